@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * arena.c : Per-thread bump allocator for lookup temporaries.
+ *
+ * Every thread owns one block which is allocated on first use and kept
+ * until the thread exits. Temporaries are carved from it and given back
+ * all at once with arena_release(), so a lookup never goes through the
+ * host's malloc unless the block overflows.
+ */
+
+#include "nss-sqlite.h"
+#include "arena.h"
+#include "stats.h"
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN sizeof(void*)
+
+struct arena_chunk {
+    struct arena_chunk* prev;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+static __thread struct arena_chunk* arena_head = NULL;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Free every chunk of an exiting thread's arena.
+ * @param p Head chunk of the arena.
+ */
+static void arena_destroy(void* p) {
+    struct arena_chunk* chunk = p;
+    while(chunk != NULL) {
+        struct arena_chunk* prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+}
+
+static void arena_key_init(void) {
+    pthread_key_create(&arena_key, arena_destroy);
+}
+
+static struct arena_chunk* arena_new_chunk(struct arena_chunk* prev, size_t size) {
+    struct arena_chunk* chunk = malloc(sizeof(*chunk) + size);
+    if(chunk == NULL) {
+        return NULL;
+    }
+    chunk->prev = prev;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+/*
+ * Return the calling thread's arena, creating its first block if needed.
+ */
+static struct arena_chunk* arena_get(void) {
+    if(arena_head == NULL) {
+        pthread_once(&arena_once, arena_key_init);
+        arena_head = arena_new_chunk(NULL, ARENA_BLOCK_SIZE);
+        pthread_setspecific(arena_key, arena_head);
+    }
+    return arena_head;
+}
+
+/*
+ * Remember current arena position. Everything allocated after this
+ * call is freed by arena_release() on the returned mark.
+ */
+arena_mark_t arena_mark(void) {
+    arena_mark_t mark;
+    mark.chunk = arena_get();
+    mark.used = mark.chunk ? mark.chunk->used : 0;
+    return mark;
+}
+
+/*
+ * Give back everything allocated since mark was taken.
+ * @param mark Position returned by arena_mark().
+ */
+void arena_release(arena_mark_t mark) {
+    while(arena_head != NULL && arena_head != mark.chunk) {
+        struct arena_chunk* prev = arena_head->prev;
+        free(arena_head);
+        arena_head = prev;
+    }
+    if(arena_head != NULL) {
+        arena_head->used = mark.used;
+    }
+    pthread_setspecific(arena_key, arena_head);
+}
+
+/*
+ * Allocate size bytes from calling thread's arena. Memory is aligned
+ * for any pointer type and lives until the enclosing arena_release().
+ * @param size Number of bytes wanted.
+ */
+void* arena_alloc(size_t size) {
+    struct arena_chunk* chunk = arena_get();
+    void* p;
+
+    if(chunk == NULL) {
+        return NULL;
+    }
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if(chunk->size - chunk->used < size) {
+        /* Block is full, chain a new one which will be freed on release */
+        size_t csize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        NSS_STAT_INC(arena_overflows);
+        if((chunk = arena_new_chunk(chunk, csize)) == NULL) {
+            return NULL;
+        }
+        arena_head = chunk;
+        pthread_setspecific(arena_key, arena_head);
+    }
+    p = chunk->data + chunk->used;
+    chunk->used += size;
+    NSS_STAT_ADD(arena_bytes, size);
+    return p;
+}
+
+/*
+ * strdup() counterpart allocating from the arena.
+ * @param s String to copy.
+ */
+char* arena_strdup(const char* s) {
+    size_t l = strlen(s) + 1;
+    char* copy = arena_alloc(l);
+    if(copy != NULL) {
+        memcpy(copy, s, l);
+    }
+    return copy;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_ARENA_H
+#define NSS_SQLITE_ARENA_H
+
+#include <stddef.h>
+
+/* Size of the block every thread keeps for its temporaries. */
+#define ARENA_BLOCK_SIZE 16384
+
+struct arena_chunk;
+
+/* Position in the calling thread's arena, see arena_mark(). */
+typedef struct {
+    struct arena_chunk* chunk;
+    size_t used;
+} arena_mark_t;
+
+arena_mark_t arena_mark(void);
+void arena_release(arena_mark_t);
+void* arena_alloc(size_t);
+char* arena_strdup(const char*);
+
+#endif
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * async.c : Lookups run by a pool of worker threads.
+ *
+ * Requests are queued by nss_sqlite_submit() and taken by workers which
+ * run them through the usual entry points, so they share the handle
+ * pools, statement caches and shared cache with blocking lookups. A
+ * worker takes every queued request of the same kind in one go: they
+ * run back to back on the same warm handle and are signalled with a
+ * single eventfd write.
+ */
+
+#include "nss-sqlite.h"
+#include "libnss-sqlite.h"
+#include "settings.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Most requests a worker takes at once */
+#define NSS_ASYNC_BATCH 64
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static struct nss_sqlite_request* queue_head = NULL;
+static struct nss_sqlite_request** queue_tail = &queue_head;
+static struct nss_sqlite_request* done_head = NULL;
+static struct nss_sqlite_request** done_tail = &done_head;
+static int async_workers = 0;
+static int async_efd = -1;
+
+/*
+ * Workers do not survive fork(), neither do the requests they had.
+ */
+static void nss_async_atfork_child(void) {
+    pthread_mutex_init(&async_lock, NULL);
+    pthread_cond_init(&async_cond, NULL);
+    queue_head = NULL;
+    queue_tail = &queue_head;
+    done_head = NULL;
+    done_tail = &done_head;
+    async_workers = 0;
+}
+
+/*
+ * Run one request through the matching entry point.
+ */
+static void nss_async_run(struct nss_sqlite_request* req) {
+    int err = 0;
+
+    switch(req->func) {
+        case NSS_SQLITE_GETPWNAM:
+            req->status = _nss_sqlite_getpwnam_r(req->name, req->result, req->buf, req->buflen, &err);
+            break;
+        case NSS_SQLITE_GETPWUID:
+            req->status = _nss_sqlite_getpwuid_r(req->id, req->result, req->buf, req->buflen, &err);
+            break;
+        case NSS_SQLITE_GETGRNAM:
+            req->status = _nss_sqlite_getgrnam_r(req->name, req->result, req->buf, req->buflen, &err);
+            break;
+        case NSS_SQLITE_GETGRGID:
+            req->status = _nss_sqlite_getgrgid_r(req->id, req->result, req->buf, req->buflen, &err);
+            break;
+        case NSS_SQLITE_GETSPNAM:
+            req->status = _nss_sqlite_getspnam_r(req->name, req->result, req->buf, req->buflen, &err);
+            break;
+    }
+    req->err = err;
+}
+
+/*
+ * Take the first queued request and those of the same kind behind it.
+ * Called with async_lock held.
+ * @param batch Filled with the requests, in submission order.
+ * @return Number of requests taken.
+ */
+static int nss_async_take(struct nss_sqlite_request** batch) {
+    struct nss_sqlite_request** preq = &queue_head;
+    int func = queue_head->func, n = 0;
+
+    while(*preq != NULL && n < NSS_ASYNC_BATCH) {
+        struct nss_sqlite_request* req = *preq;
+        if(req->func == func) {
+            *preq = req->next;
+            req->next = NULL;
+            batch[n++] = req;
+        } else {
+            preq = &req->next;
+        }
+    }
+    for(queue_tail = preq ; *queue_tail != NULL ; queue_tail = &(*queue_tail)->next);
+    return n;
+}
+
+static void* nss_async_worker(void* arg) {
+    struct nss_sqlite_request* batch[NSS_ASYNC_BATCH];
+    uint64_t one = 1;
+    int i, n, signal;
+
+    (void)arg;
+    for(;;) {
+        pthread_mutex_lock(&async_lock);
+        while(queue_head == NULL) {
+            pthread_cond_wait(&async_cond, &async_lock);
+        }
+        n = nss_async_take(batch);
+        pthread_mutex_unlock(&async_lock);
+
+        for(i = 0 ; i < n ; ++i) {
+            nss_async_run(batch[i]);
+        }
+
+        signal = FALSE;
+        pthread_mutex_lock(&async_lock);
+        for(i = 0 ; i < n ; ++i) {
+            if(batch[i]->done == NULL) {
+                *done_tail = batch[i];
+                done_tail = &batch[i]->next;
+                signal = TRUE;
+            }
+        }
+        pthread_mutex_unlock(&async_lock);
+        /* Callbacks last, they may free their request */
+        for(i = 0 ; i < n ; ++i) {
+            if(batch[i]->done != NULL) {
+                batch[i]->done(batch[i]);
+            }
+        }
+        if(signal && write(async_efd, &one, sizeof(one)) < 0) {
+            NSS_ERROR("async: eventfd: %m\n");
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start the workers and the eventfd on first use. Called with async_lock
+ * held.
+ * @return FALSE if no worker could be started.
+ */
+static int nss_async_start(void) {
+    static int registered = FALSE;
+    long threads = nss_settings()->async_threads;
+    sigset_t all, old;
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    if(!registered) {
+        pthread_atfork(NULL, NULL, nss_async_atfork_child);
+        registered = TRUE;
+    }
+    if(async_efd < 0 && (async_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        NSS_ERROR("async: eventfd: %m\n");
+        return FALSE;
+    }
+
+    /* Signals of the host are not ours to receive */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while(async_workers < threads &&
+          pthread_create(&tid, &attr, nss_async_worker, NULL) == 0) {
+        async_workers++;
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return async_workers > 0;
+}
+
+/*
+ * Queue a lookup for the workers, starting them on first use.
+ * @param req Request, owned by the workers until it completes.
+ */
+int nss_sqlite_submit(struct nss_sqlite_request* req) {
+    int ok;
+
+    if(req->func < NSS_SQLITE_GETPWNAM || req->func > NSS_SQLITE_GETSPNAM ||
+       req->result == NULL || req->buf == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    req->next = NULL;
+
+    pthread_mutex_lock(&async_lock);
+    if((ok = async_workers > 0 || nss_async_start())) {
+        *queue_tail = req;
+        queue_tail = &req->next;
+        pthread_cond_signal(&async_cond);
+    }
+    pthread_mutex_unlock(&async_lock);
+    if(!ok) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * eventfd signalled when requests without callback complete.
+ */
+int nss_sqlite_async_fd(void) {
+    pthread_mutex_lock(&async_lock);
+    if(async_efd < 0 && (async_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        NSS_ERROR("async: eventfd: %m\n");
+    }
+    pthread_mutex_unlock(&async_lock);
+    return async_efd;
+}
+
+/*
+ * Hand completed requests without callback over to the caller. The
+ * eventfd is read first so that requests completing meanwhile signal it
+ * again.
+ */
+struct nss_sqlite_request* nss_sqlite_completed(void) {
+    struct nss_sqlite_request* list;
+    uint64_t count;
+
+    if(async_efd >= 0 && read(async_efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        NSS_ERROR("async: eventfd: %m\n");
+    }
+    pthread_mutex_lock(&async_lock);
+    list = done_head;
+    done_head = NULL;
+    done_tail = &done_head;
+    pthread_mutex_unlock(&async_lock);
+    return list;
+}
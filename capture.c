@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * capture.c : Record lookups for later replay.
+ *
+ * With capture_dir set, each process maps its own capture file,
+ * <capture_dir>/nss-sqlite.<pid>.<time>.cap, of capture_bytes bytes and
+ * appends a record per _nss_sqlite_* call to it. Records hold names
+ * looked up, so files are created mode 0600.
+ */
+
+#include "nss-sqlite.h"
+#include "capture.h"
+#include "settings.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Capture states */
+#define CAP_UNKNOWN 0
+#define CAP_ON      1
+#define CAP_OFF     2
+
+static int cap_state = CAP_UNKNOWN;
+static pthread_mutex_t cap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nss_capture_header* cap_header = NULL;
+static struct nss_capture_record* cap_ring = NULL;
+static size_t cap_size = 0;
+static int64_t cap_offset;      /* CLOCK_REALTIME - CLOCK_MONOTONIC */
+
+static uint64_t nss_capture_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * A forked child gets its own file, on its first call.
+ */
+static void nss_capture_atfork_child(void) {
+    pthread_mutex_init(&cap_lock, NULL);
+    if(cap_header != NULL) {
+        munmap(cap_header, cap_size);
+        cap_header = NULL;
+        cap_ring = NULL;
+    }
+    cap_state = CAP_UNKNOWN;
+}
+
+/*
+ * Create and map the capture file of this process.
+ * @return New capture state.
+ */
+static int nss_capture_open(void) {
+    const struct nss_settings* settings = nss_settings();
+    struct timespec real;
+    char path[PATH_MAX];
+    uint64_t capacity;
+    void* map;
+    int fd;
+
+    if(settings->capture_dir == NULL) {
+        return CAP_OFF;
+    }
+    capacity = (settings->capture_bytes - sizeof(struct nss_capture_header)) / sizeof(struct nss_capture_record);
+    if(settings->capture_bytes < (long)sizeof(struct nss_capture_header) || capacity == 0) {
+        NSS_ERROR("capture_bytes is too small\n");
+        return CAP_OFF;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &real);
+    if(snprintf(path, sizeof(path), "%s/nss-sqlite.%d.%ld.cap", settings->capture_dir,
+                (int)getpid(), (long)real.tv_sec) >= (int)sizeof(path)) {
+        return CAP_OFF;
+    }
+    if((fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0600)) < 0) {
+        NSS_ERROR("%s: %m\n", path);
+        return CAP_OFF;
+    }
+    cap_size = sizeof(struct nss_capture_header) + capacity * sizeof(struct nss_capture_record);
+    if(ftruncate(fd, cap_size) != 0
+       || (map = mmap(NULL, cap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        NSS_ERROR("%s: %m\n", path);
+        close(fd);
+        unlink(path);
+        return CAP_OFF;
+    }
+    close(fd);
+
+    cap_header = map;
+    cap_ring = (struct nss_capture_record*)(cap_header + 1);
+    memcpy(cap_header->magic, NSS_CAPTURE_MAGIC, sizeof(cap_header->magic));
+    cap_header->record_size = sizeof(struct nss_capture_record);
+    cap_header->pid = getpid();
+    cap_header->capacity = capacity;
+    cap_header->head = 0;
+    cap_offset = (int64_t)((uint64_t)real.tv_sec * 1000000000 + real.tv_nsec) - (int64_t)nss_capture_now();
+    return CAP_ON;
+}
+
+/*
+ * Start timing a call.
+ * @return Start time to give to nss_capture(), 0 if not capturing.
+ */
+uint64_t nss_capture_start(void) {
+    int state = __atomic_load_n(&cap_state, __ATOMIC_ACQUIRE);
+
+    if(state == CAP_UNKNOWN) {
+        pthread_mutex_lock(&cap_lock);
+        if((state = cap_state) == CAP_UNKNOWN) {
+            static int registered = FALSE;
+            if(!registered) {
+                pthread_atfork(NULL, NULL, nss_capture_atfork_child);
+                registered = TRUE;
+            }
+            state = nss_capture_open();
+            __atomic_store_n(&cap_state, state, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&cap_lock);
+    }
+    return state == CAP_ON ? nss_capture_now() : 0;
+}
+
+/*
+ * Append a call to the capture file.
+ * @param func enum nss_capture_func.
+ * @param key Name looked up, NULL for calls by id.
+ * @param id uid or gid looked up.
+ * @param buflen Caller's buffer size.
+ * @param status Status returned to the caller.
+ * @param start Value returned by nss_capture_start().
+ */
+void nss_capture(int func, const char* key, uint32_t id, size_t buflen, int status, uint64_t start) {
+    struct nss_capture_record* rec;
+    uint64_t latency, slot;
+
+    if(start == 0) {
+        return;
+    }
+    latency = nss_capture_now() - start;
+    slot = __atomic_fetch_add(&cap_header->head, 1, __ATOMIC_RELAXED) % cap_header->capacity;
+    rec = &cap_ring[slot];
+    rec->time_ns = start + cap_offset;
+    rec->latency_ns = latency > UINT32_MAX ? UINT32_MAX : latency;
+    rec->buflen = buflen > UINT32_MAX ? UINT32_MAX : buflen;
+    rec->id = id;
+    rec->func = func;
+    rec->status = status;
+    if(key != NULL) {
+        strncpy(rec->key, key, sizeof(rec->key) - 1);
+        rec->key[sizeof(rec->key) - 1] = '\0';
+    } else {
+        memset(rec->key, 0, sizeof(rec->key));
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Layout of capture files, shared by the module and nss-sqlite-replay.
+ *
+ * A capture file is a header followed by a ring of fixed size records.
+ * head counts every record ever written, record i lives in slot
+ * i % capacity, so the file holds the last capacity calls.
+ */
+
+#ifndef NSS_SQLITE_CAPTURE_H
+#define NSS_SQLITE_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NSS_CAPTURE_MAGIC "NSSCAP1"
+
+/* Captured functions */
+enum nss_capture_func {
+    NSS_CAP_SETPWENT = 1,
+    NSS_CAP_ENDPWENT,
+    NSS_CAP_GETPWENT,
+    NSS_CAP_GETPWNAM,
+    NSS_CAP_GETPWUID,
+    NSS_CAP_SETGRENT,
+    NSS_CAP_ENDGRENT,
+    NSS_CAP_GETGRENT,
+    NSS_CAP_GETGRNAM,
+    NSS_CAP_GETGRGID,
+    NSS_CAP_INITGROUPS,
+    NSS_CAP_SETSPENT,
+    NSS_CAP_ENDSPENT,
+    NSS_CAP_GETSPENT,
+    NSS_CAP_GETSPNAM,
+    NSS_CAP_MAX
+};
+
+struct nss_capture_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t pid;
+    uint64_t capacity;          /* number of record slots */
+    uint64_t head;              /* number of records written */
+    uint8_t pad[32];
+};
+
+struct nss_capture_record {
+    uint64_t time_ns;           /* call start, ns since the Epoch */
+    uint32_t latency_ns;        /* saturates at UINT32_MAX */
+    uint32_t buflen;            /* caller's buffer size, or initgroups'
+                                   limit */
+    uint32_t id;                /* uid, gid, or initgroups' gid */
+    uint16_t func;              /* enum nss_capture_func */
+    int16_t status;             /* enum nss_status */
+    char key[40];               /* name, truncated, NUL padded */
+};
+
+uint64_t nss_capture_start(void);
+void nss_capture(int, const char*, uint32_t, size_t, int, uint64_t);
+
+#endif
@@ -1,11 +1,102 @@
-CREATE TABLE passwd(uid INTEGER PRIMARY KEY, username TEXT NOT NULL, passwd TEXT NOT NULL, gid INTEGER, gecos TEXT NOT NULL default ',,,', homedir TEXT NOT NULL, shell TEXT NOT NULL);
+CREATE TABLE passwd(uid INTEGER PRIMARY KEY, username TEXT NOT NULL, passwd TEXT NOT NULL, gid INTEGER, gecos TEXT NOT NULL default ',,,', homedir TEXT NOT NULL, shell TEXT NOT NULL, packed BLOB);
 CREATE INDEX idx_passwd_username ON passwd(username);
 
 CREATE TABLE user_group(uid INTEGER, gid INTEGER, CONSTRAINT pk_user_groups PRIMARY KEY(uid, gid));
 CREATE INDEX idx_ug_uid ON user_group(uid);
 CREATE INDEX idx_ug_gid ON user_group(gid);
 
-CREATE TABLE groups(gid INTEGER PRIMARY KEY, groupname TEXT NOT NULL, passwd TEXT NOT NULL DEFAULT '');
+-- Nested groups: members of group member_gid are members of group gid
+-- too. Cycles are refused. group_closure holds every pair of groups one
+-- contains the other, however deep, and user_group_closure every group
+-- a user belongs to, directly or through nesting; paths counts the ways
+-- a pair is reached so that removing one of them is undone exactly.
+-- Both are kept up to date by the triggers below and let memberships be
+-- read with a single index range whatever the depth of nesting.
+CREATE TABLE group_nesting(gid INTEGER, member_gid INTEGER, CONSTRAINT pk_group_nesting PRIMARY KEY(gid, member_gid));
+CREATE INDEX idx_gn_member_gid ON group_nesting(member_gid);
+
+CREATE TABLE group_closure(gid INTEGER, member_gid INTEGER, paths INTEGER NOT NULL, CONSTRAINT pk_group_closure PRIMARY KEY(gid, member_gid));
+CREATE INDEX idx_gc_member_gid ON group_closure(member_gid);
+
+CREATE TABLE user_group_closure(uid INTEGER, gid INTEGER, paths INTEGER NOT NULL, CONSTRAINT pk_user_group_closure PRIMARY KEY(uid, gid));
+CREATE INDEX idx_ugc_gid ON user_group_closure(gid, uid);
+
+CREATE TRIGGER group_nesting_check BEFORE INSERT ON group_nesting
+WHEN NEW.gid = NEW.member_gid OR EXISTS (SELECT 1 FROM group_closure WHERE gid = NEW.member_gid AND member_gid = NEW.gid)
+BEGIN
+    SELECT RAISE(ABORT, 'group nesting cycle');
+END;
+
+CREATE TRIGGER group_nesting_update BEFORE UPDATE ON group_nesting
+BEGIN
+    SELECT RAISE(ABORT, 'delete and insert group_nesting rows instead');
+END;
+
+CREATE TRIGGER group_nesting_insert AFTER INSERT ON group_nesting
+BEGIN
+    INSERT INTO group_closure(gid, member_gid, paths)
+        SELECT a.gid, d.member_gid, a.paths * d.paths
+        FROM (SELECT gid, paths FROM group_closure WHERE member_gid = NEW.gid UNION ALL SELECT NEW.gid, 1) a,
+             (SELECT member_gid, paths FROM group_closure WHERE gid = NEW.member_gid UNION ALL SELECT NEW.member_gid, 1) d
+        WHERE true
+        ON CONFLICT(gid, member_gid) DO UPDATE SET paths = paths + excluded.paths;
+    INSERT INTO user_group_closure(uid, gid, paths)
+        SELECT u.uid, a.gid, u.paths * a.paths
+        FROM (SELECT uid, paths FROM user_group_closure WHERE gid = NEW.member_gid) u,
+             (SELECT gid, paths FROM group_closure WHERE member_gid = NEW.gid UNION ALL SELECT NEW.gid, 1) a
+        WHERE true
+        ON CONFLICT(uid, gid) DO UPDATE SET paths = paths + excluded.paths;
+END;
+
+CREATE TRIGGER group_nesting_delete AFTER DELETE ON group_nesting
+BEGIN
+    UPDATE group_closure SET paths = paths - (
+            SELECT a.paths * d.paths
+            FROM (SELECT paths FROM group_closure x WHERE x.gid = group_closure.gid AND x.member_gid = OLD.gid UNION ALL SELECT 1 WHERE group_closure.gid = OLD.gid) a,
+                 (SELECT paths FROM group_closure x WHERE x.gid = OLD.member_gid AND x.member_gid = group_closure.member_gid UNION ALL SELECT 1 WHERE group_closure.member_gid = OLD.member_gid) d)
+        WHERE gid IN (SELECT gid FROM group_closure WHERE member_gid = OLD.gid UNION ALL SELECT OLD.gid)
+          AND member_gid IN (SELECT member_gid FROM group_closure WHERE gid = OLD.member_gid UNION ALL SELECT OLD.member_gid);
+    UPDATE user_group_closure SET paths = paths - (
+            SELECT u.paths * a.paths
+            FROM (SELECT paths FROM user_group_closure x WHERE x.uid = user_group_closure.uid AND x.gid = OLD.member_gid) u,
+                 (SELECT paths FROM group_closure WHERE gid = user_group_closure.gid AND member_gid = OLD.gid UNION ALL SELECT 1 WHERE user_group_closure.gid = OLD.gid) a)
+        WHERE gid IN (SELECT gid FROM group_closure WHERE member_gid = OLD.gid UNION ALL SELECT OLD.gid)
+          AND uid IN (SELECT uid FROM user_group_closure WHERE gid = OLD.member_gid);
+    DELETE FROM user_group_closure WHERE paths <= 0
+        AND gid IN (SELECT gid FROM group_closure WHERE member_gid = OLD.gid UNION ALL SELECT OLD.gid);
+    DELETE FROM group_closure WHERE paths <= 0
+        AND gid IN (SELECT gid FROM group_closure WHERE member_gid = OLD.gid UNION ALL SELECT OLD.gid);
+END;
+
+CREATE TRIGGER user_group_closure_insert AFTER INSERT ON user_group
+BEGIN
+    INSERT INTO user_group_closure(uid, gid, paths)
+        SELECT NEW.uid, gid, paths FROM (SELECT gid, paths FROM group_closure WHERE member_gid = NEW.gid UNION ALL SELECT NEW.gid, 1)
+        WHERE true
+        ON CONFLICT(uid, gid) DO UPDATE SET paths = paths + excluded.paths;
+END;
+
+CREATE TRIGGER user_group_closure_delete AFTER DELETE ON user_group
+BEGIN
+    UPDATE user_group_closure SET paths = paths - (
+            SELECT paths FROM group_closure WHERE gid = user_group_closure.gid AND member_gid = OLD.gid UNION ALL SELECT 1 WHERE user_group_closure.gid = OLD.gid)
+        WHERE uid = OLD.uid AND gid IN (SELECT gid FROM group_closure WHERE member_gid = OLD.gid UNION ALL SELECT OLD.gid);
+    DELETE FROM user_group_closure WHERE uid = OLD.uid AND paths <= 0;
+END;
+
+CREATE TRIGGER user_group_closure_update AFTER UPDATE OF uid, gid ON user_group
+BEGIN
+    UPDATE user_group_closure SET paths = paths - (
+            SELECT paths FROM group_closure WHERE gid = user_group_closure.gid AND member_gid = OLD.gid UNION ALL SELECT 1 WHERE user_group_closure.gid = OLD.gid)
+        WHERE uid = OLD.uid AND gid IN (SELECT gid FROM group_closure WHERE member_gid = OLD.gid UNION ALL SELECT OLD.gid);
+    DELETE FROM user_group_closure WHERE uid = OLD.uid AND paths <= 0;
+    INSERT INTO user_group_closure(uid, gid, paths)
+        SELECT NEW.uid, gid, paths FROM (SELECT gid, paths FROM group_closure WHERE member_gid = NEW.gid UNION ALL SELECT NEW.gid, 1)
+        WHERE true
+        ON CONFLICT(uid, gid) DO UPDATE SET paths = paths + excluded.paths;
+END;
+
+CREATE TABLE groups(gid INTEGER PRIMARY KEY, groupname TEXT NOT NULL, passwd TEXT NOT NULL DEFAULT '', packed BLOB);
 CREATE INDEX idx_groupname ON groups(groupname);
 
 CREATE TABLE nss_queries(name TEXT PRIMARY KEY, query TEXT NOT NULL);
@@ -18,5 +109,139 @@ INSERT INTO nss_queries VALUES("setgrent",   "SELECT gid, groupname, passwd FROM
 INSERT INTO nss_queries VALUES("getgrnam_r", "SELECT gid, groupname, passwd FROM groups WHERE groupname = ?");
 INSERT INTO nss_queries VALUES("getgrgid_r", "SELECT gid, groupname, passwd FROM groups WHERE gid = ?");
 
-INSERT INTO nss_queries VALUES("initgroups_dyn", "SELECT ug.gid FROM user_group ug INNER JOIN passwd p ON p.uid = ug.uid WHERE p.username = ? AND ug.gid != ?");
-INSERT INTO nss_queries VALUES("get_users", "SELECT username FROM passwd u INNER JOIN user_group ug ON ug.uid = u.uid WHERE ug.gid = ?");
+INSERT INTO nss_queries VALUES("initgroups_dyn", "SELECT ug.gid FROM user_group_closure ug INNER JOIN passwd p ON p.uid = ug.uid WHERE p.username = ? AND ug.gid != ?");
+INSERT INTO nss_queries VALUES("get_users", "SELECT username FROM passwd u INNER JOIN user_group_closure ug ON ug.uid = u.uid WHERE ug.gid = ?");
+
+-- Used by nss_sqlite_members_next(), nss_sqlite_is_member() and
+-- nss_sqlite_count_members() of libnss-sqlite.h. get_members_page
+-- returns members of gid ?1 with a uid above ?2, in uid order, along
+-- with that uid; it is stopped once the caller's buffer is full.
+INSERT INTO nss_queries VALUES("get_members_page", "SELECT u.username, ug.uid FROM user_group_closure ug INNER JOIN passwd u ON u.uid = ug.uid WHERE ug.gid = ? AND ug.uid > ? ORDER BY ug.uid");
+INSERT INTO nss_queries VALUES("is_member", "SELECT 1 FROM user_group_closure WHERE uid = (SELECT uid FROM passwd WHERE username = ?) AND gid = ?");
+INSERT INTO nss_queries VALUES("count_members", "SELECT member_count FROM group_members WHERE gid = ?");
+
+-- Keyset paginated walks used by getpwent/getgrent: ?1 is the last key
+-- returned (uid, resp. gid, read from the same column as in setpwent and
+-- setgrent) and ?2 the page size. When missing, setpwent and setgrent are
+-- used instead and hold a read transaction for the whole walk.
+INSERT INTO nss_queries VALUES("getpwent_page", "SELECT username, passwd, uid, gid, gecos, homedir, shell FROM passwd WHERE uid > ? ORDER BY uid LIMIT ?");
+INSERT INTO nss_queries VALUES("getgrent_page", "SELECT gid, groupname, passwd FROM groups WHERE gid > ? ORDER BY gid LIMIT ?");
+
+-- Packed members: one row per group holding the number of members and
+-- their names, each followed by a NUL byte, nested members included.
+-- Kept up to date by the triggers below, get_members lets group lookups
+-- read a whole group at once instead of one row per member. Delete the
+-- get_members query to go back to get_users. To fill it for an existing
+-- database:
+--   DELETE FROM group_members;
+--   INSERT INTO group_members SELECT ug.gid, count(*), CAST(group_concat(p.username || x'00', '') AS BLOB) FROM user_group_closure ug INNER JOIN passwd p ON p.uid = ug.uid GROUP BY ug.gid;
+CREATE TABLE group_members(gid INTEGER PRIMARY KEY, member_count INTEGER NOT NULL DEFAULT 0, members BLOB NOT NULL DEFAULT x'');
+INSERT INTO nss_queries VALUES("get_members", "SELECT member_count, members FROM group_members WHERE gid = ?");
+
+CREATE TRIGGER group_members_ug_insert AFTER INSERT ON user_group_closure
+WHEN EXISTS (SELECT 1 FROM passwd WHERE uid = NEW.uid)
+BEGIN
+    INSERT OR IGNORE INTO group_members(gid) VALUES(NEW.gid);
+    UPDATE group_members SET member_count = member_count + 1,
+        members = CAST(members || (SELECT username FROM passwd WHERE uid = NEW.uid) || x'00' AS BLOB)
+        WHERE gid = NEW.gid;
+END;
+
+CREATE TRIGGER group_members_ug_delete AFTER DELETE ON user_group_closure
+WHEN EXISTS (SELECT 1 FROM passwd WHERE uid = OLD.uid)
+BEGIN
+    UPDATE group_members SET member_count = member_count - 1,
+        members = CAST(substr(members, 1, instr(CAST(x'00' || members AS BLOB), CAST(x'00' || (SELECT username FROM passwd WHERE uid = OLD.uid) || x'00' AS BLOB)) - 1)
+            || substr(members, instr(CAST(x'00' || members AS BLOB), CAST(x'00' || (SELECT username FROM passwd WHERE uid = OLD.uid) || x'00' AS BLOB)) + length(CAST((SELECT username FROM passwd WHERE uid = OLD.uid) AS BLOB)) + 1) AS BLOB)
+        WHERE gid = OLD.gid AND instr(CAST(x'00' || members AS BLOB), CAST(x'00' || (SELECT username FROM passwd WHERE uid = OLD.uid) || x'00' AS BLOB)) > 0;
+    DELETE FROM group_members WHERE gid = OLD.gid AND member_count <= 0;
+END;
+
+CREATE TRIGGER group_members_passwd_insert AFTER INSERT ON passwd
+BEGIN
+    INSERT OR IGNORE INTO group_members(gid) SELECT gid FROM user_group_closure WHERE uid = NEW.uid;
+    UPDATE group_members SET member_count = member_count + 1,
+        members = CAST(members || NEW.username || x'00' AS BLOB)
+        WHERE gid IN (SELECT gid FROM user_group_closure WHERE uid = NEW.uid);
+END;
+
+CREATE TRIGGER group_members_passwd_delete AFTER DELETE ON passwd
+BEGIN
+    UPDATE group_members SET member_count = member_count - 1,
+        members = CAST(substr(members, 1, instr(CAST(x'00' || members AS BLOB), CAST(x'00' || OLD.username || x'00' AS BLOB)) - 1)
+            || substr(members, instr(CAST(x'00' || members AS BLOB), CAST(x'00' || OLD.username || x'00' AS BLOB)) + length(CAST(OLD.username AS BLOB)) + 1) AS BLOB)
+        WHERE gid IN (SELECT gid FROM user_group_closure WHERE uid = OLD.uid) AND instr(CAST(x'00' || members AS BLOB), CAST(x'00' || OLD.username || x'00' AS BLOB)) > 0;
+    DELETE FROM group_members WHERE member_count <= 0 AND gid IN (SELECT gid FROM user_group_closure WHERE uid = OLD.uid);
+END;
+
+CREATE TRIGGER group_members_passwd_update AFTER UPDATE OF uid, username ON passwd
+BEGIN
+    UPDATE group_members SET member_count = member_count - 1,
+        members = CAST(substr(members, 1, instr(CAST(x'00' || members AS BLOB), CAST(x'00' || OLD.username || x'00' AS BLOB)) - 1)
+            || substr(members, instr(CAST(x'00' || members AS BLOB), CAST(x'00' || OLD.username || x'00' AS BLOB)) + length(CAST(OLD.username AS BLOB)) + 1) AS BLOB)
+        WHERE gid IN (SELECT gid FROM user_group_closure WHERE uid = OLD.uid) AND instr(CAST(x'00' || members AS BLOB), CAST(x'00' || OLD.username || x'00' AS BLOB)) > 0;
+    DELETE FROM group_members WHERE member_count <= 0 AND gid IN (SELECT gid FROM user_group_closure WHERE uid = OLD.uid);
+    INSERT OR IGNORE INTO group_members(gid) SELECT gid FROM user_group_closure WHERE uid = NEW.uid;
+    UPDATE group_members SET member_count = member_count + 1,
+        members = CAST(members || NEW.username || x'00' AS BLOB)
+        WHERE gid IN (SELECT gid FROM user_group_closure WHERE uid = NEW.uid);
+END;
+
+-- Serialized rows: packed holds the entry laid out as it is copied in
+-- the caller's buffer, so that the *_packed queries below let point
+-- lookups read a single value and copy it at once. It starts with a
+-- header of decimal numbers separated by ':' and ended by a NUL byte,
+-- "uid:gid:passwd:gecos:dir:shell" for passwd and "gid:passwd" for
+-- groups, where names are the offsets of those strings after the
+-- header, then come the strings, each followed by a NUL byte. Rows
+-- whose packed is NULL, because of a NULL field or because it was
+-- never filled, are read column by column. Delete the *_packed queries
+-- to always do so. Setting packed to NULL rebuilds it:
+--   UPDATE passwd SET packed = NULL; UPDATE groups SET packed = NULL;
+INSERT INTO nss_queries VALUES("getpwnam_r_packed", "SELECT packed FROM passwd WHERE username = ?");
+INSERT INTO nss_queries VALUES("getpwuid_r_packed", "SELECT packed FROM passwd WHERE uid = ?");
+INSERT INTO nss_queries VALUES("getgrnam_r_packed", "SELECT packed FROM groups WHERE groupname = ?");
+INSERT INTO nss_queries VALUES("getgrgid_r_packed", "SELECT packed FROM groups WHERE gid = ?");
+
+CREATE TRIGGER passwd_packed_insert AFTER INSERT ON passwd
+BEGIN
+    UPDATE passwd SET packed = CAST(uid || ':' || gid || ':' || (length(CAST(username AS BLOB)) + 1) || ':' || (length(CAST(username AS BLOB)) + length(CAST(passwd AS BLOB)) + 2) || ':'
+        || (length(CAST(username AS BLOB)) + length(CAST(passwd AS BLOB)) + length(CAST(gecos AS BLOB)) + 3) || ':'
+        || (length(CAST(username AS BLOB)) + length(CAST(passwd AS BLOB)) + length(CAST(gecos AS BLOB)) + length(CAST(homedir AS BLOB)) + 4)
+        || x'00' || username || x'00' || passwd || x'00' || gecos || x'00' || homedir || x'00' || shell || x'00' AS BLOB)
+        WHERE rowid = NEW.rowid;
+END;
+
+CREATE TRIGGER passwd_packed_update AFTER UPDATE OF username, passwd, uid, gid, gecos, homedir, shell, packed ON passwd
+WHEN NEW.packed IS OLD.packed OR NEW.packed IS NULL
+BEGIN
+    UPDATE passwd SET packed = CAST(uid || ':' || gid || ':' || (length(CAST(username AS BLOB)) + 1) || ':' || (length(CAST(username AS BLOB)) + length(CAST(passwd AS BLOB)) + 2) || ':'
+        || (length(CAST(username AS BLOB)) + length(CAST(passwd AS BLOB)) + length(CAST(gecos AS BLOB)) + 3) || ':'
+        || (length(CAST(username AS BLOB)) + length(CAST(passwd AS BLOB)) + length(CAST(gecos AS BLOB)) + length(CAST(homedir AS BLOB)) + 4)
+        || x'00' || username || x'00' || passwd || x'00' || gecos || x'00' || homedir || x'00' || shell || x'00' AS BLOB)
+        WHERE rowid = NEW.rowid;
+END;
+
+CREATE TRIGGER groups_packed_insert AFTER INSERT ON groups
+BEGIN
+    UPDATE groups SET packed = CAST(gid || ':' || (length(CAST(groupname AS BLOB)) + 1) || x'00' || groupname || x'00' || passwd || x'00' AS BLOB)
+        WHERE rowid = NEW.rowid;
+END;
+
+CREATE TRIGGER groups_packed_update AFTER UPDATE OF groupname, passwd, gid, packed ON groups
+WHEN NEW.packed IS OLD.packed OR NEW.packed IS NULL
+BEGIN
+    UPDATE groups SET packed = CAST(gid || ':' || (length(CAST(groupname AS BLOB)) + 1) || x'00' || groupname || x'00' || passwd || x'00' AS BLOB)
+        WHERE rowid = NEW.rowid;
+END;
+
+-- Sharding: when not empty, entries are spread over the listed database
+-- files, each with this same schema. 'id' rows route uid/gid ranges,
+-- 'name' rows route ranges of the 32 bit FNV-1a hash of the name. Keys
+-- matched by no row stay in this file. An empty path means this file.
+CREATE TABLE nss_shards(shard INTEGER PRIMARY KEY, path TEXT NOT NULL, kind TEXT NOT NULL CHECK (kind IN ('id', 'name')), lo INTEGER NOT NULL, hi INTEGER NOT NULL);
+
+-- Maintained by nss-sqlite-sync: generation is bumped by each applied
+-- changeset.
+CREATE TABLE nss_generation(id INTEGER PRIMARY KEY CHECK (id = 0), generation INTEGER NOT NULL);
+INSERT INTO nss_generation VALUES(0, 0);
@@ -1,5 +1,40 @@
-CREATE TABLE shadow (username TEXT PRIMARY KEY, passwd TEXT, lastchange INTEGER default -1, mindays INTEGER default -1, maxdays INTEGER default -1, warn INTEGER default -1, inact INTEGER default -1, expire INTEGER default -1);
+CREATE TABLE shadow (username TEXT PRIMARY KEY, passwd TEXT, lastchange INTEGER default -1, mindays INTEGER default -1, maxdays INTEGER default -1, warn INTEGER default -1, inact INTEGER default -1, expire INTEGER default -1, packed BLOB);
 
 CREATE TABLE nss_queries(name TEXT PRIMARY KEY, query TEXT NOT NULL);
 INSERT INTO nss_queries VALUES("setspent",  "SELECT username, passwd, lastchange, mindays, maxdays, warn, inact, expire FROM shadow");
 INSERT INTO nss_queries VALUES("getspnam_r","SELECT username, passwd, lastchange, mindays, maxdays, warn, inact, expire FROM shadow WHERE username = ?");
+
+-- Keyset paginated walk used by getspent: ?1 is the last username returned
+-- and ?2 the page size. When missing, setspent is used instead and holds a
+-- read transaction for the whole walk.
+INSERT INTO nss_queries VALUES("getspent_page", "SELECT username, passwd, lastchange, mindays, maxdays, warn, inact, expire FROM shadow WHERE username > ? ORDER BY username LIMIT ?");
+
+-- Serialized rows, as in passwd.sql, with header
+-- "lstchg:min:max:warn:inact:expire:passwd".
+INSERT INTO nss_queries VALUES("getspnam_r_packed", "SELECT packed FROM shadow WHERE username = ?");
+
+CREATE TRIGGER shadow_packed_insert AFTER INSERT ON shadow
+BEGIN
+    UPDATE shadow SET packed = CAST(lastchange || ':' || mindays || ':' || maxdays || ':' || warn || ':' || inact || ':' || expire || ':' || (length(CAST(username AS BLOB)) + 1)
+        || x'00' || username || x'00' || passwd || x'00' AS BLOB)
+        WHERE rowid = NEW.rowid;
+END;
+
+CREATE TRIGGER shadow_packed_update AFTER UPDATE OF username, passwd, lastchange, mindays, maxdays, warn, inact, expire, packed ON shadow
+WHEN NEW.packed IS OLD.packed OR NEW.packed IS NULL
+BEGIN
+    UPDATE shadow SET packed = CAST(lastchange || ':' || mindays || ':' || maxdays || ':' || warn || ':' || inact || ':' || expire || ':' || (length(CAST(username AS BLOB)) + 1)
+        || x'00' || username || x'00' || passwd || x'00' AS BLOB)
+        WHERE rowid = NEW.rowid;
+END;
+
+-- Sharding: when not empty, entries are spread over the listed database
+-- files, each with this same schema. 'id' rows route uid/gid ranges,
+-- 'name' rows route ranges of the 32 bit FNV-1a hash of the name. Keys
+-- matched by no row stay in this file. An empty path means this file.
+CREATE TABLE nss_shards(shard INTEGER PRIMARY KEY, path TEXT NOT NULL, kind TEXT NOT NULL CHECK (kind IN ('id', 'name')), lo INTEGER NOT NULL, hi INTEGER NOT NULL);
+
+-- Maintained by nss-sqlite-sync: generation is bumped by each applied
+-- changeset.
+CREATE TABLE nss_generation(id INTEGER PRIMARY KEY CHECK (id = 0), generation INTEGER NOT NULL);
+INSERT INTO nss_generation VALUES(0, 0);
@@ -0,0 +1,844 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * db.c : Pool of database handles and of their compiled statements.
+ *
+ * Opening a database, reading its schema and compiling the nss_queries
+ * statements costs far more than the lookup itself, so handles are kept
+ * around once a lookup is done. Each handle gets its own preallocated
+ * lookaside buffer so that SQLite's small allocations stay out of the
+ * host's malloc.
+ *
+ * Where memory matters more than latency (thousands of processes per
+ * host each keeping their own handles), the memory_limit, cache_size,
+ * mmap_size, max_idle and idle_timeout settings trade it back: SQLite's
+ * heap is capped, pages come from the shared file mapping instead of a
+ * private cache, and handles nobody used for a while are closed.
+ */
+
+#include "nss-sqlite.h"
+#include "arena.h"
+#include "libnss-sqlite.h"
+#include "probes.h"
+#include "settings.h"
+#include "slowlog.h"
+#include "db.h"
+#include "stats.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+struct nss_db_pool {
+    char* path;
+    pthread_mutex_t lock;
+    dev_t dev;          /* identity of the file currently at path */
+    ino_t ino;
+    struct nss_db* idle;
+    int nidle;
+    int failures;       /* consecutive failed accesses */
+    time_t retry_at;    /* once tripped, next access let through */
+    int trip_errno;     /* stat() of the file when last let through */
+    struct stat trip_st;
+};
+
+static struct nss_db_pool pools[NSS_DB_MAX_POOLS];
+static int npools = 0;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Footprint accounting, see nss_db_footprint() */
+static long long nss_db_handles = 0;
+static long long nss_db_lookaside_bytes = 0;
+
+/* Deadline of the calling thread's current lookup, 0 outside lookups */
+static __thread int deadline_depth = 0;
+static __thread uint64_t deadline_at = 0;
+
+/* Idle handles reaper, runs only while some handle is idle */
+static pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static int reaper_running = FALSE;
+
+/*
+ * Child side of fork(). Handles inherited from parent must not be used
+ * (nor closed, that would drop parent's locks), just forget them.
+ */
+static void nss_db_atfork_child(void) {
+    int i;
+    pthread_mutex_init(&pools_lock, NULL);
+    pthread_mutex_init(&reaper_lock, NULL);
+    reaper_running = FALSE;
+    for(i = 0 ; i < npools ; ++i) {
+        pthread_mutex_init(&pools[i].lock, NULL);
+        pools[i].idle = NULL;
+        pools[i].nidle = 0;
+    }
+}
+
+/*
+ * Find pool for given database file, creating it if needed.
+ * @param path Database file name.
+ */
+static struct nss_db_pool* nss_db_pool_get(const char* path) {
+    struct nss_db_pool* pool = NULL;
+    int i, n = __atomic_load_n(&npools, __ATOMIC_ACQUIRE);
+
+    for(i = 0 ; i < n ; ++i) {
+        if(strcmp(pools[i].path, path) == 0) {
+            return &pools[i];
+        }
+    }
+
+    pthread_mutex_lock(&pools_lock);
+    for(i = 0 ; i < npools ; ++i) {
+        if(strcmp(pools[i].path, path) == 0) {
+            pool = &pools[i];
+            break;
+        }
+    }
+    if(pool == NULL && npools < NSS_DB_MAX_POOLS) {
+        if(npools == 0) {
+            pthread_atfork(NULL, NULL, nss_db_atfork_child);
+        }
+        pool = &pools[npools];
+        pool->path = strdup(path);
+        pthread_mutex_init(&pool->lock, NULL);
+        __atomic_store_n(&npools, npools + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pools_lock);
+
+    if(pool == NULL) {
+        NSS_ERROR("Too many databases, %s not pooled\n", path);
+    }
+    return pool;
+}
+
+/*
+ * Get a copy of a database file name which lives as long as the
+ * process does.
+ * @param path Database file name.
+ */
+const char* nss_db_intern(const char* path) {
+    struct nss_db_pool* pool = nss_db_pool_get(path);
+    return pool ? pool->path : NULL;
+}
+
+/*
+ * Database file name a handle was acquired for.
+ * @param db DB handle.
+ */
+const char* nss_db_path(const struct nss_db* db) {
+    return db->pool->path;
+}
+
+/*
+ * Close a handle and free everything attached to it.
+ */
+static void nss_db_close(struct nss_db* db) {
+    int i;
+    nss_slowlog_detach(db);
+    for(i = 0 ; i < db->nstmts ; ++i) {
+        sqlite3_finalize(db->stmts[i].pSt);
+    }
+    sqlite3_close(db->pDb);
+    /* lookaside buffer must outlive the connection */
+    if(db->lookaside != NULL) {
+        __atomic_sub_fetch(&nss_db_lookaside_bytes, NSS_DB_LOOKASIDE_SIZE * NSS_DB_LOOKASIDE_COUNT, __ATOMIC_RELAXED);
+    }
+    __atomic_sub_fetch(&nss_db_handles, 1, __ATOMIC_RELAXED);
+    free(db->lookaside);
+    free(db);
+}
+
+#if NSS_SQLITE_PAGECACHE_PAGES > 0
+/*
+ * Give SQLite a preallocated page cache. This is a process wide
+ * setting which only works if nobody initialized SQLite before us.
+ */
+static void nss_db_pagecache_init(void) {
+    int hdrsz = 0, sz;
+    void* buf;
+
+    if(sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &hdrsz) != SQLITE_OK) {
+        return;
+    }
+    sz = 4096 + hdrsz;
+    if((buf = malloc((size_t)sz * NSS_SQLITE_PAGECACHE_PAGES)) == NULL) {
+        return;
+    }
+    if(sqlite3_config(SQLITE_CONFIG_PAGECACHE, buf, sz, NSS_SQLITE_PAGECACHE_PAGES) != SQLITE_OK) {
+        NSS_DEBUG("SQLite already initialized, page cache not preallocated\n");
+        free(buf);
+    }
+}
+#endif
+
+/*
+ * Process wide memory settings, applied before the first handle opens
+ * (SQLite may only have been loaded for it). The heap limit is
+ * SQLite's, it also covers host's own use of SQLite.
+ */
+static pthread_once_t limits_once = PTHREAD_ONCE_INIT;
+
+static void nss_db_limits_init(void) {
+#if NSS_SQLITE_PAGECACHE_PAGES > 0
+    nss_db_pagecache_init();
+#endif
+    if(nss_settings()->memory_limit > 0) {
+        /* The limit is only enforced with memory statistics on, which
+         * some builds leave off by default */
+        sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 1);
+        sqlite3_soft_heap_limit64(nss_settings()->memory_limit);
+    }
+}
+
+static time_t nss_db_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static uint64_t nss_db_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * SQLite progress handler, interrupts statements of a lookup past its
+ * deadline. They then fail with SQLITE_INTERRUPT.
+ * @param p Handle running the statement.
+ */
+static int nss_db_progress(void* p) {
+    struct nss_db* db = p;
+
+    if(deadline_at != 0 && nss_db_clock() > deadline_at) {
+        NSS_ERROR("%s: lookup deadline exceeded\n", nss_db_path(db));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * SQLite busy handler, waits for writers up to the lookup's deadline.
+ * Statements run outside lookups give up at once as they always did.
+ * @param p Handle waiting for the lock.
+ * @param count Number of previous waits for this lock.
+ */
+static int nss_db_busy(void* p, int count) {
+    uint64_t now = nss_db_clock(), wait;
+    struct timespec ts;
+
+    if(deadline_at == 0 || now >= deadline_at) {
+        return 0;
+    }
+    wait = (count < 4 ? 1 << count : NSS_DB_BUSY_MAX_WAIT) * 1000000ULL;
+    if(wait > deadline_at - now) {
+        wait = deadline_at - now;
+    }
+    ts.tv_sec = wait / 1000000000;
+    ts.tv_nsec = wait % 1000000000;
+    nanosleep(&ts, NULL);
+    return 1;
+}
+
+/*
+ * Start the calling thread's lookup, every statement it runs until
+ * nss_db_deadline_end() shares the deadline_ms budget. Calls nest, the
+ * outermost one sets the deadline.
+ */
+void nss_db_deadline_start(void) {
+    long ms = nss_settings()->deadline_ms;
+
+    if(deadline_depth++ == 0 && ms > 0) {
+        deadline_at = nss_db_clock() + (uint64_t)ms * 1000000;
+    }
+}
+
+/*
+ * End the lookup started by nss_db_deadline_start().
+ */
+void nss_db_deadline_end(void) {
+    if(deadline_depth > 0 && --deadline_depth == 0) {
+        deadline_at = 0;
+    }
+}
+
+/*
+ * Set a numeric PRAGMA on a new handle.
+ */
+static void nss_db_pragma(struct nss_db* db, const char* pragma, long value) {
+    char sql[64];
+
+    snprintf(sql, sizeof(sql), "PRAGMA %s=%ld", pragma, value);
+    if(sqlite3_exec(db->pDb, sql, NULL, NULL, NULL) != SQLITE_OK) {
+        NSS_ERROR("%s: %s\n", sql, sqlite3_errmsg(db->pDb));
+    }
+}
+
+/*
+ * Open a new handle on pool's database.
+ * @param pool Pool the handle will be returned to.
+ * @param path Database file name.
+ * @param st stat() result for the database file.
+ */
+static struct nss_db* nss_db_open(struct nss_db_pool* pool, const char* path, const struct stat* st) {
+    const struct nss_settings* settings = nss_settings();
+    struct nss_db* db;
+    sqlite3_stmt* pSt = NULL;
+    int res;
+
+    pthread_once(&limits_once, nss_db_limits_init);
+    if((db = calloc(1, sizeof(*db))) == NULL) {
+        return NULL;
+    }
+
+    NSS_DEBUG("Opening DB connection to %s\n", path);
+    NSS_PROBE1(db_open_entry, path);
+    res = sqlite3_open_v2(path, &db->pDb, SQLITE_OPEN_READWRITE, NULL);
+    NSS_PROBE2(db_open_return, path, res);
+    if(res != SQLITE_OK) {
+        NSS_ERROR("%s: %s\n", path, sqlite3_errmsg(db->pDb));
+        sqlite3_close(db->pDb);
+        free(db);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&nss_db_handles, 1, __ATOMIC_RELAXED);
+
+    /* Some distributions build SQLite without lookaside support. It is
+     * not worth its memory under a memory limit either. */
+    if(!sqlite3_compileoption_used("OMIT_LOOKASIDE") && settings->memory_limit == 0) {
+        db->lookaside = malloc(NSS_DB_LOOKASIDE_SIZE * NSS_DB_LOOKASIDE_COUNT);
+    }
+    if(db->lookaside != NULL &&
+       sqlite3_db_config(db->pDb, SQLITE_DBCONFIG_LOOKASIDE, db->lookaside,
+                         NSS_DB_LOOKASIDE_SIZE, NSS_DB_LOOKASIDE_COUNT) != SQLITE_OK) {
+        free(db->lookaside);
+        db->lookaside = NULL;
+    }
+    if(db->lookaside != NULL) {
+        __atomic_add_fetch(&nss_db_lookaside_bytes, NSS_DB_LOOKASIDE_SIZE * NSS_DB_LOOKASIDE_COUNT, __ATOMIC_RELAXED);
+    }
+
+    if(settings->cache_size >= 0) {
+        nss_db_pragma(db, "cache_size", settings->cache_size);
+    }
+    if(settings->mmap_size > 0) {
+        nss_db_pragma(db, "mmap_size", settings->mmap_size);
+    }
+
+    if(settings->deadline_ms > 0) {
+        sqlite3_progress_handler(db->pDb, NSS_DB_PROGRESS_OPS, nss_db_progress, db);
+        sqlite3_busy_handler(db->pDb, nss_db_busy, db);
+    }
+
+    if(settings->slow_log != NULL) {
+        nss_slowlog_attach(db);
+    }
+
+    db->pool = pool;
+    db->dev = st->st_dev;
+    db->ino = st->st_ino;
+
+    /* An empty or foreign file is not worth pooling */
+    if(sqlite3_prepare_v2(db->pDb, "SELECT 1 FROM nss_queries", -1, &pSt, NULL) != SQLITE_OK) {
+        NSS_ERROR("%s: %s\n", path, sqlite3_errmsg(db->pDb));
+        sqlite3_finalize(pSt);
+        nss_db_close(db);
+        return NULL;
+    }
+    sqlite3_finalize(pSt);
+    NSS_STAT_INC(db_opens);
+    return db;
+}
+
+/*
+ * Circuit breaker: after breaker_threshold failed accesses in a row,
+ * accesses to a database fail at once without logging for
+ * breaker_backoff seconds. Only a missing file or a failed open counts,
+ * errors of statements on an open handle may well be transient. A
+ * stat() of the file tells whether it changed meanwhile, the next
+ * access then tries it straight away; otherwise one access probes it
+ * again once the backoff is over.
+ * @param pool Pool of the database.
+ * @param err stat() errno for the file, 0 if it succeeded.
+ * @param st stat() result for the file.
+ * @return FALSE if the access must fail.
+ */
+static int nss_db_breaker_pass(struct nss_db_pool* pool, int err, const struct stat* st) {
+    const struct nss_settings* settings = nss_settings();
+    int pass = TRUE;
+
+    if(settings->breaker_threshold <= 0) {
+        return TRUE;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->failures >= settings->breaker_threshold) {
+        time_t now = nss_db_now();
+        if(now < pool->retry_at && err == pool->trip_errno &&
+           (err != 0 || (st->st_dev == pool->trip_st.st_dev &&
+                         st->st_ino == pool->trip_st.st_ino &&
+                         st->st_size == pool->trip_st.st_size &&
+                         st->st_mtime == pool->trip_st.st_mtime))) {
+            pass = FALSE;
+        } else {
+            /* This access probes the database, others keep failing
+             * until it reports */
+            pool->retry_at = now + settings->breaker_backoff;
+            pool->trip_errno = err;
+            pool->trip_st = *st;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return pass;
+}
+
+/*
+ * Count a failed access to a database, tripping its breaker.
+ * @param pool Pool of the database.
+ */
+static void nss_db_breaker_fail(struct nss_db_pool* pool) {
+    const struct nss_settings* settings = nss_settings();
+    struct stat st;
+    int err;
+
+    if(settings->breaker_threshold <= 0) {
+        return;
+    }
+
+    memset(&st, 0, sizeof(st));
+    err = stat(pool->path, &st) != 0 ? errno : 0;
+    pthread_mutex_lock(&pool->lock);
+    if(++pool->failures == settings->breaker_threshold) {
+        NSS_ERROR("%s: %d failures in a row, failing for %lds\n", pool->path,
+                  pool->failures, settings->breaker_backoff);
+        NSS_STAT_INC(breaker_trips);
+        pool->retry_at = nss_db_now() + settings->breaker_backoff;
+        pool->trip_errno = err;
+        pool->trip_st = st;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Get a handle on a database, either from the pool or freshly opened.
+ * A handle is never reused once the file it was opened on has been
+ * replaced.
+ * @param path Database file name.
+ */
+struct nss_db* nss_db_acquire(const char* path) {
+    struct nss_db_pool* pool;
+    struct nss_db* db = NULL;
+    struct nss_db* stale = NULL;
+    struct stat st;
+    int err;
+
+    NSS_STAT_INC(lookups);
+
+    if(!nss_sqlite3_load()) {
+        return NULL;
+    }
+    if((pool = nss_db_pool_get(path)) == NULL) {
+        return NULL;
+    }
+
+    memset(&st, 0, sizeof(st));
+    err = stat(path, &st) != 0 ? errno : 0;
+    if(!nss_db_breaker_pass(pool, err, &st)) {
+        NSS_STAT_INC(breaker_rejects);
+        return NULL;
+    }
+    if(err != 0) {
+        NSS_ERROR("%s: %s\n", path, strerror(err));
+        nss_db_breaker_fail(pool);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->dev != st.st_dev || pool->ino != st.st_ino) {
+        /* File was replaced, idle handles point to the old one */
+        stale = pool->idle;
+        pool->idle = NULL;
+        pool->nidle = 0;
+        pool->dev = st.st_dev;
+        pool->ino = st.st_ino;
+    }
+    if(pool->idle != NULL) {
+        db = pool->idle;
+        pool->idle = db->next;
+        pool->nidle--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    while(stale != NULL) {
+        struct nss_db* next = stale->next;
+        NSS_STAT_INC(db_discards);
+        nss_db_close(stale);
+        stale = next;
+    }
+
+    if(db != NULL) {
+        NSS_STAT_INC(db_reuses);
+        return db;
+    }
+    if((db = nss_db_open(pool, path, &st)) == NULL) {
+        nss_db_breaker_fail(pool);
+    }
+    return db;
+}
+
+/*
+ * Look for an already compiled statement. Returned statement is reset
+ * and has no bindings.
+ * @param ppSt Filled with the statement, NULL if the query is known to
+ * be missing from nss_queries.
+ * @return TRUE if name was found in handle's cache.
+ */
+static int nss_db_cached(struct nss_db* db, const char* name, sqlite3_stmt** ppSt) {
+    sqlite3_stmt* pSt;
+    int i;
+
+    for(i = 0 ; i < db->nstmts ; ++i) {
+        if(db->stmts[i].name == name || strcmp(db->stmts[i].name, name) == 0) {
+            db->stmts[i].used = ++db->uses;
+            pSt = db->stmts[i].pSt;
+            if(pSt != NULL) {
+                sqlite3_reset(pSt);
+                sqlite3_clear_bindings(pSt);
+                NSS_STAT_INC(stmt_reuses);
+            }
+            *ppSt = pSt;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Keep a statement in handle's cache. When it is full, which custom
+ * setups naming many optional queries may reach, the least recently
+ * used statement makes room.
+ */
+static void nss_db_remember(struct nss_db* db, const char* name, sqlite3_stmt* pSt) {
+    int i, slot = db->nstmts;
+
+    if(db->nstmts == NSS_DB_MAX_STMTS) {
+        for(slot = 0, i = 1 ; i < db->nstmts ; ++i) {
+            /* Wraps with uses, an occasional wrong pick is harmless */
+            if(db->uses - db->stmts[i].used > db->uses - db->stmts[slot].used) {
+                slot = i;
+            }
+        }
+        sqlite3_finalize(db->stmts[slot].pSt);
+    } else {
+        db->nstmts++;
+    }
+    db->stmts[slot].name = name;
+    db->stmts[slot].pSt = pSt;
+    db->stmts[slot].used = ++db->uses;
+}
+
+/*
+ * Compile a statement and keep it in handle's cache.
+ * @param quiet Do not log compilation errors (optional tables).
+ */
+static sqlite3_stmt* nss_db_compile(struct nss_db* db, const char* name, const char* sql, int quiet) {
+    sqlite3_stmt* pSt;
+    int res;
+
+    NSS_PROBE1(prepare_entry, name);
+    res = sqlite3_prepare_v2(db->pDb, sql, -1, &pSt, NULL);
+    NSS_PROBE2(prepare_return, name, res);
+    if(res != SQLITE_OK) {
+        if(!quiet) {
+            NSS_ERROR("%s: %s\n", name, sqlite3_errmsg(db->pDb));
+        }
+        return NULL;
+    }
+    NSS_STAT_INC(stmt_prepares);
+    nss_db_remember(db, name, pSt);
+    return pSt;
+}
+
+/*
+ * Get the statement for a nss_queries entry, compiling it on first use.
+ * Returned statement is reset and has no bindings. Optional queries
+ * missing from nss_queries are remembered as such, so probing them
+ * again costs nothing; errors reading nss_queries are not.
+ * @param db Handle acquired with nss_db_acquire().
+ * @param name nss_queries name, must be a string literal.
+ */
+sqlite3_stmt* nss_db_stmt(struct nss_db* db, const char* name) {
+    sqlite3_stmt* pSt = NULL;
+    arena_mark_t mark;
+    char* sql;
+    int missing;
+
+    if(nss_db_cached(db, name, &pSt)) {
+        return pSt;
+    }
+
+    mark = arena_mark();
+    if((sql = get_query(db->pDb, name, &missing)) != NULL) {
+        pSt = nss_db_compile(db, name, sql, FALSE);
+    } else if(missing) {
+        /* A failed read of nss_queries is tried again next time */
+        nss_db_remember(db, name, NULL);
+    }
+    arena_release(mark);
+    return pSt;
+}
+
+/*
+ * Same as nss_db_stmt() for the module's own statements, which do not
+ * come from nss_queries. Errors are not logged, callers use this for
+ * optional tables.
+ * @param db Handle acquired with nss_db_acquire().
+ * @param name Statement name, must be a string literal.
+ * @param sql Statement text.
+ */
+sqlite3_stmt* nss_db_sql(struct nss_db* db, const char* name, const char* sql) {
+    sqlite3_stmt* pSt;
+
+    if(nss_db_cached(db, name, &pSt) && pSt != NULL) {
+        return pSt;
+    }
+    return nss_db_compile(db, name, sql, TRUE);
+}
+
+/*
+ * sqlite3_step() for lookup statements, traced with the step probes.
+ * @param pSt Statement to step.
+ */
+int nss_db_step(sqlite3_stmt* pSt) {
+    int res;
+
+    NSS_PROBE1(step_entry, sqlite3_sql(pSt));
+    res = sqlite3_step(pSt);
+    NSS_PROBE2(step_return, sqlite3_sql(pSt), res);
+    return res;
+}
+
+/*
+ * Account lookaside usage of a handle since its last release.
+ */
+static void nss_db_lookaside_stats(struct nss_db* db) {
+    int cur, hit = 0, miss_size = 0, miss_full = 0;
+
+    sqlite3_db_status(db->pDb, SQLITE_DBSTATUS_LOOKASIDE_HIT, &cur, &hit, 1);
+    sqlite3_db_status(db->pDb, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, &cur, &miss_size, 1);
+    sqlite3_db_status(db->pDb, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, &cur, &miss_full, 1);
+    NSS_STAT_ADD(lookaside_hits, hit);
+    NSS_STAT_ADD(lookaside_misses, miss_size + miss_full);
+}
+
+/*
+ * Close handles idle for idle_timeout seconds or more, every
+ * idle_timeout seconds. The thread exits once no handle is left idle
+ * and is started again by the next release.
+ */
+static void* nss_db_reaper(void* arg) {
+    long timeout = nss_settings()->idle_timeout;
+    int i, idle;
+
+    (void)arg;
+    for(;;) {
+        struct nss_db* expired = NULL;
+        time_t limit;
+
+        sleep(timeout);
+        limit = nss_db_now() - timeout;
+
+        pthread_mutex_lock(&reaper_lock);
+        idle = 0;
+        for(i = 0 ; i < __atomic_load_n(&npools, __ATOMIC_ACQUIRE) ; ++i) {
+            struct nss_db_pool* pool = &pools[i];
+            struct nss_db** pdb;
+
+            pthread_mutex_lock(&pool->lock);
+            /* Most recently released handles come first */
+            for(pdb = &pool->idle ; *pdb != NULL && (*pdb)->idle_since > limit ; pdb = &(*pdb)->next) {
+                idle++;
+            }
+            while(*pdb != NULL) {
+                struct nss_db* db = *pdb;
+                *pdb = db->next;
+                pool->nidle--;
+                db->next = expired;
+                expired = db;
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
+        if(idle == 0) {
+            reaper_running = FALSE;
+        }
+        pthread_mutex_unlock(&reaper_lock);
+
+        while(expired != NULL) {
+            struct nss_db* next = expired->next;
+            nss_db_close(expired);
+            expired = next;
+        }
+        if(idle == 0) {
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Make sure the reaper runs, called after a handle went idle. The flag
+ * is only read under reaper_lock: a reaper which did not see the
+ * handle in its scan may be about to exit.
+ */
+static void nss_db_reaper_kick(void) {
+    sigset_t all, old;
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    pthread_mutex_lock(&reaper_lock);
+    if(!reaper_running) {
+        /* Signals of the host are not ours to receive */
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        reaper_running = pthread_create(&tid, &attr, nss_db_reaper, NULL) == 0;
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    pthread_mutex_unlock(&reaper_lock);
+}
+
+/*
+ * Give a handle back to its pool once a lookup is done. Every
+ * statement is reset so that no read transaction stays open.
+ * @param db Handle acquired with nss_db_acquire().
+ */
+void nss_db_release(struct nss_db* db) {
+    const struct nss_settings* settings = nss_settings();
+    struct nss_db_pool* pool = db->pool;
+    int i, keep = FALSE;
+
+    for(i = 0 ; i < db->nstmts ; ++i) {
+        if(sqlite3_stmt_busy(db->stmts[i].pSt)) {
+            sqlite3_reset(db->stmts[i].pSt);
+        }
+    }
+    nss_db_lookaside_stats(db);
+    nss_slowlog_flush(db);
+    if(settings->memory_limit > 0) {
+        /* Idle handles keep their schema and statements only */
+        sqlite3_db_release_memory(db->pDb);
+    }
+    if(settings->idle_timeout > 0) {
+        db->idle_since = nss_db_now();
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->failures >= settings->breaker_threshold && settings->breaker_threshold > 0) {
+        NSS_ERROR("%s: back to normal\n", pool->path);
+    }
+    pool->failures = 0;
+    if(db->dev == pool->dev && db->ino == pool->ino && pool->nidle < settings->max_idle) {
+        db->next = pool->idle;
+        pool->idle = db;
+        pool->nidle++;
+        keep = TRUE;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if(!keep) {
+        nss_db_close(db);
+    } else if(settings->idle_timeout > 0) {
+        nss_db_reaper_kick();
+    }
+}
+
+/*
+ * Close a handle which hit an error instead of returning it to the pool.
+ * @param db Handle acquired with nss_db_acquire().
+ */
+void nss_db_discard(struct nss_db* db) {
+    NSS_STAT_INC(db_discards);
+    nss_db_close(db);
+}
+
+/*
+ * End a lookup: the handle goes back to the pool unless the lookup
+ * failed in a way which may come from the handle itself.
+ * @param db Handle acquired with nss_db_acquire().
+ * @param status nss_status the lookup ends with.
+ */
+void nss_db_finish(struct nss_db* db, int status) {
+    if(status == NSS_STATUS_UNAVAIL) {
+        nss_db_discard(db);
+    } else {
+        nss_db_release(db);
+    }
+}
+
+/*
+ * Memory held by the module's handles. Handles in use belong to their
+ * thread and are not inspected, only counted.
+ * @param fp Filled with current figures.
+ */
+void nss_db_footprint(struct nss_sqlite_footprint* fp) {
+    sqlite3_int64 cur, hi;
+    int i, n = __atomic_load_n(&npools, __ATOMIC_ACQUIRE);
+
+    memset(fp, 0, sizeof(*fp));
+    fp->handles = __atomic_load_n(&nss_db_handles, __ATOMIC_RELAXED);
+    fp->lookaside_bytes = __atomic_load_n(&nss_db_lookaside_bytes, __ATOMIC_RELAXED);
+
+    for(i = 0 ; i < n ; ++i) {
+        struct nss_db* db;
+        pthread_mutex_lock(&pools[i].lock);
+        for(db = pools[i].idle ; db != NULL ; db = db->next) {
+            int used, unused;
+            fp->idle_handles++;
+            if(sqlite3_db_status(db->pDb, SQLITE_DBSTATUS_CACHE_USED, &used, &unused, 0) == SQLITE_OK) {
+                fp->cache_bytes += used;
+            }
+            if(sqlite3_db_status(db->pDb, SQLITE_DBSTATUS_SCHEMA_USED, &used, &unused, 0) == SQLITE_OK) {
+                fp->schema_bytes += used;
+            }
+            if(sqlite3_db_status(db->pDb, SQLITE_DBSTATUS_STMT_USED, &used, &unused, 0) == SQLITE_OK) {
+                fp->stmt_bytes += used;
+            }
+        }
+        pthread_mutex_unlock(&pools[i].lock);
+    }
+
+    if(!nss_sqlite3_loaded()) {
+        return;
+    }
+    if(sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &cur, &hi, 0) == SQLITE_OK) {
+        fp->sqlite_memory = cur;
+        fp->sqlite_memory_highwater = hi;
+    }
+    fp->memory_limit = sqlite3_soft_heap_limit64(-1);
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_DB_H
+#define NSS_SQLITE_DB_H
+
+#include <sqlite3.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Max number of compiled statements kept per handle, room for every
+ * statement the module and its tools name */
+#define NSS_DB_MAX_STMTS 32
+/* Default max number of idle handles kept per database file */
+#define NSS_DB_MAX_IDLE 8
+/* Max number of distinct database files (shards included) */
+#define NSS_DB_MAX_POOLS 64
+/* Lookaside slots preallocated for each handle */
+#define NSS_DB_LOOKASIDE_SIZE 128
+#define NSS_DB_LOOKASIDE_COUNT 256
+/* VM instructions between two checks of a lookup's deadline */
+#define NSS_DB_PROGRESS_OPS 1000
+/* Longest single wait for a lock held by a writer, in ms */
+#define NSS_DB_BUSY_MAX_WAIT 10
+
+struct nss_db_pool;
+struct nss_slow;
+struct nss_sqlite_footprint;
+
+/*
+ * A pooled database handle together with the statements already
+ * compiled on it. Handles are owned by a single thread between
+ * nss_db_acquire() and nss_db_release()/nss_db_discard().
+ */
+struct nss_db {
+    sqlite3* pDb;
+    struct nss_db_pool* pool;
+    dev_t dev;          /* identity of the file this handle reads */
+    ino_t ino;
+    int nstmts;
+    unsigned int uses;      /* statement lookups on this handle */
+    struct {
+        const char* name;   /* nss_queries name or internal statement
+                               name, must be a literal */
+        sqlite3_stmt* pSt;
+        unsigned int used;  /* value of uses when last returned */
+    } stmts[NSS_DB_MAX_STMTS];
+    void* lookaside;
+    time_t idle_since;              /* monotonic time of last release */
+    struct nss_slow* slow;          /* slow query log records, NULL when
+                                       not logging */
+    struct nss_db* next;
+};
+
+const char* nss_db_intern(const char*);
+struct nss_db* nss_db_acquire(const char*);
+const char* nss_db_path(const struct nss_db*);
+sqlite3_stmt* nss_db_stmt(struct nss_db*, const char*);
+sqlite3_stmt* nss_db_sql(struct nss_db*, const char*, const char*);
+int nss_db_step(sqlite3_stmt*);
+void nss_db_release(struct nss_db*);
+void nss_db_discard(struct nss_db*);
+void nss_db_deadline_start(void);
+void nss_db_deadline_end(void);
+void nss_db_finish(struct nss_db*, int);
+void nss_db_footprint(struct nss_sqlite_footprint*);
+
+#endif
@@ -0,0 +1,381 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * dump.c : Whole database dumps for inventory tools.
+ *
+ * Every database file is read inside one read transaction, so what the
+ * caller gets is the content of the file at a single point in time
+ * instead of what getpwent()/getgrent() see page after page. Passwd
+ * and group key spaces are cut into ranges which several threads scan
+ * on their own handles. Without the snapshot API this is only
+ * consistent if those handles see the same commit, which holds for
+ * rollback journals: the coordinating transaction keeps its SHARED
+ * lock until every worker is done, so nobody can commit meanwhile. In
+ * WAL mode readers do not block writers and every range is scanned by
+ * the coordinator in its own transaction.
+ */
+
+#include "nss-sqlite.h"
+#include "db.h"
+#include "libnss-sqlite.h"
+#include "settings.h"
+#include "shard.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Ranges each scanning thread gets for passwd and group key spaces */
+#define NSS_DUMP_RANGES_PER_THREAD 4
+#define NSS_DUMP_MAX_THREADS 64
+#define NSS_DUMP_MAX_RANGES (2 * NSS_DUMP_RANGES_PER_THREAD * NSS_DUMP_MAX_THREADS + 1)
+
+struct dump_range {
+    int kind;
+    sqlite3_int64 lo, hi;       /* inclusive key bounds */
+};
+
+struct dump_job {
+    const char* path;
+    nss_sqlite_dump_fn fn;
+    void* ctx;
+    struct dump_range ranges[NSS_DUMP_MAX_RANGES];
+    int nranges;
+    int next;                   /* next range to scan, atomic */
+    int result;                 /* first failure, atomic */
+};
+
+/*
+ * Record the first failure of a job, which stops every scanner.
+ */
+static void dump_fail(struct dump_job* job, int result) {
+    int expected = 0;
+    __atomic_compare_exchange_n(&job->result, &expected, result, FALSE,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Open a read transaction on a handle and take its read lock right
+ * away, BEGIN alone is deferred.
+ * @param db Handle acquired with nss_db_acquire().
+ */
+static int dump_begin(struct nss_db* db) {
+    sqlite3_stmt* pSt;
+    int res;
+
+    if(sqlite3_exec(db->pDb, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+        return SQLITE_ERROR;
+    }
+    if(!(pSt = nss_db_sql(db, "dump_pin", "SELECT 1 FROM sqlite_master LIMIT 1"))) {
+        sqlite3_exec(db->pDb, "ROLLBACK", NULL, NULL, NULL);
+        return SQLITE_ERROR;
+    }
+    res = sqlite3_step(pSt);
+    sqlite3_reset(pSt);
+    if(res != SQLITE_ROW && res != SQLITE_DONE) {
+        sqlite3_exec(db->pDb, "ROLLBACK", NULL, NULL, NULL);
+        return res;
+    }
+    return SQLITE_OK;
+}
+
+static void dump_end(struct nss_db* db) {
+    sqlite3_exec(db->pDb, "COMMIT", NULL, NULL, NULL);
+}
+
+/*
+ * Scan one key range and hand its entries to the job's callback.
+ * Ranges other than the whole key space need the keyset queries.
+ * @param db Handle inside a dump_begin() transaction.
+ * @param job Job the range belongs to.
+ * @param r Range to scan.
+ */
+static void dump_scan(struct nss_db* db, struct dump_job* job, const struct dump_range* r) {
+    const char *page, *all;
+    sqlite3_stmt* pSt;
+    char* buf = NULL;
+    size_t buflen = 0;
+    int res = SQLITE_DONE, status, key;
+    union {
+        struct passwd pw;
+        struct group gr;
+        struct spwd sp;
+    } e;
+    struct group gr;
+
+    switch(r->kind) {
+        case NSS_SQLITE_DUMP_PASSWD:
+            page = "getpwent_page", all = "setpwent", key = 2;
+            break;
+        case NSS_SQLITE_DUMP_GROUP:
+            page = "getgrent_page", all = "setgrent", key = 0;
+            break;
+        default:
+            page = "getspent_page", all = "setspent", key = -1;
+            break;
+    }
+
+    if((pSt = nss_db_stmt(db, page)) != NULL) {
+        if(key < 0) {
+            res = sqlite3_bind_text(pSt, 1, "", -1, SQLITE_STATIC);
+        } else {
+            res = sqlite3_bind_int64(pSt, 1, r->lo == INT64_MIN ? r->lo : r->lo - 1);
+        }
+        if(res == SQLITE_OK) {
+            res = sqlite3_bind_int(pSt, 2, -1);
+        }
+        if(res != SQLITE_OK) {
+            NSS_ERROR(sqlite3_errmsg(db->pDb));
+            dump_fail(job, -1);
+            return;
+        }
+    } else if(r->lo != INT64_MIN || !(pSt = nss_db_stmt(db, all))) {
+        dump_fail(job, -1);
+        return;
+    }
+
+    while(__atomic_load_n(&job->result, __ATOMIC_RELAXED) == 0
+          && (res = nss_db_step(pSt)) == SQLITE_ROW) {
+        if(key >= 0 && sqlite3_column_int64(pSt, key) > r->hi) {
+            res = SQLITE_DONE;
+            break;
+        }
+        memset(&e, 0, sizeof(e));
+        switch(r->kind) {
+            case NSS_SQLITE_DUMP_PASSWD:
+                if(!fill_passwd_sql(&e.pw, pSt)) {
+                    NSS_ERROR("unreadable passwd row\n");
+                    dump_fail(job, -1);
+                    continue;
+                }
+                break;
+            case NSS_SQLITE_DUMP_GROUP:
+                fill_group_sql(&gr, pSt);
+                /* Members are read by the same handle, hence in the
+                 * same transaction */
+                for(;;) {
+                    int err = 0;
+                    status = fill_group(db, &e.gr, buf, buflen, gr, &err);
+                    if(status != NSS_STATUS_TRYAGAIN || err != ERANGE) {
+                        break;
+                    }
+                    buflen = buflen ? 2 * buflen : 4096;
+                    free(buf);
+                    if(!(buf = malloc(buflen))) {
+                        buflen = 0;
+                        break;
+                    }
+                }
+                if(status != NSS_STATUS_SUCCESS) {
+                    dump_fail(job, -1);
+                    continue;
+                }
+                break;
+            default:
+                if(!fill_shadow_sql(&e.sp, pSt)) {
+                    NSS_ERROR("unreadable shadow row\n");
+                    dump_fail(job, -1);
+                    continue;
+                }
+                e.sp.sp_flag = ~0UL;
+                break;
+        }
+        if((status = job->fn(job->ctx, r->kind, &e)) != 0) {
+            dump_fail(job, status);
+        }
+    }
+    if(res != SQLITE_ROW && res != SQLITE_DONE) {
+        NSS_ERROR(sqlite3_errmsg(db->pDb));
+        dump_fail(job, -1);
+    }
+    sqlite3_reset(pSt);
+    free(buf);
+}
+
+/*
+ * Scan ranges of a job until none is left.
+ * @param db Handle inside a dump_begin() transaction.
+ */
+static void dump_ranges(struct nss_db* db, struct dump_job* job) {
+    int i;
+
+    while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_SEQ_CST)) < job->nranges
+          && __atomic_load_n(&job->result, __ATOMIC_RELAXED) == 0) {
+        dump_scan(db, job, &job->ranges[i]);
+    }
+}
+
+/*
+ * Scanning thread. Its transaction must start while the coordinator
+ * holds its own, a thread which cannot get the read lock right away (a
+ * writer is waiting for it) leaves its share to the others.
+ */
+static void* dump_worker(void* p) {
+    struct dump_job* job = p;
+    struct nss_db* db;
+
+    if(!(db = nss_db_acquire(job->path))) {
+        return NULL;
+    }
+    if(dump_begin(db) == SQLITE_OK) {
+        dump_ranges(db, job);
+        dump_end(db);
+    }
+    nss_db_release(db);
+    return NULL;
+}
+
+/*
+ * Append ranges covering a table's integer key space, split evenly
+ * between its bounds. A single range is used when the bounds cannot
+ * be read (custom schema) or no split is wanted.
+ */
+static void dump_split(struct nss_db* db, struct dump_job* job, int kind, int parts) {
+    sqlite3_int64 lo = INT64_MIN, hi = INT64_MAX, step;
+    sqlite3_stmt* pSt = NULL;
+    int i;
+
+    if(parts > 1) {
+        if(kind == NSS_SQLITE_DUMP_PASSWD) {
+            pSt = nss_db_sql(db, "dump_passwd_bounds", "SELECT min(uid), max(uid) FROM passwd");
+        } else {
+            pSt = nss_db_sql(db, "dump_group_bounds", "SELECT min(gid), max(gid) FROM groups");
+        }
+    }
+    if(pSt != NULL) {
+        if(sqlite3_step(pSt) == SQLITE_ROW && sqlite3_column_type(pSt, 0) == SQLITE_INTEGER) {
+            lo = sqlite3_column_int64(pSt, 0);
+            hi = sqlite3_column_int64(pSt, 1);
+        }
+        sqlite3_reset(pSt);
+    }
+    if(lo == INT64_MIN || hi - lo < parts) {
+        parts = 1;
+    }
+
+    step = (hi - lo) / parts + 1;
+    for(i = 0 ; i < parts ; ++i) {
+        struct dump_range* r = &job->ranges[job->nranges++];
+        r->kind = kind;
+        r->lo = i == 0 ? INT64_MIN : lo + i * step;
+        r->hi = i == parts - 1 ? INT64_MAX : lo + (i + 1) * step - 1;
+    }
+}
+
+/*
+ * Dump some kinds of entries of one database file.
+ */
+static int dump_file(const char* path, int what, int threads,
+                     nss_sqlite_dump_fn fn, void* ctx) {
+    struct dump_job* job;
+    struct nss_db* db;
+    pthread_t tids[NSS_DUMP_MAX_THREADS];
+    sqlite3_stmt* pSt;
+    int i, started = 0, wal = FALSE, parts, res;
+
+    if(!(db = nss_db_acquire(path))) {
+        return -1;
+    }
+    if(dump_begin(db) != SQLITE_OK) {
+        NSS_ERROR(sqlite3_errmsg(db->pDb));
+        nss_db_discard(db);
+        return -1;
+    }
+    if(!(job = calloc(1, sizeof(*job)))) {
+        dump_end(db);
+        nss_db_release(db);
+        return -1;
+    }
+    job->path = path;
+    job->fn = fn;
+    job->ctx = ctx;
+
+    if((pSt = nss_db_sql(db, "dump_journal_mode", "PRAGMA journal_mode")) != NULL) {
+        if(sqlite3_step(pSt) == SQLITE_ROW) {
+            wal = strcmp((const char*)sqlite3_column_text(pSt, 0), "wal") == 0;
+        }
+        sqlite3_reset(pSt);
+    }
+    if(wal) {
+        threads = 1;
+    }
+
+    parts = threads > 1 ? threads * NSS_DUMP_RANGES_PER_THREAD : 1;
+    if(what & NSS_SQLITE_DUMP_PASSWD) {
+        dump_split(db, job, NSS_SQLITE_DUMP_PASSWD, parts);
+    }
+    if(what & NSS_SQLITE_DUMP_GROUP) {
+        dump_split(db, job, NSS_SQLITE_DUMP_GROUP, parts);
+    }
+    if(what & NSS_SQLITE_DUMP_SHADOW) {
+        struct dump_range* r = &job->ranges[job->nranges++];
+        r->kind = NSS_SQLITE_DUMP_SHADOW;
+        r->lo = INT64_MIN;
+        r->hi = INT64_MAX;
+    }
+
+    for(i = 1 ; i < threads && job->nranges > 1 ; ++i) {
+        if(pthread_create(&tids[started], NULL, dump_worker, job) == 0) {
+            started++;
+        }
+    }
+    /* The coordinator scans too, so the dump completes even if no
+     * worker could start its transaction */
+    dump_ranges(db, job);
+    for(i = 0 ; i < started ; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+
+    dump_end(db);
+    nss_db_release(db);
+    res = job->result;
+    free(job);
+    return res;
+}
+
+/*
+ * Hand every entry of the given kinds to fn. See libnss-sqlite.h.
+ */
+int nss_sqlite_dump(int what, int threads, nss_sqlite_dump_fn fn, void* ctx) {
+    const char* paths[NSS_SHARD_MAX];
+    int i, n, res = 0;
+
+    if(threads < 1) {
+        threads = 1;
+    } else if(threads > NSS_DUMP_MAX_THREADS) {
+        threads = NSS_DUMP_MAX_THREADS;
+    }
+
+    if(what & (NSS_SQLITE_DUMP_PASSWD | NSS_SQLITE_DUMP_GROUP)) {
+        n = nss_shard_all(nss_passwd_db(), paths);
+        for(i = 0 ; i < n && res == 0 ; ++i) {
+            res = dump_file(paths[i], what & (NSS_SQLITE_DUMP_PASSWD | NSS_SQLITE_DUMP_GROUP),
+                            threads, fn, ctx);
+        }
+    }
+    if(res == 0 && (what & NSS_SQLITE_DUMP_SHADOW)) {
+        n = nss_shard_all(nss_shadow_db(), paths);
+        for(i = 0 ; i < n && res == 0 ; ++i) {
+            res = dump_file(paths[i], NSS_SQLITE_DUMP_SHADOW, threads, fn, ctx);
+        }
+    }
+    return res;
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * ent.c : Page by page walk used by the getXXent functions.
+ */
+
+#include "nss-sqlite.h"
+#include "ent.h"
+#include "shard.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Walk states */
+#define ENT_START   0   /* nothing fetched yet from current file */
+#define ENT_MORE    1   /* more pages may follow */
+#define ENT_LAST    2   /* current page is the last one */
+
+/*
+ * Remember key of the row about to be stored, next page starts after it.
+ */
+static void nss_ent_save_key(struct nss_ent* ent, sqlite3_stmt* pSt) {
+    const char* key;
+    size_t l;
+
+    if(sqlite3_column_type(pSt, ent->key_col) == SQLITE_INTEGER) {
+        ent->last_id = sqlite3_column_int64(pSt, ent->key_col);
+        ent->key_text = FALSE;
+        return;
+    }
+
+    if((key = (const char*)sqlite3_column_text(pSt, ent->key_col)) == NULL) {
+        return;
+    }
+    l = sqlite3_column_bytes(pSt, ent->key_col) + 1;
+    if(l > ent->last_name_size) {
+        char* p = realloc(ent->last_name, l);
+        if(p == NULL) {
+            return;
+        }
+        ent->last_name = p;
+        ent->last_name_size = l;
+    }
+    memcpy(ent->last_name, key, l);
+    ent->key_text = TRUE;
+}
+
+/*
+ * Bind the position of the next page to the keyset query.
+ */
+static int nss_ent_bind(struct nss_ent* ent, sqlite3_stmt* pSt) {
+    int res;
+
+    if(ent->state == ENT_START) {
+        /* Lower than any key: integers sort before text in SQLite */
+        res = sqlite3_bind_int64(pSt, 1, INT64_MIN);
+    } else if(ent->key_text) {
+        res = sqlite3_bind_text(pSt, 1, ent->last_name, -1, SQLITE_STATIC);
+    } else {
+        res = sqlite3_bind_int64(pSt, 1, ent->last_id);
+    }
+    if(res == SQLITE_OK) {
+        res = sqlite3_bind_int(pSt, 2, NSS_ENT_PAGE_ROWS);
+    }
+    return res;
+}
+
+/*
+ * Fill the page from pSt. Stops after NSS_ENT_PAGE_ROWS rows or when
+ * page buffer is full, in which case the row which did not fit is left
+ * pending in pSt.
+ * @return SQLite result of the last step: SQLITE_ROW if more rows may
+ * follow, SQLITE_DONE at the end of the statement.
+ */
+static int nss_ent_fill(struct nss_ent* ent, sqlite3_stmt* pSt) {
+    size_t strings = NSS_ENT_PAGE_ROWS * ent->entry_size;
+    size_t used = 0;
+    int res;
+
+    ent->count = 0;
+    ent->pos = 0;
+    while(ent->count < NSS_ENT_PAGE_ROWS) {
+        ssize_t l;
+
+        if(ent->pending) {
+            ent->pending = FALSE;
+        } else if((res = nss_db_step(pSt)) != SQLITE_ROW) {
+            return res;
+        }
+
+        while((l = ent->store(pSt, ent->page + ent->count * ent->entry_size,
+                              ent->page + strings + used, ent->page_size - strings - used)) < 0) {
+            char* page;
+            if(l == NSS_ENT_BAD_ROW) {
+                return SQLITE_CORRUPT;
+            }
+            if(ent->count > 0) {
+                /* Page full, this row will start next page */
+                ent->pending = TRUE;
+                return SQLITE_ROW;
+            }
+            /* Single row larger than the buffer, grow it */
+            if(!(page = realloc(ent->page, ent->page_size * 2))) {
+                return SQLITE_NOMEM;
+            }
+            ent->page = page;
+            ent->page_size *= 2;
+        }
+        used += (l + sizeof(char*) - 1) & ~(sizeof(char*) - 1);
+        nss_ent_save_key(ent, pSt);
+        ent->count++;
+    }
+    return SQLITE_ROW;
+}
+
+/*
+ * Current file is exhausted, move on to next shard if any.
+ */
+static void nss_ent_next_shard(struct nss_ent* ent) {
+    const char* paths[NSS_SHARD_MAX];
+
+    if(ent->shard + 1 < nss_shard_all(ent->path(), paths)) {
+        ent->shard++;
+        ent->state = ENT_START;
+    } else {
+        ent->state = ENT_LAST;
+    }
+}
+
+/*
+ * Fetch next page of entries.
+ */
+static enum nss_status nss_ent_load(struct nss_ent* ent) {
+    const char* paths[NSS_SHARD_MAX];
+    int res;
+
+    if(ent->page == NULL) {
+        ent->page_size = NSS_ENT_PAGE_ROWS * ent->entry_size + NSS_ENT_PAGE_SIZE;
+        if(!(ent->page = malloc(ent->page_size))) {
+            return NSS_STATUS_TRYAGAIN;
+        }
+    }
+
+    if(ent->db != NULL) {
+        /* Legacy walk, keep stepping the statement we hold */
+        res = nss_ent_fill(ent, ent->pSt);
+        if(res != SQLITE_ROW) {
+            nss_db_finish(ent->db, res == SQLITE_DONE ? NSS_STATUS_NOTFOUND : res2nss_status(res));
+            ent->db = NULL;
+            if(res == SQLITE_DONE) {
+                nss_ent_next_shard(ent);
+            }
+            return res == SQLITE_DONE ? NSS_STATUS_SUCCESS : res2nss_status(res);
+        }
+        ent->state = ENT_MORE;
+        return NSS_STATUS_SUCCESS;
+    }
+
+    if(ent->shard >= nss_shard_all(ent->path(), paths)) {
+        /* Shards went away during the walk */
+        ent->state = ENT_LAST;
+        ent->count = ent->pos = 0;
+        return NSS_STATUS_SUCCESS;
+    }
+    if(!(ent->db = nss_db_acquire(paths[ent->shard]))) {
+        return NSS_STATUS_UNAVAIL;
+    }
+    if(!(ent->pSt = nss_db_stmt(ent->db, ent->page_query))) {
+        if(ent->state != ENT_START || !(ent->pSt = nss_db_stmt(ent->db, ent->all_query))) {
+            nss_db_discard(ent->db);
+            ent->db = NULL;
+            return NSS_STATUS_UNAVAIL;
+        }
+        NSS_DEBUG("%s not found, walking %s in one transaction\n", ent->page_query, ent->all_query);
+        return nss_ent_load(ent);
+    }
+    if(nss_ent_bind(ent, ent->pSt) != SQLITE_OK) {
+        NSS_ERROR("%s: %s\n", ent->page_query, sqlite3_errmsg(ent->db->pDb));
+        nss_db_release(ent->db);
+        ent->db = NULL;
+        return NSS_STATUS_UNAVAIL;
+    }
+
+    res = nss_ent_fill(ent, ent->pSt);
+    /* Page is copied, let the read transaction go. A row left pending
+     * will be fetched again by next page's query. */
+    ent->pending = FALSE;
+    sqlite3_reset(ent->pSt);
+    nss_db_finish(ent->db, (res == SQLITE_ROW || res == SQLITE_DONE) ? NSS_STATUS_SUCCESS : res2nss_status(res));
+    ent->db = NULL;
+    ent->pSt = NULL;
+
+    if(res != SQLITE_ROW && res != SQLITE_DONE) {
+        return res2nss_status(res);
+    }
+    if(res == SQLITE_DONE) {
+        nss_ent_next_shard(ent);
+    } else {
+        ent->state = ENT_MORE;
+    }
+    return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * Get current entry of the walk, fetching a new page if needed. The
+ * entry stays current until nss_ent_advance() is called, so a caller
+ * whose buffer was too short gets the same entry again.
+ * @param ent Walk state.
+ * @param entry Filled with a pointer to the entry.
+ */
+enum nss_status nss_ent_next(struct nss_ent* ent, void** entry) {
+    enum nss_status res;
+
+    while(ent->pos >= ent->count) {
+        if(ent->state == ENT_LAST) {
+            return NSS_STATUS_NOTFOUND;
+        }
+        if((res = nss_ent_load(ent)) != NSS_STATUS_SUCCESS) {
+            return res;
+        }
+    }
+    *entry = ent->page + ent->pos * ent->entry_size;
+    return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * Move past the current entry.
+ */
+void nss_ent_advance(struct nss_ent* ent) {
+    ent->pos++;
+}
+
+/*
+ * Restart the walk from the first entry.
+ */
+void nss_ent_rewind(struct nss_ent* ent) {
+    if(ent->db != NULL) {
+        /* Legacy walk, the statement just has to be reset */
+        sqlite3_reset(ent->pSt);
+    }
+    if(ent->shard != 0 && ent->db != NULL) {
+        /* Legacy walk of another shard */
+        nss_db_release(ent->db);
+        ent->db = NULL;
+    }
+    ent->shard = 0;
+    ent->state = ENT_START;
+    ent->pending = FALSE;
+    ent->count = 0;
+    ent->pos = 0;
+}
+
+/*
+ * Free everything held by the walk.
+ */
+void nss_ent_close(struct nss_ent* ent) {
+    if(ent->db != NULL) {
+        nss_db_release(ent->db);
+        ent->db = NULL;
+    }
+    free(ent->page);
+    free(ent->last_name);
+    ent->page = NULL;
+    ent->last_name = NULL;
+    ent->last_name_size = 0;
+    ent->shard = 0;
+    ent->state = ENT_START;
+    ent->pending = FALSE;
+    ent->count = 0;
+    ent->pos = 0;
+}
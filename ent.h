@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_ENT_H
+#define NSS_SQLITE_ENT_H
+
+#include "db.h"
+
+#include <sys/types.h>
+
+/* Max rows fetched per page */
+#define NSS_ENT_PAGE_ROWS 256
+/* Initial size of the page buffer, grown when a single row needs it */
+#define NSS_ENT_PAGE_SIZE 32768
+
+/*
+ * Copy current row of pSt into entry, strings going to buf.
+ * Returns the number of bytes of buf used, -1 if buflen is too short,
+ * NSS_ENT_BAD_ROW if the row cannot be read.
+ */
+#define NSS_ENT_BAD_ROW (-2)
+
+typedef ssize_t (*nss_ent_store)(sqlite3_stmt* pSt, void* entry, char* buf, size_t buflen);
+
+/*
+ * State of a getXXent walk.
+ *
+ * Rows are fetched in pages using the keyset query (WHERE key > ?
+ * ORDER BY key LIMIT ?) and copied out of SQLite, so no read transaction
+ * stays open while the caller takes its time between two entries.
+ * Databases without the keyset query are walked with the legacy
+ * whole-table statement, which then holds its handle until the end.
+ * Sharded setups are walked one file after the other.
+ */
+struct nss_ent {
+    /* set once */
+    const char* (*path)(void);  /* root database */
+    const char* page_query;     /* nss_queries name of the keyset query */
+    const char* all_query;      /* nss_queries name of the legacy query */
+    int key_col;                /* column holding the key */
+    size_t entry_size;
+    nss_ent_store store;
+    /* walk */
+    struct nss_db* db;          /* held between pages by legacy walks only */
+    sqlite3_stmt* pSt;
+    int shard;                  /* file being walked, see nss_shard_all() */
+    int state;
+    int pending;                /* legacy walks: pSt is on a row which
+                                   did not fit in previous page */
+    int key_text;               /* key is last_name rather than last_id */
+    sqlite3_int64 last_id;      /* key of the last row fetched */
+    char* last_name;
+    size_t last_name_size;
+    /* current page, NSS_ENT_PAGE_ROWS entries followed by strings */
+    char* page;
+    size_t page_size;
+    int count;
+    int pos;
+};
+
+#define NSS_ENT_INIT(path, page_query, all_query, key_col, type, store) \
+    { path, page_query, all_query, key_col, sizeof(type), store, \
+      NULL, NULL, 0, 0, 0, 0, 0, NULL, 0, NULL, 0, 0, 0 }
+
+enum nss_status nss_ent_next(struct nss_ent*, void**);
+void nss_ent_advance(struct nss_ent*);
+void nss_ent_rewind(struct nss_ent*);
+void nss_ent_close(struct nss_ent*);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * flight.c : Coalescing of concurrent identical lookups.
+ *
+ * When many threads of a process look the same key up at once, only the
+ * first one (the leader) queries the database. The others wait for it
+ * and copy its entry into their own buffers, the leader does not return
+ * before they are done so its buffer stays valid meanwhile. Only found
+ * and not found answers are shared; waiters redo errors themselves as
+ * the leader's buffer may just have been too small.
+ */
+
+#include "nss-sqlite.h"
+#include "flight.h"
+
+#include <pthread.h>
+#include <string.h>
+
+struct nss_flight {
+    int func;                   /* enum nss_capture_func, 0 if free */
+    const char* name;           /* key, leader's copy */
+    sqlite3_int64 id;
+    int waiters;
+    int done;
+    enum nss_status status;     /* leader's answer once done */
+    const void* entry;
+    pthread_cond_t cond;
+};
+
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#if NSS_SQLITE_SINGLE_FLIGHT
+
+static struct nss_flight flights[NSS_FLIGHT_SLOTS];
+static pthread_once_t flights_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Child side of fork(): flights of the parent's threads never end in
+ * the child.
+ */
+static void nss_flight_atfork_child(void) {
+    int i;
+    pthread_mutex_init(&flights_lock, NULL);
+    for(i = 0 ; i < NSS_FLIGHT_SLOTS ; ++i) {
+        flights[i].func = 0;
+        pthread_cond_init(&flights[i].cond, NULL);
+    }
+}
+
+static void nss_flight_init(void) {
+    int i;
+    for(i = 0 ; i < NSS_FLIGHT_SLOTS ; ++i) {
+        pthread_cond_init(&flights[i].cond, NULL);
+    }
+    pthread_atfork(NULL, NULL, nss_flight_atfork_child);
+}
+
+#endif
+
+/*
+ * Join the lookup of a key other threads may already be doing.
+ * @param pf Set to the flight the caller leads, to be given to
+ * nss_flight_end() once its lookup is done, or NULL.
+ * @param func Looked up function, from enum nss_capture_func.
+ * @param name Key for lookups by name, else NULL.
+ * @param id Key for lookups by id.
+ * @param copy Copies the leader's entry for a waiter.
+ * @param dst, buf, buflen, errnop Caller's entry point arguments.
+ * @param res Set to the caller's answer when TRUE is returned.
+ * @return TRUE if the answer was taken from another thread's lookup,
+ * FALSE if the caller has to do its own.
+ */
+int nss_flight_join(struct nss_flight** pf, int func, const char* name, sqlite3_int64 id,
+                    nss_flight_copy copy, void* dst, char* buf, size_t buflen,
+                    int* errnop, int* res) {
+#if NSS_SQLITE_SINGLE_FLIGHT
+    struct nss_flight* f = NULL;
+    struct nss_flight* free_slot = NULL;
+    int i, shared = FALSE;
+
+    *pf = NULL;
+    pthread_once(&flights_once, nss_flight_init);
+
+    pthread_mutex_lock(&flights_lock);
+    for(i = 0 ; i < NSS_FLIGHT_SLOTS ; ++i) {
+        struct nss_flight* cur = &flights[i];
+        if(cur->func == 0) {
+            if(free_slot == NULL) {
+                free_slot = cur;
+            }
+        } else if(cur->func == func && !cur->done && cur->id == id
+                  && (name == NULL || strcmp(cur->name, name) == 0)) {
+            f = cur;
+            break;
+        }
+    }
+
+    if(f == NULL) {
+        /* Lead this key, unless too many are already in flight */
+        if(free_slot != NULL) {
+            free_slot->func = func;
+            free_slot->name = name;
+            free_slot->id = id;
+            free_slot->waiters = 0;
+            free_slot->done = FALSE;
+            *pf = free_slot;
+        }
+        pthread_mutex_unlock(&flights_lock);
+        return FALSE;
+    }
+
+    f->waiters++;
+    while(!f->done) {
+        pthread_cond_wait(&f->cond, &flights_lock);
+    }
+    pthread_mutex_unlock(&flights_lock);
+
+    if(f->status == NSS_STATUS_SUCCESS) {
+        *res = copy(dst, buf, buflen, f->entry, errnop);
+        shared = TRUE;
+    } else if(f->status == NSS_STATUS_NOTFOUND) {
+        *res = NSS_STATUS_NOTFOUND;
+        shared = TRUE;
+    }
+
+    pthread_mutex_lock(&flights_lock);
+    if(--f->waiters == 0) {
+        pthread_cond_broadcast(&f->cond);
+    }
+    pthread_mutex_unlock(&flights_lock);
+    return shared;
+#else
+    *pf = NULL;
+    return FALSE;
+#endif
+}
+
+/*
+ * Hand the leader's answer to waiting threads and wait for them to
+ * copy it.
+ * @param f Flight from nss_flight_join(), may be NULL.
+ * @param res Leader's answer.
+ * @param entry Leader's entry, read by waiters if res is a success.
+ */
+void nss_flight_end(struct nss_flight* f, enum nss_status res, const void* entry) {
+    if(f == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&flights_lock);
+    f->status = res;
+    f->entry = entry;
+    f->done = TRUE;
+    if(f->waiters > 0) {
+        pthread_cond_broadcast(&f->cond);
+        while(f->waiters > 0) {
+            pthread_cond_wait(&f->cond, &flights_lock);
+        }
+    }
+    f->func = 0;
+    pthread_mutex_unlock(&flights_lock);
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_FLIGHT_H
+#define NSS_SQLITE_FLIGHT_H
+
+#include <nss.h>
+#include <sqlite3.h>
+#include <stddef.h>
+
+/* Max number of distinct lookups coalesced at the same time */
+#define NSS_FLIGHT_SLOTS 32
+
+struct nss_flight;
+
+/*
+ * Copy an entry found by another thread into the caller's struct and
+ * buffer, e.g. copy_passwd().
+ */
+typedef enum nss_status (*nss_flight_copy)(void* dst, char* buf, size_t buflen,
+                                           const void* src, int* errnop);
+
+int nss_flight_join(struct nss_flight**, int, const char*, sqlite3_int64,
+                    nss_flight_copy, void*, char*, size_t, int*, int*);
+void nss_flight_end(struct nss_flight*, enum nss_status, const void*);
+
+#endif
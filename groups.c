@@ -20,6 +20,13 @@
  * groups.c : Functions handling groups entries retrieval.
  */
 #include "nss-sqlite.h"
+#include "capture.h"
+#include "ent.h"
+#include "flight.h"
+#include "probes.h"
+#include "settings.h"
+#include "shard.h"
+#include "shm.h"
 #include "utils.h"
 
 #include <errno.h>
@@ -29,62 +36,52 @@
 #include <string.h>
 
 /*
- * struct used to store data used by getgrent.
+ * Copy a group row into a getgrent page. Members are not part of the
+ * page, they are fetched when the entry is returned.
  */
-static struct {
-    sqlite3* pDb;
-    sqlite3_stmt* pSt;
-    int try_again;      /* flag to know if NSS_TRYAGAIN
-                            was returned by previous call
-                            to getgrent_r */
-    /* group information cache used if NSS_TRYAGAIN was returned */
+static ssize_t store_group(sqlite3_stmt* pSt, void* p, char* buf, size_t buflen) {
+    struct group* gr = p;
     struct group entry;
-} grent_data = { NULL, NULL, 0, NULL};
+    size_t name_length, pw_length;
 
-/* mutex used to serialize xxgrent operation */
-pthread_mutex_t grent_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+    if(!fill_group_sql(&entry, pSt)) {
+        return NSS_ENT_BAD_ROW;
+    }
+    name_length = strlen(entry.gr_name) + 1;
+    pw_length = strlen(entry.gr_passwd) + 1;
+    if(buflen < name_length + pw_length) {
+        return -1;
+    }
+
+    gr->gr_gid = entry.gr_gid;
+    gr->gr_name = memcpy(buf, entry.gr_name, name_length);
+    gr->gr_passwd = memcpy(buf + name_length, entry.gr_passwd, pw_length);
+    gr->gr_mem = NULL;
+    return name_length + pw_length;
+}
 
 /*
- * Free memory used by a dynamically allocated 2D table.
- * @param m Dynamically allocated table. Each element will
- * be freed, m will be freed too.
- * @param c Number of elements in t.
+ * struct used to store data used by getgrent.
  */
-static void free_2Dtable(char** t, int c) {
-    int i;
-    for(i = 0 ; i < c ; ++i) {
-        free(t[i]);
-    }
-    free(t);
-}
+static struct nss_ent grent_data = NSS_ENT_INIT(nss_passwd_db, "getgrent_page",
+        "setgrent", 0, struct group, store_group);
+
+/* mutex used to serialize xxgrent operation */
+pthread_mutex_t grent_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
 /*
  * Initialize grent functions (serial group access).
+ * Entries are fetched lazily, this only rewinds the walk.
  */
 enum nss_status _nss_sqlite_setgrent(void) {
-    char* sql;
+    uint64_t t0 = nss_capture_start();
+    NSS_DEBUG("setgrent: rewinding group walk\n");
+    NSS_PROBE(setgrent_entry);
     pthread_mutex_lock(&grent_mutex);
-    if(grent_data.pDb == NULL) {
-        NSS_DEBUG("setgrent: opening DB connection\n");
-        if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &grent_data.pDb) != SQLITE_OK) {
-            NSS_ERROR(sqlite3_errmsg(grent_data.pDb));
-            return NSS_STATUS_UNAVAIL;
-        }
-        if(!(sql = get_query(grent_data.pDb, "setgrent")) ) {
-            NSS_ERROR(sqlite3_errmsg(grent_data.pDb));
-            sqlite3_close(grent_data.pDb);
-            return NSS_STATUS_UNAVAIL;
-        }
-        if(sqlite3_prepare(grent_data.pDb, sql, -1, &grent_data.pSt, NULL) != SQLITE_OK) {
-            NSS_ERROR(sqlite3_errmsg(grent_data.pDb));
-            sqlite3_finalize(grent_data.pSt);
-            sqlite3_close(grent_data.pDb);
-            free(sql);
-            return NSS_STATUS_UNAVAIL;
-        }
-    }
-    free(sql);
+    nss_ent_rewind(&grent_data);
     pthread_mutex_unlock(&grent_mutex);
+    nss_capture(NSS_CAP_SETGRENT, NULL, 0, 0, NSS_STATUS_SUCCESS, t0);
+    NSS_PROBE1(setgrent_return, NSS_STATUS_SUCCESS);
     return NSS_STATUS_SUCCESS;
 }
 
@@ -92,14 +89,14 @@ enum nss_status _nss_sqlite_setgrent(void) {
  * Finalize grent functions.
  */
 enum nss_status _nss_sqlite_endgrent(void) {
+    uint64_t t0 = nss_capture_start();
     NSS_DEBUG("endgrent: finalizing group serial access facilities\n");
+    NSS_PROBE(endgrent_entry);
     pthread_mutex_lock(&grent_mutex);
-    if(grent_data.pDb != NULL) {
-        sqlite3_finalize(grent_data.pSt);
-        sqlite3_close(grent_data.pDb);
-        grent_data.pDb = NULL;
-    }
+    nss_ent_close(&grent_data);
     pthread_mutex_unlock(&grent_mutex);
+    nss_capture(NSS_CAP_ENDGRENT, NULL, 0, 0, NSS_STATUS_SUCCESS, t0);
+    NSS_PROBE1(endgrent_return, NSS_STATUS_SUCCESS);
     return NSS_STATUS_SUCCESS;
 }
 
@@ -115,44 +112,87 @@ enum nss_status _nss_sqlite_endgrent(void) {
 enum nss_status
 _nss_sqlite_getgrent_r(struct group *gbuf, char *buf,
                       size_t buflen, int *errnop) {
+    uint64_t t0 = nss_capture_start();
+    struct group* entry;
+    struct nss_db* db;
     int res;
     NSS_DEBUG("getgrent_r\n");
+    NSS_PROBE(getgrent_entry);
+    nss_db_deadline_start();
     pthread_mutex_lock(&grent_mutex);
 
-    if(grent_data.pDb == NULL) {
-        _nss_sqlite_setgrent();
+    res = nss_ent_next(&grent_data, (void**)&entry);
+    if(res == NSS_STATUS_SUCCESS) {
+        NSS_DEBUG("getgrent_r: fetched group #%d: %s\n", entry->gr_gid, entry->gr_name);
+        /* members are read in their own short transaction */
+        if(!(db = nss_db_acquire(nss_passwd_db()))) {
+            res = NSS_STATUS_UNAVAIL;
+        } else {
+            res = fill_group(db, gbuf, buf, buflen, *entry, errnop);
+            nss_db_finish(db, res);
+        }
+        /* on ERANGE the same entry is returned by next call */
+        if(res == NSS_STATUS_SUCCESS) {
+            nss_ent_advance(&grent_data);
+        }
+    }
+
+    pthread_mutex_unlock(&grent_mutex);
+    nss_db_deadline_end();
+    nss_capture(NSS_CAP_GETGRENT, NULL, 0, buflen, res, t0);
+    NSS_PROBE1(getgrent_return, res);
+    return res;
+}
+
+/*
+ * Look group up by name in one database file.
+ */
+static enum nss_status getgrnam_in(const char* path, const char* name, struct group *gbuf,
+               char *buf, size_t buflen, int *errnop) {
+    struct nss_db *db;
+    struct sqlite3_stmt* pSt;
+    struct group entry;
+    int res;
+
+    if(!(db = nss_db_acquire(path))) {
+        return NSS_STATUS_UNAVAIL;
     }
 
-    if(grent_data.try_again) {
-        res = fill_group(grent_data.pDb, gbuf, buf, buflen, grent_data.entry, errnop);
-        /* buffer was long enough this time */
-        if(res != NSS_STATUS_TRYAGAIN || (*errnop) != ERANGE) {
-            grent_data.try_again = 0;
-            pthread_mutex_unlock(&grent_mutex);
+    if((pSt = nss_db_stmt(db, "getgrnam_r_packed")) != NULL) {
+        if(sqlite3_bind_text(pSt, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
+            NSS_ERROR(sqlite3_errmsg(db->pDb));
+            nss_db_release(db);
+            return NSS_STATUS_UNAVAIL;
+        }
+        res = res2nss_status(nss_db_step(pSt));
+        if(res == NSS_STATUS_SUCCESS) {
+            res = fill_group_packed(db, gbuf, buf, buflen, pSt, errnop);
+        }
+        if(res != NSS_STATUS_RETURN) {
+            nss_db_finish(db, res);
             return res;
         }
     }
 
-    res = res2nss_status(sqlite3_step(grent_data.pSt), grent_data.pDb, grent_data.pSt);
-    if(res != NSS_STATUS_SUCCESS) {
-        grent_data.pDb = NULL;
-        pthread_mutex_unlock(&grent_mutex);
-        return res;
+    if(!(pSt = nss_db_stmt(db, "getgrnam_r"))) {
+        nss_db_discard(db);
+        return NSS_STATUS_UNAVAIL;
     }
 
-    fill_group_sql(&grent_data.entry, grent_data.pSt);
-    NSS_DEBUG("getgrent_r: fetched group #%d: %s\n", grent_data.entry.gr_gid, grent_data.entry.gr_name);
-
-    res = fill_group(grent_data.pDb, gbuf, buf, buflen, grent_data.entry, errnop);
-    if(res == NSS_STATUS_TRYAGAIN && (*errnop) == ERANGE) {
-        /* cache result for next try */
-        grent_data.try_again = 1;
+    if(sqlite3_bind_text(pSt, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
+        NSS_ERROR(sqlite3_errmsg(db->pDb));
+        nss_db_release(db);
+        return NSS_STATUS_UNAVAIL;
+    }
 
-        pthread_mutex_unlock(&grent_mutex);
-        return NSS_STATUS_TRYAGAIN;
+    res = res2nss_status(nss_db_step(pSt));
+    if(res == NSS_STATUS_SUCCESS) {
+        fill_group_sql(&entry, pSt);
+        res = fill_group(db, gbuf, buf, buflen, entry, errnop);
     }
-    pthread_mutex_unlock(&grent_mutex);
-    return NSS_STATUS_SUCCESS;
+
+    nss_db_finish(db, res);
+    return res;
 }
 
 /**
@@ -168,55 +208,79 @@ _nss_sqlite_getgrent_r(struct group *gbuf, char *buf,
 enum nss_status
 _nss_sqlite_getgrnam_r(const char* name, struct group *gbuf,
                       char *buf, size_t buflen, int *errnop) {
-    sqlite3 *pDb;
+    uint64_t t0 = nss_capture_start();
+    const char* paths[NSS_SHARD_MAX];
+    struct nss_flight* f;
+    uint64_t stamp;
+    int i, n, res = NSS_STATUS_NOTFOUND;
+
+    NSS_DEBUG("getgrnam_r : looking for group %s\n", name);
+    NSS_PROBE1(getgrnam_entry, name);
+    nss_db_deadline_start();
+
+    if(!nss_shm_get(NSS_CAP_GETGRNAM, name, 0, copy_group, gbuf, buf, buflen, errnop, &res, &stamp)
+       && !nss_flight_join(&f, NSS_CAP_GETGRNAM, name, 0, copy_group, gbuf, buf, buflen, errnop, &res)) {
+        n = nss_shard_name(nss_passwd_db(), name, paths);
+        for(i = 0 ; i < n && res == NSS_STATUS_NOTFOUND ; ++i) {
+            res = getgrnam_in(paths[i], name, gbuf, buf, buflen, errnop);
+        }
+        nss_flight_end(f, res, gbuf);
+        nss_shm_put(NSS_CAP_GETGRNAM, name, 0, stamp, res, gbuf);
+    }
+    nss_db_deadline_end();
+    nss_capture(NSS_CAP_GETGRNAM, name, 0, buflen, res, t0);
+    NSS_PROBE2(getgrnam_return, name, res);
+    return res;
+}
+
+/*
+ * Look group up by GID in one database file.
+ */
+static enum nss_status getgrgid_in(const char* path, gid_t gid, struct group *gbuf,
+               char *buf, size_t buflen, int *errnop) {
+    struct nss_db *db;
     struct sqlite3_stmt* pSt;
     struct group entry;
     int res;
-    char* sql;
 
-    NSS_DEBUG("getgrnam_r : looking for group %s\n", name);
-
-    if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &pDb) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
+    if(!(db = nss_db_acquire(path))) {
         return NSS_STATUS_UNAVAIL;
     }
 
-    if(!(sql = get_query(pDb, "getgrnam_r")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
+    if((pSt = nss_db_stmt(db, "getgrgid_r_packed")) != NULL) {
+        if(sqlite3_bind_int(pSt, 1, gid) != SQLITE_OK) {
+            NSS_ERROR(sqlite3_errmsg(db->pDb));
+            nss_db_release(db);
+            return NSS_STATUS_UNAVAIL;
+        }
+        res = res2nss_status(nss_db_step(pSt));
+        if(res == NSS_STATUS_SUCCESS) {
+            res = fill_group_packed(db, gbuf, buf, buflen, pSt, errnop);
+        }
+        if(res != NSS_STATUS_RETURN) {
+            nss_db_finish(db, res);
+            return res;
+        }
     }
 
-    if(sqlite3_prepare(pDb, sql, -1, &pSt, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
+    if(!(pSt = nss_db_stmt(db, "getgrgid_r"))) {
+        nss_db_discard(db);
         return NSS_STATUS_UNAVAIL;
     }
 
-    if(sqlite3_bind_text(pSt, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
+    if(sqlite3_bind_int(pSt, 1, gid) != SQLITE_OK) {
+        NSS_ERROR(sqlite3_errmsg(db->pDb));
+        nss_db_release(db);
         return NSS_STATUS_UNAVAIL;
     }
 
-    res = res2nss_status(sqlite3_step(pSt), pDb, pSt);
-    if(res != NSS_STATUS_SUCCESS) {
-        free(sql);
-        return res;
+    res = res2nss_status(nss_db_step(pSt));
+    if(res == NSS_STATUS_SUCCESS) {
+        fill_group_sql(&entry, pSt);
+        res = fill_group(db, gbuf, buf, buflen, entry, errnop);
     }
 
-    fill_group_sql(&entry, pSt);
-
-    res = fill_group(pDb, gbuf, buf, buflen, entry, errnop);
-
-    sqlite3_finalize(pSt);
-    sqlite3_close(pDb);
-    free(sql);
+    nss_db_finish(db, res);
     return res;
 }
 
@@ -233,125 +297,66 @@ _nss_sqlite_getgrnam_r(const char* name, struct group *gbuf,
 enum nss_status
 _nss_sqlite_getgrgid_r(gid_t gid, struct group *gbuf,
                       char *buf, size_t buflen, int *errnop) {
-     sqlite3 *pDb;
-     struct sqlite3_stmt* pSt;
-     struct group entry;
-     int res;
-     char* sql;
-
+    uint64_t t0 = nss_capture_start();
+    const char* paths[NSS_SHARD_MAX];
+    struct nss_flight* f;
+    uint64_t stamp;
+    int i, n, res = NSS_STATUS_NOTFOUND;
 
     NSS_DEBUG("getgrgid_r : looking for group #%d\n", gid);
-
-    if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &pDb) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
-    }
-
-    if(!(sql = get_query(pDb, "getgrgid_r")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
-    }
-
-    if(sqlite3_prepare(pDb, sql, -1, &pSt, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
-        return NSS_STATUS_UNAVAIL;
-    }
-
-    if(sqlite3_bind_int(pSt, 1, gid) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
-        return NSS_STATUS_UNAVAIL;
-    }
-
-    res = res2nss_status(sqlite3_step(pSt), pDb, pSt);
-    if(res != NSS_STATUS_SUCCESS) {
-        free(sql);
-        return res;
+    NSS_PROBE1(getgrgid_entry, gid);
+    nss_db_deadline_start();
+
+    if(!nss_shm_get(NSS_CAP_GETGRGID, NULL, gid, copy_group, gbuf, buf, buflen, errnop, &res, &stamp)
+       && !nss_flight_join(&f, NSS_CAP_GETGRGID, NULL, gid, copy_group, gbuf, buf, buflen, errnop, &res)) {
+        n = nss_shard_id(nss_passwd_db(), gid, paths);
+        for(i = 0 ; i < n && res == NSS_STATUS_NOTFOUND ; ++i) {
+            res = getgrgid_in(paths[i], gid, gbuf, buf, buflen, errnop);
+        }
+        nss_flight_end(f, res, gbuf);
+        nss_shm_put(NSS_CAP_GETGRGID, NULL, gid, stamp, res, gbuf);
     }
-
-    fill_group_sql(&entry, pSt);
-
-    res = fill_group(pDb, gbuf, buf, buflen, entry, errnop);
-
-    sqlite3_finalize(pSt);
-    sqlite3_close(pDb);
-    free(sql);
+    nss_db_deadline_end();
+    nss_capture(NSS_CAP_GETGRGID, NULL, gid, buflen, res, t0);
+    NSS_PROBE2(getgrgid_return, gid, res);
     return res;
-
 }
 
 /*
- * Haven't seen any detailled documentation about this function.
- * Anyway it have to fill in groups for the specified user without
- * adding his main group (group param).
- * @param user Username whose groups are wanted.
- * @param group Main group of user (should not be put in groupsp).
- * @param start Index from which groups filling must begin (initgroups_dyn
- * is called for every backend). Can be updated
- * @param size Size of groups vector. Can be modified if function needs
- * more space (should not exceed limit).
- * @param groupsp Pointer to the group vector. Can be realloc'ed if more
- * space is needed.
- * @param limit Max size of groupsp (<= 0 if no limit).
- * @param errnop Pointer to errno (filled if an error occurs).
+ * Add groups user belongs to according to one database file.
  */
-
-enum nss_status
-_nss_sqlite_initgroups_dyn(const char *user, gid_t gid, long int *start,
-                          long int *size, gid_t **groupsp, long int limit,
-                                                    int *errnop) {
-    sqlite3 *pDb;
+static enum nss_status initgroups_in(const char* path, const char *user, gid_t gid,
+               long int *start, long int *size, gid_t **groupsp, long int limit,
+               int *errnop) {
+    struct nss_db *db;
     struct sqlite3_stmt *pSt;
-    char* sql;
+    long int first = *start;
     int res;
-    NSS_DEBUG("initgroups_dyn: filling groups for user : %s, main gid : %d\n", user, gid);
-
-    if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &pDb) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
-    }
 
-    if(!(sql = get_query(pDb, "initgroups_dyn")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
+    if(!(db = nss_db_acquire(path))) {
         return NSS_STATUS_UNAVAIL;
     }
 
-    if(sqlite3_prepare(pDb, sql, -1, &pSt, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
+    if(!(pSt = nss_db_stmt(db, "initgroups_dyn"))) {
+        nss_db_discard(db);
         return NSS_STATUS_UNAVAIL;
     }
 
     if(sqlite3_bind_text(pSt, 1, user, -1, SQLITE_STATIC) != SQLITE_OK) {
         NSS_ERROR("Unable to bind username in initgroups_dyn\n");
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
+        nss_db_release(db);
         return NSS_STATUS_UNAVAIL;
     }
 
     if(sqlite3_bind_int(pSt, 2, gid) != SQLITE_OK) {
         NSS_ERROR("Unable to bind gid in initgroups_dyn\n");
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
+        nss_db_release(db);
         return NSS_STATUS_UNAVAIL;
     }
 
-    res = res2nss_status(sqlite3_step(pSt), pDb, pSt);
+    res = res2nss_status(nss_db_step(pSt));
     if(res != NSS_STATUS_SUCCESS) {
-        free(sql);
+        nss_db_finish(db, res);
         return res;
     }
 
@@ -360,147 +365,260 @@ _nss_sqlite_initgroups_dyn(const char *user, gid_t gid, long int *start,
         NSS_DEBUG("initgroups_dyn: adding group %d\n", gid);
         /* Too short, doubling size */
         if(*start == *size) {
+            gid_t* groups;
+            long int newsize;
             if(limit > 0) {
                 if(*size < limit) {
-                    *size = (limit < (*size * 2)) ? limit : (*size * 2);
+                    newsize = (limit < (*size * 2)) ? limit : (*size * 2);
                 } else {
                     /* limit reached, tell caller to try with a bigger one */
                     NSS_ERROR("initgroups_dyn: limit was too low\n");
                     *errnop = ERANGE;
-                    sqlite3_finalize(pSt);
-                    sqlite3_close(pDb);
-                    free(sql);
+                    nss_db_release(db);
                     return NSS_STATUS_TRYAGAIN;
                 }
             } else {
-                (*size) = (*size) * 2;
+                newsize = (*size) * 2;
             }
-            *groupsp = realloc(*groupsp, sizeof(**groupsp) * (*size));
+            /* groupsp belongs to the caller, it has to stay a malloc'ed block */
+            if(!(groups = realloc(*groupsp, sizeof(**groupsp) * newsize))) {
+                *errnop = ENOMEM;
+                nss_db_release(db);
+                return NSS_STATUS_TRYAGAIN;
+            }
+            *groupsp = groups;
+            *size = newsize;
         }
         (*groupsp)[*start] = gid;
         (*start)++;
-        res = sqlite3_step(pSt);
+        res = nss_db_step(pSt);
     } while(res == SQLITE_ROW);
-    *groupsp = realloc(*groupsp, sizeof(**groupsp) * (*start));
-    *size = *start;
 
-    sqlite3_finalize(pSt);
-    sqlite3_close(pDb);
-    free(sql);
+    if(res != SQLITE_DONE) {
+        /* Walk cut short (deadline, lock): a partial list is no answer */
+        NSS_ERROR("initgroups_dyn: %s\n", sqlite3_errmsg(db->pDb));
+        *start = first;
+        res = res2nss_status(res);
+        nss_db_finish(db, res);
+        return res;
+    }
+
+    nss_db_release(db);
 
     return NSS_STATUS_SUCCESS;
 }
 
 /*
- * Fills all users for a given group.
- * @param buffer Buffer which will contain all users' names headed
- * with a char* pointers area containing pointer to members' names,
- * ending by NULL.
- * @param pDb DB handle to fetch users (must be opened).
+ * Haven't seen any detailled documentation about this function.
+ * Anyway it have to fill in groups for the specified user without
+ * adding his main group (group param).
+ * @param user Username whose groups are wanted.
+ * @param group Main group of user (should not be put in groupsp).
+ * @param start Index from which groups filling must begin (initgroups_dyn
+ * is called for every backend). Can be updated
+ * @param size Size of groups vector. Can be modified if function needs
+ * more space (should not exceed limit).
+ * @param groupsp Pointer to the group vector. Can be realloc'ed if more
+ * space is needed.
+ * @param limit Max size of groupsp (<= 0 if no limit).
+ * @param errnop Pointer to errno (filled if an error occurs).
+ */
+
+enum nss_status
+_nss_sqlite_initgroups_dyn(const char *user, gid_t gid, long int *start,
+                          long int *size, gid_t **groupsp, long int limit,
+                                                    int *errnop) {
+    uint64_t t0 = nss_capture_start();
+    const char* paths[NSS_SHARD_MAX];
+    int i, n, res = NSS_STATUS_NOTFOUND, found = FALSE;
+    NSS_DEBUG("initgroups_dyn: filling groups for user : %s, main gid : %d\n", user, gid);
+    NSS_PROBE1(initgroups_dyn_entry, user);
+    nss_db_deadline_start();
+
+    /* memberships live with the user */
+    n = nss_shard_name(nss_passwd_db(), user, paths);
+    for(i = 0 ; i < n ; ++i) {
+        res = initgroups_in(paths[i], user, gid, start, size, groupsp, limit, errnop);
+        if(res == NSS_STATUS_SUCCESS) {
+            found = TRUE;
+        } else if(res != NSS_STATUS_NOTFOUND) {
+            break;
+        }
+    }
+    if(i == n) {
+        res = found ? NSS_STATUS_SUCCESS : NSS_STATUS_NOTFOUND;
+    }
+    nss_db_deadline_end();
+    nss_capture(NSS_CAP_INITGROUPS, user, gid, limit > 0 ? limit : 0, res, t0);
+    NSS_PROBE2(initgroups_dyn_return, user, res);
+    return res;
+}
+
+/*
+ * Stack members of a group found in one database file, one row per
+ * member through the get_users query.
+ * @param db DB handle to fetch users.
  * @param gid GID.
+ * @param buffer Buffer, see get_users().
  * @param buflen Buffer length.
+ * @param mcount Number of members already stacked, updated.
+ * @param names_size Bytes of names already stacked, updated.
  * @param errnop Pointer to errno, will be filled if an error occurs.
  */
-
-enum nss_status get_users(sqlite3* pDb, gid_t gid, char* buffer, size_t buflen, int* errnop) {
+static enum nss_status get_joined_in(struct nss_db* db, gid_t gid, char* buffer, size_t buflen,
+               int* mcount, size_t* names_size, int* errnop) {
     struct sqlite3_stmt *pSt;
-    int res, msize = 20, mcount = 0, i, ptr_area_size;
-    char* sql;
-    char* next_member;
-    char **members;
+    int res;
     char **ptr_area = (char**)buffer;
+    char *names = buffer + buflen - *names_size;
 
-    NSS_DEBUG("get_users: looking for members of group #%d\n", gid);
-    
-    if(!(sql = get_query(pDb, "get_users")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
-    }
-
-    if(sqlite3_prepare(pDb, sql, strlen(sql), &pSt, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
+    if(!(pSt = nss_db_stmt(db, "get_users"))) {
         return NSS_STATUS_UNAVAIL;
     }
 
     if(sqlite3_bind_int(pSt, 1, gid) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
+        NSS_ERROR(sqlite3_errmsg(db->pDb));
         return NSS_STATUS_UNAVAIL;
-        free(sql);
     }
 
-    res = sqlite3_step(pSt);
+    /* Here is what we want to get :
+     * __________________________________________________
+     * ...|@1|@2|@3|...|NULL|.......|member3|member2|member1
+     * --------------------------------------------------
+     *    ^ gr_mem
+     */
+    while((res = nss_db_step(pSt)) == SQLITE_ROW) {
+        const char* member = (const char*)sqlite3_column_text(pSt, 0);
+        size_t l;
 
-    if(res != SQLITE_ROW) {
-        sqlite3_finalize(pSt);
-        if(res == SQLITE_DONE) {
-            NSS_DEBUG("get_users: No member found\n");
-            if(buflen < sizeof(char*)) {
-                *errnop = ERANGE;
-                free(sql);
-                return NSS_STATUS_TRYAGAIN;
-            }
-            ptr_area[0] = NULL;
-            free(sql);
-            return NSS_STATUS_SUCCESS;
+        if(member == NULL) {
+            continue;
         }
-        free(sql);
-        return NSS_STATUS_UNAVAIL;
+        l = sqlite3_column_bytes(pSt, 0) + 1;
+        /* room for this member's pointer and the final NULL */
+        if((*mcount + 2) * sizeof(char*) + *names_size + l > buflen) {
+            sqlite3_reset(pSt);
+            (*errnop) = ERANGE;
+            return NSS_STATUS_TRYAGAIN;
+        }
+        names -= l;
+        memcpy(names, member, l);
+        *names_size += l;
+        ptr_area[(*mcount)++] = names;
     }
+    sqlite3_reset(pSt);
 
-    /* members is a buffer to temporary hold members (we need to know the count
-     * before going further) and SQLite doesn't seems to offer such a
-     * functionnality. */
-    members = (char**)malloc(msize * sizeof(char*));
-    do {
-        const unsigned char* member = sqlite3_column_text(pSt, 0);
+    if(res != SQLITE_DONE) {
+        return res2nss_status(res);
+    }
+    return NSS_STATUS_SUCCESS;
+}
 
-        if(msize == mcount) {
-            msize *= 2;
-            members = (char**)realloc(members, msize * sizeof(char*));
-        }
-        members[mcount] = strdup((char*)member);
-        ++mcount;
-        res = sqlite3_step(pSt);
-    } while(res == SQLITE_ROW);
+/*
+ * Stack members of a group found in one database file. The packed
+ * group_members row is used when the database has one: its size is
+ * known before anything is copied and names are copied at once.
+ * Parameters are those of get_joined_in().
+ */
+static enum nss_status get_users_in(struct nss_db* db, gid_t gid, char* buffer, size_t buflen,
+               int* mcount, size_t* names_size, int* errnop) {
+    struct sqlite3_stmt *pSt;
+    const char *members, *p, *end;
+    char **ptr_area = (char**)buffer;
+    char *names;
+    int res, count, nuls;
+    size_t len;
 
-    free(sql);
-    sqlite3_finalize(pSt);
+    if(!(pSt = nss_db_stmt(db, "get_members"))) {
+        return get_joined_in(db, gid, buffer, buflen, mcount, names_size, errnop);
+    }
 
-    /* Here is what we want to get :
-     * __________________________________________________
-     * ...|@1|@2|@3|...|NULL|member1|member2|member3|...
-     * --------------------------------------------------
-     *    ^ gr_mem
-     */
+    if(sqlite3_bind_int(pSt, 1, gid) != SQLITE_OK) {
+        NSS_ERROR(sqlite3_errmsg(db->pDb));
+        return NSS_STATUS_UNAVAIL;
+    }
 
-    /* Let's build addresses part */
-    ptr_area_size = (mcount + 1) * sizeof(char *);
+    res = nss_db_step(pSt);
+    if(res != SQLITE_ROW) {
+        /* No row, no member in this database */
+        sqlite3_reset(pSt);
+        return res == SQLITE_DONE ? NSS_STATUS_SUCCESS : res2nss_status(res);
+    }
+
+    count = sqlite3_column_int(pSt, 0);
+    members = sqlite3_column_blob(pSt, 1);
+    len = sqlite3_column_bytes(pSt, 1);
+    end = members + len;
+    for(p = members, nuls = 0 ; p < end && (p = memchr(p, '\0', end - p)) != NULL ; ++p, ++nuls);
+    if(nuls != count || (len > 0 && end[-1] != '\0')) {
+        NSS_ERROR("get_users: packed members of group #%d do not match member_count\n", gid);
+        sqlite3_reset(pSt);
+        return get_joined_in(db, gid, buffer, buflen, mcount, names_size, errnop);
+    }
 
-    if(buflen < ptr_area_size) {
-        free_2Dtable(members, mcount);
+    /* room for every pointer and the final NULL */
+    if((*mcount + count + 1) * sizeof(char*) + *names_size + len > buflen) {
+        sqlite3_reset(pSt);
         (*errnop) = ERANGE;
         return NSS_STATUS_TRYAGAIN;
     }
+    names = buffer + buflen - *names_size - len;
+    memcpy(names, members, len);
+    sqlite3_reset(pSt);
+
+    *names_size += len;
+    while(count-- > 0) {
+        ptr_area[(*mcount)++] = names;
+        names += strlen(names) + 1;
+    }
+    return NSS_STATUS_SUCCESS;
+}
 
-    next_member = buffer + ptr_area_size;
-    buflen -= ptr_area_size;
-    for(i = 0 ; i < mcount ; ++i) {
-        int l = strlen(members[i]) + 1;
-        if(buflen < l) {
-            free_2Dtable(members, mcount);
-            (*errnop) = ERANGE;
+/*
+ * Fills all users for a given group.
+ * Members' names are stacked from the end of the buffer while pointers
+ * grow from its start, so nothing has to be counted or copied twice.
+ * Members live with their user, so every shard is asked.
+ * @param db DB handle to fetch users.
+ * @param gid GID.
+ * @param buffer Buffer which will contain all users' names headed
+ * with a char* pointers area containing pointer to members' names,
+ * ending by NULL. Must be suitably aligned for pointers.
+ * @param buflen Buffer length.
+ * @param errnop Pointer to errno, will be filled if an error occurs.
+ */
+
+enum nss_status get_users(struct nss_db* db, gid_t gid, char* buffer, size_t buflen, int* errnop) {
+    const char* paths[NSS_SHARD_MAX];
+    int i, n, res = NSS_STATUS_SUCCESS, mcount = 0;
+    size_t names_size = 0;
+
+    NSS_DEBUG("get_users: looking for members of group #%d\n", gid);
+
+    n = nss_shard_all(nss_passwd_db(), paths);
+    for(i = 0 ; i < n && res == NSS_STATUS_SUCCESS ; ++i) {
+        struct nss_db* sdb = db;
+        if(strcmp(paths[i], nss_db_path(db)) != 0) {
+            if(!(sdb = nss_db_acquire(paths[i]))) {
+                return NSS_STATUS_UNAVAIL;
+            }
+        }
+        res = get_users_in(sdb, gid, buffer, buflen, &mcount, &names_size, errnop);
+        if(sdb != db) {
+            nss_db_finish(sdb, res);
+        }
+    }
+    if(res != NSS_STATUS_SUCCESS) {
+        return res;
+    }
+
+    if(mcount == 0) {
+        NSS_DEBUG("get_users: No member found\n");
+        if(buflen < sizeof(char*)) {
+            *errnop = ERANGE;
             return NSS_STATUS_TRYAGAIN;
         }
-        strcpy(next_member, members[i]);
-        ptr_area[i] = next_member;
-        buflen -= l;
-        next_member  += l;
-    }
-    ptr_area[i] = NULL;
-    free_2Dtable(members, mcount);
-    return TRUE;
+    }
+    ((char**)buffer)[mcount] = NULL;
+    return NSS_STATUS_SUCCESS;
 }
-
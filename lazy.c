@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * lazy.c : Load SQLite when the module first needs it.
+ *
+ * Most processes loading the module never get to use it, their
+ * lookups are answered by the sources before it in nsswitch.conf or by
+ * the shared cache. Loading SQLite on first database access spares
+ * them the cost of mapping and relocating it.
+ */
+
+#define NSS_SQLITE3_LOADER
+
+#include "nss-sqlite.h"
+
+#if NSS_SQLITE_LAZY
+
+#include <dlfcn.h>
+#include <pthread.h>
+
+struct nss_sqlite3_api nss_sqlite3;
+
+static pthread_once_t load_once = PTHREAD_ONCE_INIT;
+static int loaded = FALSE;
+
+static void nss_sqlite3_open(void) {
+    void* lib;
+
+    if(!(lib = dlopen(NSS_SQLITE_LIBRARY, RTLD_NOW | RTLD_LOCAL))) {
+        NSS_ERROR("%s\n", dlerror());
+        return;
+    }
+#define NSS_SQLITE3_SYM(f) \
+    if(!(nss_sqlite3.f = (__typeof__(f)*)dlsym(lib, #f))) { \
+        NSS_ERROR("%s: %s missing\n", NSS_SQLITE_LIBRARY, #f); \
+        return; \
+    }
+    NSS_SQLITE3_FUNCS(NSS_SQLITE3_SYM)
+#undef NSS_SQLITE3_SYM
+    /* The library stays loaded for the life of the process */
+    __atomic_store_n(&loaded, TRUE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Load SQLite and resolve the functions the module uses.
+ * @return TRUE if SQLite is usable.
+ */
+int nss_sqlite3_load(void) {
+    if(__atomic_load_n(&loaded, __ATOMIC_ACQUIRE)) {
+        return TRUE;
+    }
+    pthread_once(&load_once, nss_sqlite3_open);
+    return __atomic_load_n(&loaded, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Whether SQLite was loaded already, without loading it.
+ */
+int nss_sqlite3_loaded(void) {
+    return __atomic_load_n(&loaded, __ATOMIC_ACQUIRE);
+}
+
+#endif
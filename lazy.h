@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * lazy.h : Access to SQLite, optionally loaded on first use.
+ *
+ * With --enable-lazy-sqlite the module is not linked against SQLite.
+ * Every SQLite function it calls is then a pointer of nss_sqlite3,
+ * filled by nss_sqlite3_load(), which must have succeeded before any
+ * of them is used. Database accesses all start with nss_db_acquire(),
+ * which loads SQLite, so only code running outside of a handle (e.g.
+ * statistics) has to check with nss_sqlite3_loaded().
+ */
+
+#ifndef NSS_SQLITE_LAZY_H
+#define NSS_SQLITE_LAZY_H
+
+#include <sqlite3.h>
+
+#if NSS_SQLITE_LAZY
+
+/* Every SQLite function the module uses */
+#define NSS_SQLITE3_FUNCS(X) \
+    X(sqlite3_bind_int) \
+    X(sqlite3_bind_int64) \
+    X(sqlite3_bind_text) \
+    X(sqlite3_busy_handler) \
+    X(sqlite3_clear_bindings) \
+    X(sqlite3_close) \
+    X(sqlite3_column_blob) \
+    X(sqlite3_column_bytes) \
+    X(sqlite3_column_int) \
+    X(sqlite3_column_int64) \
+    X(sqlite3_column_text) \
+    X(sqlite3_column_type) \
+    X(sqlite3_compileoption_used) \
+    X(sqlite3_config) \
+    X(sqlite3_db_config) \
+    X(sqlite3_db_handle) \
+    X(sqlite3_db_release_memory) \
+    X(sqlite3_db_status) \
+    X(sqlite3_errcode) \
+    X(sqlite3_errmsg) \
+    X(sqlite3_exec) \
+    X(sqlite3_expanded_sql) \
+    X(sqlite3_finalize) \
+    X(sqlite3_free) \
+    X(sqlite3_mprintf) \
+    X(sqlite3_open_v2) \
+    X(sqlite3_prepare_v2) \
+    X(sqlite3_progress_handler) \
+    X(sqlite3_reset) \
+    X(sqlite3_soft_heap_limit64) \
+    X(sqlite3_sql) \
+    X(sqlite3_status64) \
+    X(sqlite3_step) \
+    X(sqlite3_stmt_busy) \
+    X(sqlite3_stmt_status) \
+    X(sqlite3_trace_v2)
+
+struct nss_sqlite3_api {
+#define NSS_SQLITE3_FIELD(f) __typeof__(f)* f;
+    NSS_SQLITE3_FUNCS(NSS_SQLITE3_FIELD)
+#undef NSS_SQLITE3_FIELD
+};
+
+extern struct nss_sqlite3_api nss_sqlite3;
+
+int nss_sqlite3_load(void);
+int nss_sqlite3_loaded(void);
+
+/* lazy.c itself needs the real names */
+#ifndef NSS_SQLITE3_LOADER
+#define sqlite3_bind_int (nss_sqlite3.sqlite3_bind_int)
+#define sqlite3_bind_int64 (nss_sqlite3.sqlite3_bind_int64)
+#define sqlite3_bind_text (nss_sqlite3.sqlite3_bind_text)
+#define sqlite3_busy_handler (nss_sqlite3.sqlite3_busy_handler)
+#define sqlite3_clear_bindings (nss_sqlite3.sqlite3_clear_bindings)
+#define sqlite3_close (nss_sqlite3.sqlite3_close)
+#define sqlite3_column_blob (nss_sqlite3.sqlite3_column_blob)
+#define sqlite3_column_bytes (nss_sqlite3.sqlite3_column_bytes)
+#define sqlite3_column_int (nss_sqlite3.sqlite3_column_int)
+#define sqlite3_column_int64 (nss_sqlite3.sqlite3_column_int64)
+#define sqlite3_column_text (nss_sqlite3.sqlite3_column_text)
+#define sqlite3_column_type (nss_sqlite3.sqlite3_column_type)
+#define sqlite3_compileoption_used (nss_sqlite3.sqlite3_compileoption_used)
+#define sqlite3_config (nss_sqlite3.sqlite3_config)
+#define sqlite3_db_config (nss_sqlite3.sqlite3_db_config)
+#define sqlite3_db_handle (nss_sqlite3.sqlite3_db_handle)
+#define sqlite3_db_release_memory (nss_sqlite3.sqlite3_db_release_memory)
+#define sqlite3_db_status (nss_sqlite3.sqlite3_db_status)
+#define sqlite3_errcode (nss_sqlite3.sqlite3_errcode)
+#define sqlite3_errmsg (nss_sqlite3.sqlite3_errmsg)
+#define sqlite3_exec (nss_sqlite3.sqlite3_exec)
+#define sqlite3_expanded_sql (nss_sqlite3.sqlite3_expanded_sql)
+#define sqlite3_finalize (nss_sqlite3.sqlite3_finalize)
+#define sqlite3_free (nss_sqlite3.sqlite3_free)
+#define sqlite3_mprintf (nss_sqlite3.sqlite3_mprintf)
+#define sqlite3_open_v2 (nss_sqlite3.sqlite3_open_v2)
+#define sqlite3_prepare_v2 (nss_sqlite3.sqlite3_prepare_v2)
+#define sqlite3_progress_handler (nss_sqlite3.sqlite3_progress_handler)
+#define sqlite3_reset (nss_sqlite3.sqlite3_reset)
+#define sqlite3_soft_heap_limit64 (nss_sqlite3.sqlite3_soft_heap_limit64)
+#define sqlite3_sql (nss_sqlite3.sqlite3_sql)
+#define sqlite3_status64 (nss_sqlite3.sqlite3_status64)
+#define sqlite3_step (nss_sqlite3.sqlite3_step)
+#define sqlite3_stmt_busy (nss_sqlite3.sqlite3_stmt_busy)
+#define sqlite3_stmt_status (nss_sqlite3.sqlite3_stmt_status)
+#define sqlite3_trace_v2 (nss_sqlite3.sqlite3_trace_v2)
+#endif
+
+#else
+
+#define nss_sqlite3_load() TRUE
+#define nss_sqlite3_loaded() TRUE
+
+#endif
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * libnss-sqlite.h : Public interface of libnss_sqlite beyond the NSS
+ * entry points. Programs wanting it link with -lnss_sqlite.
+ */
+
+#ifndef LIBNSS_SQLITE_H
+#define LIBNSS_SQLITE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Process wide counters. All values are cumulative since the module
+ * was loaded unless stated otherwise.
+ */
+struct nss_sqlite_stats {
+    unsigned long long lookups;         /* database accesses started */
+    unsigned long long db_opens;        /* database handles opened */
+    unsigned long long db_reuses;       /* lookups served by a pooled handle */
+    unsigned long long db_discards;     /* handles closed after an error or
+                                           a database file replacement */
+    unsigned long long stmt_prepares;   /* statements compiled */
+    unsigned long long stmt_reuses;     /* statements served from cache */
+    unsigned long long arena_bytes;     /* bytes handed out by thread arenas */
+    unsigned long long arena_overflows; /* arena fell back to malloc */
+    unsigned long long lookaside_hits;  /* SQLite allocations satisfied by
+                                           the handles' lookaside buffers */
+    unsigned long long lookaside_misses;/* ... and those which were not */
+    unsigned long long breaker_trips;   /* databases given up on after
+                                           breaker_threshold failures */
+    unsigned long long breaker_rejects; /* accesses failed at once meanwhile */
+    long long sqlite_memory;            /* current SQLite heap usage, process
+                                           wide (needs memory statistics) */
+    long long sqlite_malloc_count;      /* current SQLite heap allocations */
+};
+
+/*
+ * Copy current counters into st.
+ */
+void nss_sqlite_get_stats(struct nss_sqlite_stats* st);
+
+/*
+ * Memory the module holds in the calling process. Per handle figures
+ * only cover handles idle in the pools; pages read through the
+ * mmap_size mapping are shared with other processes and not included.
+ */
+struct nss_sqlite_footprint {
+    long long handles;                  /* open database handles */
+    long long idle_handles;             /* ... of which idle in the pools */
+    long long cache_bytes;              /* page cache of idle handles */
+    long long schema_bytes;             /* schemas of idle handles */
+    long long stmt_bytes;               /* compiled statements of idle
+                                           handles */
+    long long lookaside_bytes;          /* lookaside buffers of all handles */
+    long long sqlite_memory;            /* current SQLite heap usage, process
+                                           wide */
+    long long sqlite_memory_highwater;  /* ... and its highest value */
+    long long memory_limit;             /* SQLite soft heap limit, 0 if none */
+};
+
+/*
+ * Copy current memory figures into fp.
+ */
+void nss_sqlite_get_footprint(struct nss_sqlite_footprint* fp);
+
+/* Kinds of entries nss_sqlite_dump() walks, may be or'ed together */
+#define NSS_SQLITE_DUMP_PASSWD 1
+#define NSS_SQLITE_DUMP_GROUP  2
+#define NSS_SQLITE_DUMP_SHADOW 4
+
+/*
+ * Called for every dumped entry. entry points to a struct passwd,
+ * struct group or struct spwd according to kind, which is only valid
+ * during the call. Returning non zero stops the dump, which then
+ * returns that value.
+ */
+typedef int (*nss_sqlite_dump_fn)(void* ctx, int kind, const void* entry);
+
+/*
+ * Hand every entry of the kinds in what to fn. Each database file is
+ * read in a single transaction so entries of one file are consistent
+ * with each other. With threads > 1, fn is called concurrently from up
+ * to that many threads and entries do not come in key order. Returns 0
+ * once everything was dumped, -1 on database errors.
+ */
+int nss_sqlite_dump(int what, int threads, nss_sqlite_dump_fn fn, void* ctx);
+
+/* Lookups nss_sqlite_submit() runs */
+#define NSS_SQLITE_GETPWNAM 1
+#define NSS_SQLITE_GETPWUID 2
+#define NSS_SQLITE_GETGRNAM 3
+#define NSS_SQLITE_GETGRGID 4
+#define NSS_SQLITE_GETSPNAM 5
+
+/*
+ * Asynchronous lookup. The caller fills everything up to ctx, then
+ * keeps the request, the name and the buffers alive until completion.
+ */
+struct nss_sqlite_request {
+    int func;                       /* NSS_SQLITE_GET* */
+    const char* name;               /* key of lookups by name */
+    unsigned int id;                /* uid or gid of lookups by id */
+    void* result;                   /* struct passwd, group or spwd */
+    char* buf;                      /* room for result's strings */
+    size_t buflen;
+    void (*done)(struct nss_sqlite_request* req);
+                                    /* completion callback, called from a
+                                       worker thread, or NULL to use
+                                       nss_sqlite_async_fd() */
+    void* ctx;                      /* for the caller */
+    int status;                     /* enum nss_status of the lookup */
+    int err;                        /* its errno, ERANGE if buf is too
+                                       small (status NSS_STATUS_TRYAGAIN) */
+    struct nss_sqlite_request* next;/* completed list, private before */
+};
+
+/*
+ * Queue req for the module's worker threads (async_threads setting),
+ * which are started on first use and never block the caller. Returns 0,
+ * or -1 with errno set to EINVAL for a malformed request or EAGAIN if
+ * no worker could be started. Requests queued behind each other with
+ * the same func are run together. Queued requests are lost in a child
+ * after fork().
+ */
+int nss_sqlite_submit(struct nss_sqlite_request* req);
+
+/*
+ * eventfd, to be polled for reading, signalled when requests without
+ * callback complete. Returns -1 if it could not be created.
+ */
+int nss_sqlite_async_fd(void);
+
+/*
+ * Take requests without callback completed so far, linked through
+ * next in completion order, NULL if none. Clears the eventfd.
+ */
+struct nss_sqlite_request* nss_sqlite_completed(void);
+
+/* Cursor over the members of a group, see nss_sqlite_members_open() */
+struct nss_sqlite_members;
+
+/*
+ * Start reading the members of group gid, nested groups included, for
+ * groups too large to be read at once with getgrgid_r(). No database is
+ * accessed until nss_sqlite_members_next(). Returns NULL when out of
+ * memory.
+ */
+struct nss_sqlite_members* nss_sqlite_members_open(unsigned int gid);
+
+/*
+ * Copy the next members into buf, each name followed by a NUL byte, as
+ * many as fit. Returns the number of names copied, 0 once every member
+ * was returned, or -1 with errno set to ERANGE if the next name does
+ * not fit in buflen, ENOSYS if the database lacks the get_members_page
+ * query, or EIO. Members added or removed between two calls may be
+ * missed, others are returned once.
+ */
+int nss_sqlite_members_next(struct nss_sqlite_members* it, char* buf, size_t buflen);
+
+void nss_sqlite_members_close(struct nss_sqlite_members* it);
+
+/*
+ * Whether user belongs to group gid, directly or through nested groups,
+ * with a single index lookup. Returns 1 or 0, -1 on errors (errno set
+ * as by nss_sqlite_members_next()).
+ */
+int nss_sqlite_is_member(const char* user, unsigned int gid);
+
+/*
+ * Number of members of group gid, read from group_members without
+ * going through them. Returns -1 on errors.
+ */
+long long nss_sqlite_count_members(unsigned int gid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
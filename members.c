@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * members.c : Group membership queries exported to applications.
+ *
+ * getgrgid_r() has to hand every member at once, which takes buffers of
+ * megabytes for the largest groups. Here members are read page by page
+ * through the get_members_page query, keyed by uid like getXXent, so
+ * no read transaction is held between two calls. Checking a single
+ * membership or counting members reads one index entry.
+ */
+
+#include "nss-sqlite.h"
+#include "db.h"
+#include "libnss-sqlite.h"
+#include "settings.h"
+#include "shard.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct nss_sqlite_members {
+    unsigned int gid;
+    int shard;                  /* index in nss_shard_all() order */
+    sqlite3_int64 last_uid;     /* last member returned from it */
+};
+
+/*
+ * Error out of a database access with errno set. Only errors of
+ * nss_db_step() may come from the handle itself and discard it.
+ * @param status nss_status to finish the handle with.
+ */
+static int nss_members_fail(struct nss_db* db, int status, int err) {
+    nss_db_finish(db, status);
+    nss_db_deadline_end();
+    errno = err;
+    return -1;
+}
+
+/*
+ * Get a statement of nss_queries with gid bound to its first
+ * parameter, or to its second one after name when given. errno is
+ * set to ENOSYS when the query is missing, EIO when binding failed.
+ */
+static sqlite3_stmt* nss_members_stmt(struct nss_db* db, const char* query, const char* name,
+                                      unsigned int gid) {
+    sqlite3_stmt* pSt;
+    int i = 1;
+
+    if(!(pSt = nss_db_stmt(db, query))) {
+        NSS_ERROR("%s: no such query\n", query);
+        errno = ENOSYS;
+        return NULL;
+    }
+    if((name != NULL && sqlite3_bind_text(pSt, i++, name, -1, SQLITE_STATIC) != SQLITE_OK) ||
+       sqlite3_bind_int64(pSt, i, gid) != SQLITE_OK) {
+        NSS_ERROR(sqlite3_errmsg(db->pDb));
+        errno = EIO;
+        return NULL;
+    }
+    return pSt;
+}
+
+struct nss_sqlite_members* nss_sqlite_members_open(unsigned int gid) {
+    struct nss_sqlite_members* it;
+
+    if(!(it = malloc(sizeof(*it)))) {
+        return NULL;
+    }
+    it->gid = gid;
+    it->shard = 0;
+    it->last_uid = INT64_MIN;
+    return it;
+}
+
+/*
+ * Copy the members following the last one returned, each followed by a
+ * NUL byte, as many as fit in buf. Rows are read in uid order and the
+ * statement is reset as soon as buf is full.
+ */
+int nss_sqlite_members_next(struct nss_sqlite_members* it, char* buf, size_t buflen) {
+    const char* paths[NSS_SHARD_MAX];
+    struct nss_db* db;
+    sqlite3_stmt* pSt;
+    size_t used = 0;
+    int n, count = 0, res;
+
+    nss_db_deadline_start();
+    while(count == 0 && it->shard < (n = nss_shard_all(nss_passwd_db(), paths))) {
+        if(!(db = nss_db_acquire(paths[it->shard]))) {
+            nss_db_deadline_end();
+            errno = EIO;
+            return -1;
+        }
+        if(!(pSt = nss_members_stmt(db, "get_members_page", NULL, it->gid))) {
+            return nss_members_fail(db, NSS_STATUS_NOTFOUND, errno);
+        }
+        if(sqlite3_bind_int64(pSt, 2, it->last_uid) != SQLITE_OK) {
+            NSS_ERROR(sqlite3_errmsg(db->pDb));
+            return nss_members_fail(db, NSS_STATUS_NOTFOUND, EIO);
+        }
+        while((res = nss_db_step(pSt)) == SQLITE_ROW) {
+            const char* name = (const char*)sqlite3_column_text(pSt, 0);
+            size_t l = sqlite3_column_bytes(pSt, 0) + 1;
+
+            if(name == NULL) {
+                continue;
+            }
+            if(used + l > buflen) {
+                break;
+            }
+            memcpy(buf + used, name, l);
+            used += l;
+            count++;
+            it->last_uid = sqlite3_column_int64(pSt, 1);
+        }
+        sqlite3_reset(pSt);
+        if(res != SQLITE_ROW && res != SQLITE_DONE) {
+            return nss_members_fail(db, NSS_STATUS_UNAVAIL, EIO);
+        }
+        nss_db_release(db);
+
+        if(res == SQLITE_ROW && count == 0) {
+            nss_db_deadline_end();
+            errno = ERANGE;
+            return -1;
+        }
+        if(res == SQLITE_DONE) {
+            /* This file is done with, go on with the next one */
+            it->shard++;
+            it->last_uid = INT64_MIN;
+        }
+    }
+    nss_db_deadline_end();
+    return count;
+}
+
+void nss_sqlite_members_close(struct nss_sqlite_members* it) {
+    free(it);
+}
+
+int nss_sqlite_is_member(const char* user, unsigned int gid) {
+    const char* paths[NSS_SHARD_MAX];
+    struct nss_db* db;
+    sqlite3_stmt* pSt;
+    int i, n, res = SQLITE_DONE;
+
+    nss_db_deadline_start();
+    n = nss_shard_name(nss_passwd_db(), user, paths);
+    for(i = 0 ; i < n && res == SQLITE_DONE ; ++i) {
+        if(!(db = nss_db_acquire(paths[i]))) {
+            nss_db_deadline_end();
+            errno = EIO;
+            return -1;
+        }
+        if(!(pSt = nss_members_stmt(db, "is_member", user, gid))) {
+            return nss_members_fail(db, NSS_STATUS_NOTFOUND, errno);
+        }
+        res = nss_db_step(pSt);
+        sqlite3_reset(pSt);
+        if(res != SQLITE_ROW && res != SQLITE_DONE) {
+            return nss_members_fail(db, NSS_STATUS_UNAVAIL, EIO);
+        }
+        nss_db_release(db);
+    }
+    nss_db_deadline_end();
+    return res == SQLITE_ROW;
+}
+
+long long nss_sqlite_count_members(unsigned int gid) {
+    const char* paths[NSS_SHARD_MAX];
+    struct nss_db* db;
+    sqlite3_stmt* pSt;
+    long long count = 0;
+    int i, n, res;
+
+    nss_db_deadline_start();
+    n = nss_shard_all(nss_passwd_db(), paths);
+    for(i = 0 ; i < n ; ++i) {
+        if(!(db = nss_db_acquire(paths[i]))) {
+            nss_db_deadline_end();
+            errno = EIO;
+            return -1;
+        }
+        if(!(pSt = nss_members_stmt(db, "count_members", NULL, gid))) {
+            return nss_members_fail(db, NSS_STATUS_NOTFOUND, errno);
+        }
+        if((res = nss_db_step(pSt)) == SQLITE_ROW) {
+            count += sqlite3_column_int64(pSt, 0);
+        }
+        sqlite3_reset(pSt);
+        if(res != SQLITE_ROW && res != SQLITE_DONE) {
+            return nss_members_fail(db, NSS_STATUS_UNAVAIL, EIO);
+        }
+        nss_db_release(db);
+    }
+    nss_db_deadline_end();
+    return count;
+}
@@ -25,4 +25,6 @@
 #define FALSE 0
 #define TRUE !FALSE
 
+#include "lazy.h"
+
 #endif
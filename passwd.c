@@ -21,6 +21,13 @@
  */
 
 #include "nss-sqlite.h"
+#include "capture.h"
+#include "ent.h"
+#include "flight.h"
+#include "probes.h"
+#include "settings.h"
+#include "shard.h"
+#include "shm.h"
 #include "utils.h"
 
 #include <errno.h>
@@ -32,17 +39,27 @@
 #include <pthread.h>
 
 /*
- * struct used to store data used by getpwent.
+ * Copy a passwd row into a getpwent page.
  */
-static struct {
-    sqlite3* pDb;
-    sqlite3_stmt* pSt;
-    int try_again;      /* flag to know if NSS_TRYAGAIN
-                            was returned by previous call
-                            to getpwent_r */
-    /* user information cache used if NSS_TRYAGAIN was returned */
+static ssize_t store_passwd(sqlite3_stmt* pSt, void* p, char* buf, size_t buflen) {
+    struct passwd* pw = p;
     struct passwd entry;
-} pwent_data = { NULL, NULL, 0, NULL};
+    int err;
+
+    if(!fill_passwd_sql(&entry, pSt)) {
+        return NSS_ENT_BAD_ROW;
+    }
+    if(fill_passwd(pw, buf, buflen, entry, &err) != NSS_STATUS_SUCCESS) {
+        return -1;
+    }
+    return pw->pw_shell + strlen(pw->pw_shell) + 1 - buf;
+}
+
+/*
+ * struct used to store data used by getpwent.
+ */
+static struct nss_ent pwent_data = NSS_ENT_INIT(nss_passwd_db, "getpwent_page",
+        "setpwent", 2, struct passwd, store_passwd);
 
 /* mutex used to serialize xxpwent operation */
 pthread_mutex_t pwent_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
@@ -50,31 +67,17 @@ pthread_mutex_t pwent_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
 /**
  * Setup everything needed to retrieve passwd entries.
+ * Entries are fetched lazily, this only rewinds the walk.
  */
 enum nss_status _nss_sqlite_setpwent(void) {
-    char* sql;
+    uint64_t t0 = nss_capture_start();
+    NSS_DEBUG("setpwent: rewinding passwd walk\n");
+    NSS_PROBE(setpwent_entry);
     pthread_mutex_lock(&pwent_mutex);
-    if(pwent_data.pDb == NULL) {
-        NSS_DEBUG("setpwent: opening DB connection\n");
-        if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &pwent_data.pDb) != SQLITE_OK) {
-            NSS_ERROR(sqlite3_errmsg(pwent_data.pDb));
-            return NSS_STATUS_UNAVAIL;
-        }
-        if(!(sql = get_query(pwent_data.pDb, "setpwent")) ) {
-            NSS_ERROR(sqlite3_errmsg(pwent_data.pDb));
-            sqlite3_close(pwent_data.pDb);
-            return NSS_STATUS_UNAVAIL;
-        }
-        if(sqlite3_prepare(pwent_data.pDb, sql, -1, &pwent_data.pSt, NULL) != SQLITE_OK) {
-            NSS_ERROR(sqlite3_errmsg(pwent_data.pDb));
-            sqlite3_finalize(pwent_data.pSt);
-            sqlite3_close(pwent_data.pDb);
-            free(sql);
-            return NSS_STATUS_UNAVAIL;
-        }
-    }
-    free(sql);
+    nss_ent_rewind(&pwent_data);
     pthread_mutex_unlock(&pwent_mutex);
+    nss_capture(NSS_CAP_SETPWENT, NULL, 0, 0, NSS_STATUS_SUCCESS, t0);
+    NSS_PROBE1(setpwent_return, NSS_STATUS_SUCCESS);
     return NSS_STATUS_SUCCESS;
 }
 
@@ -82,14 +85,14 @@ enum nss_status _nss_sqlite_setpwent(void) {
  * Free getpwent resources.
  */
 enum nss_status _nss_sqlite_endpwent(void) {
+    uint64_t t0 = nss_capture_start();
     NSS_DEBUG("endpwent: finalizing passwd serial access facilities\n");
+    NSS_PROBE(endpwent_entry);
     pthread_mutex_lock(&pwent_mutex);
-    if(pwent_data.pDb != NULL) {
-        sqlite3_finalize(pwent_data.pSt);
-        sqlite3_close(pwent_data.pDb);
-        pwent_data.pDb = NULL;
-    }
+    nss_ent_close(&pwent_data);
     pthread_mutex_unlock(&pwent_mutex);
+    nss_capture(NSS_CAP_ENDPWENT, NULL, 0, 0, NSS_STATUS_SUCCESS, t0);
+    NSS_PROBE1(endpwent_return, NSS_STATUS_SUCCESS);
     return NSS_STATUS_SUCCESS;
 }
 
@@ -106,170 +109,195 @@ enum nss_status _nss_sqlite_endpwent(void) {
 enum nss_status
 _nss_sqlite_getpwent_r(struct passwd *pwbuf, char *buf,
                       size_t buflen, int *errnop) {
+    uint64_t t0 = nss_capture_start();
+    struct passwd* entry;
     int res;
-    const unsigned char* name;
-    uid_t uid;
-    gid_t gid;
-    const unsigned char* shell;
-    const unsigned char* homedir;
     NSS_DEBUG("getpwent_r\n");
+    NSS_PROBE(getpwent_entry);
+    nss_db_deadline_start();
     pthread_mutex_lock(&pwent_mutex);
 
-    if(pwent_data.pDb == NULL) {
-        _nss_sqlite_setpwent();
-    }
-
-    if(pwent_data.try_again) {
-        res = fill_passwd(pwbuf, buf, buflen, pwent_data.entry, errnop);
-        /* buffer was long enough this time */
-        if(res != NSS_STATUS_TRYAGAIN || (*errnop) != ERANGE) {
-            pwent_data.try_again = 0;
-            pthread_mutex_unlock(&pwent_mutex);
-            return res;
+    res = nss_ent_next(&pwent_data, (void**)&entry);
+    if(res == NSS_STATUS_SUCCESS) {
+        NSS_DEBUG("getpwent_r: fetched user #%d: %s\n", entry->pw_uid, entry->pw_name);
+        res = fill_passwd(pwbuf, buf, buflen, *entry, errnop);
+        /* on ERANGE the same entry is returned by next call */
+        if(res == NSS_STATUS_SUCCESS) {
+            nss_ent_advance(&pwent_data);
         }
     }
 
-    res = res2nss_status(sqlite3_step(pwent_data.pSt), pwent_data.pDb, pwent_data.pSt);
-    if(res != NSS_STATUS_SUCCESS) {
-        pwent_data.pDb = NULL;
-        pthread_mutex_unlock(&pwent_mutex);
-        return res;
-    }
-
-    fill_passwd_sql(&pwent_data.entry, pwent_data.pSt);
-    res = fill_passwd(pwbuf, buf, buflen, pwent_data.entry, errnop);
-
-    NSS_DEBUG("getpwent_r: fetched user #%d: %s\n", uid, name);
-
-    if(res == NSS_STATUS_TRYAGAIN && (*errnop) == ERANGE) {
-        /* cache result for next try */
-        pwent_data.try_again = 1;
-
-        pthread_mutex_unlock(&pwent_mutex);
-        return NSS_STATUS_TRYAGAIN;
-    }
     pthread_mutex_unlock(&pwent_mutex);
-    return NSS_STATUS_SUCCESS;
+    nss_db_deadline_end();
+    nss_capture(NSS_CAP_GETPWENT, NULL, 0, buflen, res, t0);
+    NSS_PROBE1(getpwent_return, res);
+    return res;
 }
 
-/**
- * Get user info by username.
- * Open database connection, fetch the user by name, close the connection.
+/*
+ * Look user up by name in one database file.
  */
-
-enum nss_status _nss_sqlite_getpwnam_r(const char* name, struct passwd *pwbuf,
+static enum nss_status getpwnam_in(const char* path, const char* name, struct passwd *pwbuf,
                char *buf, size_t buflen, int *errnop) {
-    sqlite3 *pDb;
+    struct nss_db *db;
     struct sqlite3_stmt* pSquery;
-    char* query;
     int res;
     struct passwd entry;
 
-    NSS_DEBUG("getpwnam_r: Looking for user %s\n", name);
-
-    if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &pDb) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
+    if(!(db = nss_db_acquire(path))) {
         return NSS_STATUS_UNAVAIL;
     }
 
-    if(!(query = get_query(pDb, "getpwnam_r")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
+    /* Serialized row, copied at once, when the database keeps them */
+    if((pSquery = nss_db_stmt(db, "getpwnam_r_packed")) != NULL) {
+        if(sqlite3_bind_text(pSquery, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
+            NSS_DEBUG(sqlite3_errmsg(db->pDb));
+            nss_db_release(db);
+            return NSS_STATUS_UNAVAIL;
+        }
+        res = res2nss_status(nss_db_step(pSquery));
+        if(res == NSS_STATUS_SUCCESS) {
+            res = fill_passwd_packed(pwbuf, buf, buflen, pSquery, errnop);
+        }
+        if(res != NSS_STATUS_RETURN) {
+            nss_db_finish(db, res);
+            return res;
+        }
     }
 
-    if(sqlite3_prepare(pDb, query, strlen(query), &pSquery, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        free(query);
-        sqlite3_finalize(pSquery);
-        sqlite3_close(pDb);
-        return FALSE;
+    if(!(pSquery = nss_db_stmt(db, "getpwnam_r"))) {
+        nss_db_discard(db);
+        return NSS_STATUS_UNAVAIL;
     }
 
     if(sqlite3_bind_text(pSquery, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
-        NSS_DEBUG(sqlite3_errmsg(pDb));
-        free(query);
-        sqlite3_finalize(pSquery);
-        sqlite3_close(pDb);
+        NSS_DEBUG(sqlite3_errmsg(db->pDb));
+        nss_db_release(db);
         return NSS_STATUS_UNAVAIL;
     }
 
-    res = res2nss_status(sqlite3_step(pSquery), pDb, pSquery);
-    if(res != NSS_STATUS_SUCCESS) {
-        free(query);
-        return res;
+    res = res2nss_status(nss_db_step(pSquery));
+    if(res == NSS_STATUS_SUCCESS) {
+        fill_passwd_sql(&entry, pSquery);
+        res = fill_passwd(pwbuf, buf, buflen, entry, errnop);
+        NSS_DEBUG("Look successfull !\n");
     }
 
-    fill_passwd_sql(&entry, pSquery);
-    res = fill_passwd(pwbuf, buf, buflen, entry, errnop);
+    nss_db_finish(db, res);
+    return res;
+}
+
+/**
+ * Get user info by username.
+ * Take a pooled DB handle, fetch the user by name, give the handle back.
+ */
 
-    free(query);
-    sqlite3_finalize(pSquery);
-    sqlite3_close(pDb);
+enum nss_status _nss_sqlite_getpwnam_r(const char* name, struct passwd *pwbuf,
+               char *buf, size_t buflen, int *errnop) {
+    uint64_t t0 = nss_capture_start();
+    const char* paths[NSS_SHARD_MAX];
+    struct nss_flight* f;
+    uint64_t stamp;
+    int i, n, res = NSS_STATUS_NOTFOUND;
 
-    NSS_DEBUG("Look successfull !\n");
+    NSS_DEBUG("getpwnam_r: Looking for user %s\n", name);
+    NSS_PROBE1(getpwnam_entry, name);
+    nss_db_deadline_start();
+
+    if(!nss_shm_get(NSS_CAP_GETPWNAM, name, 0, copy_passwd, pwbuf, buf, buflen, errnop, &res, &stamp)
+       && !nss_flight_join(&f, NSS_CAP_GETPWNAM, name, 0, copy_passwd, pwbuf, buf, buflen, errnop, &res)) {
+        n = nss_shard_name(nss_passwd_db(), name, paths);
+        for(i = 0 ; i < n && res == NSS_STATUS_NOTFOUND ; ++i) {
+            res = getpwnam_in(paths[i], name, pwbuf, buf, buflen, errnop);
+        }
+        nss_flight_end(f, res, pwbuf);
+        nss_shm_put(NSS_CAP_GETPWNAM, name, 0, stamp, res, pwbuf);
+    }
+    nss_db_deadline_end();
+    nss_capture(NSS_CAP_GETPWNAM, name, 0, buflen, res, t0);
+    NSS_PROBE2(getpwnam_return, name, res);
     return res;
 }
 
 /*
- * Get user by UID.
+ * Look user up by UID in one database file.
  */
-
-enum nss_status _nss_sqlite_getpwuid_r(uid_t uid, struct passwd *pwbuf,
+static enum nss_status getpwuid_in(const char* path, uid_t uid, struct passwd *pwbuf,
                char *buf, size_t buflen, int *errnop) {
-    sqlite3 *pDb;
+    struct nss_db *db;
     struct sqlite3_stmt* pSquery;
-    char* query;
-    int res, nss_res;
+    int res;
     struct passwd entry;
 
-    NSS_DEBUG("getpwuid_r: looking for user #%d\n", uid);
-
-    if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &pDb) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
+    if(!(db = nss_db_acquire(path))) {
         return NSS_STATUS_UNAVAIL;
     }
 
-    if(!(query = get_query(pDb, "getpwuid_r")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
+    if((pSquery = nss_db_stmt(db, "getpwuid_r_packed")) != NULL) {
+        if(sqlite3_bind_int(pSquery, 1, uid) != SQLITE_OK) {
+            NSS_DEBUG(sqlite3_errmsg(db->pDb));
+            nss_db_release(db);
+            return NSS_STATUS_UNAVAIL;
+        }
+        res = res2nss_status(nss_db_step(pSquery));
+        if(res == NSS_STATUS_SUCCESS) {
+            res = fill_passwd_packed(pwbuf, buf, buflen, pSquery, errnop);
+        }
+        if(res != NSS_STATUS_RETURN) {
+            nss_db_finish(db, res);
+            return res;
+        }
     }
 
-
-    if(sqlite3_prepare(pDb, query, strlen(query), &pSquery, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        free(query);
-        sqlite3_finalize(pSquery);
-        sqlite3_close(pDb);
-        return FALSE;
+    if(!(pSquery = nss_db_stmt(db, "getpwuid_r"))) {
+        nss_db_discard(db);
+        return NSS_STATUS_UNAVAIL;
     }
 
     if(sqlite3_bind_int(pSquery, 1, uid) != SQLITE_OK) {
-        NSS_DEBUG(sqlite3_errmsg(pDb));
-        free(query);
-        sqlite3_finalize(pSquery);
-        sqlite3_close(pDb);
+        NSS_DEBUG(sqlite3_errmsg(db->pDb));
+        nss_db_release(db);
         return NSS_STATUS_UNAVAIL;
     }
 
-
-    res = sqlite3_step(pSquery);
-    nss_res = res2nss_status(res, pDb, pSquery);
-    if(nss_res != NSS_STATUS_SUCCESS) {
-        free(query);
-        return nss_res;
+    res = res2nss_status(nss_db_step(pSquery));
+    if(res == NSS_STATUS_SUCCESS) {
+        fill_passwd_sql(&entry, pSquery);
+        res = fill_passwd(pwbuf, buf, buflen, entry, errnop);
     }
 
-    fill_passwd_sql(&entry, pSquery);
-    res = fill_passwd(pwbuf, buf, buflen, entry, errnop);
-   
-    free(query);
-    sqlite3_finalize(pSquery);
-    sqlite3_close(pDb);
+    nss_db_finish(db, res);
+    return res;
+}
+
+/*
+ * Get user by UID.
+ */
+
+enum nss_status _nss_sqlite_getpwuid_r(uid_t uid, struct passwd *pwbuf,
+               char *buf, size_t buflen, int *errnop) {
+    uint64_t t0 = nss_capture_start();
+    const char* paths[NSS_SHARD_MAX];
+    struct nss_flight* f;
+    uint64_t stamp;
+    int i, n, res = NSS_STATUS_NOTFOUND;
 
+    NSS_DEBUG("getpwuid_r: looking for user #%d\n", uid);
+    NSS_PROBE1(getpwuid_entry, uid);
+    nss_db_deadline_start();
+
+    if(!nss_shm_get(NSS_CAP_GETPWUID, NULL, uid, copy_passwd, pwbuf, buf, buflen, errnop, &res, &stamp)
+       && !nss_flight_join(&f, NSS_CAP_GETPWUID, NULL, uid, copy_passwd, pwbuf, buf, buflen, errnop, &res)) {
+        n = nss_shard_id(nss_passwd_db(), uid, paths);
+        for(i = 0 ; i < n && res == NSS_STATUS_NOTFOUND ; ++i) {
+            res = getpwuid_in(paths[i], uid, pwbuf, buf, buflen, errnop);
+        }
+        nss_flight_end(f, res, pwbuf);
+        nss_shm_put(NSS_CAP_GETPWUID, NULL, uid, stamp, res, pwbuf);
+    }
+    nss_db_deadline_end();
+    nss_capture(NSS_CAP_GETPWUID, NULL, uid, buflen, res, t0);
+    NSS_PROBE2(getpwuid_return, uid, res);
     return res;
 }
 
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * prewarm.c : Optional warm-up done when the module is loaded.
+ *
+ * glibc loads NSS modules on their first use, so this runs right before
+ * the first lookup. Database files are handed to the kernel read-ahead
+ * so that B-tree pages are in the page cache by the time SQLite wants
+ * them. When built with --enable-prewarm=thread, a background thread
+ * also opens the databases and compiles the usual statements, leaving
+ * the handles in the pool for the lookups to come.
+ */
+
+#include "nss-sqlite.h"
+#include "db.h"
+#include "settings.h"
+#include "shard.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if NSS_SQLITE_PREWARM
+
+/* Never ask the kernel to read more than this per file */
+#define NSS_PREWARM_MAX_BYTES (64 * 1024 * 1024)
+
+/*
+ * Start reading a file ahead in the page cache.
+ * @param path File name.
+ */
+static void nss_prewarm_file(const char* path) {
+    struct stat st;
+    int fd;
+
+    if((fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY)) < 0) {
+        return;
+    }
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        off_t len = st.st_size < NSS_PREWARM_MAX_BYTES ? st.st_size : NSS_PREWARM_MAX_BYTES;
+        posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+    }
+    close(fd);
+}
+
+/*
+ * Read ahead a database and its write-ahead log, if any.
+ * @param path Database file name.
+ */
+static void nss_prewarm_db(const char* path) {
+    char wal[PATH_MAX];
+
+    nss_prewarm_file(path);
+    if(snprintf(wal, sizeof(wal), "%s-wal", path) < (int)sizeof(wal)) {
+        nss_prewarm_file(wal);
+    }
+}
+
+#if NSS_SQLITE_PREWARM > 1
+
+/* Lookups run the packed queries first, and get_members before
+ * get_users, when the database has them */
+static const char* const passwd_queries[] = {
+    "getpwnam_r_packed", "getpwuid_r_packed", "getgrnam_r_packed", "getgrgid_r_packed",
+    "getpwnam_r", "getpwuid_r", "getgrnam_r", "getgrgid_r",
+    "initgroups_dyn", "get_members", "get_users", NULL
+};
+
+static const char* const shadow_queries[] = {
+    "getspnam_r_packed", "getspnam_r", NULL
+};
+
+/*
+ * Compile statements on a pooled handle and give it back. Queries the
+ * database lacks are remembered as such by nss_db_stmt(), others which
+ * fail to compile are left to the first lookup needing them.
+ * @param path Database file name.
+ * @param queries nss_queries names, NULL terminated.
+ */
+static void nss_prewarm_stmts(const char* path, const char* const* queries) {
+    struct nss_db* db;
+
+    if(!(db = nss_db_acquire(path))) {
+        return;
+    }
+    for( ; *queries != NULL ; ++queries) {
+        nss_db_stmt(db, *queries);
+    }
+    nss_db_release(db);
+}
+
+static void* nss_prewarm_thread(void* arg) {
+    const char* paths[NSS_SHARD_MAX];
+
+    /* Routing table first, lookups read it before anything else */
+    nss_shard_all(nss_passwd_db(), paths);
+    nss_prewarm_stmts(nss_passwd_db(), passwd_queries);
+    /* Shadow is only readable by privileged processes */
+    if(access(nss_shadow_db(), R_OK) == 0) {
+        nss_prewarm_stmts(nss_shadow_db(), shadow_queries);
+    }
+    return NULL;
+}
+
+/*
+ * Run nss_prewarm_thread() detached, with every signal blocked so that
+ * none meant for the host application is delivered to it.
+ */
+static void nss_prewarm_spawn(void) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, old;
+
+    if(pthread_attr_init(&attr) != 0) {
+        return;
+    }
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if(pthread_create(&thread, &attr, nss_prewarm_thread, NULL) != 0) {
+        NSS_DEBUG("prewarm: unable to start thread\n");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+#endif
+
+__attribute__((constructor))
+static void nss_prewarm(void) {
+    nss_prewarm_db(nss_passwd_db());
+    if(access(nss_shadow_db(), R_OK) == 0) {
+        nss_prewarm_db(nss_shadow_db());
+    }
+#if NSS_SQLITE_PREWARM > 1
+    nss_prewarm_spawn();
+#endif
+}
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Static tracing probes (USDT), provider nss_sqlite. They compile to a
+ * nop when sys/sdt.h is available and to nothing otherwise, e.g.
+ *
+ *   bpftrace -e 'usdt:/lib/libnss_sqlite.so.2:nss_sqlite:step_return
+ *                { printf("%s %d\n", str(arg0), arg1); }'
+ *
+ * Every _nss_sqlite_* function fires <function>_entry with its key, if
+ * any, and <function>_return with its key and status. Lookup phases fire
+ * db_open, query (nss_queries read), prepare, step and fill entry/return
+ * pairs.
+ */
+
+#ifndef NSS_SQLITE_PROBES_H
+#define NSS_SQLITE_PROBES_H
+
+#if defined(ENABLE_PROBES) && defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+#define NSS_PROBE(name) DTRACE_PROBE(nss_sqlite, name)
+#define NSS_PROBE1(name, a) DTRACE_PROBE1(nss_sqlite, name, a)
+#define NSS_PROBE2(name, a, b) DTRACE_PROBE2(nss_sqlite, name, a, b)
+#define NSS_PROBE3(name, a, b, c) DTRACE_PROBE3(nss_sqlite, name, a, b, c)
+#else
+#define NSS_PROBE(name)
+#define NSS_PROBE1(name, a)
+#define NSS_PROBE2(name, a, b)
+#define NSS_PROBE3(name, a, b, c)
+#endif
+
+#endif
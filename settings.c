@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * settings.c : Runtime settings.
+ *
+ * The file is made of "key = value" lines, '#' starting a comment. It
+ * is read once per process. As the module runs inside setuid programs,
+ * it is ignored unless owned by root and writable by root only.
+ * Programs which are not setuid may name another file with the
+ * NSS_SQLITE_CONFIG environment variable, e.g. to replay captures
+ * against a copy of the databases; that file may also belong to the
+ * user running them.
+ */
+
+#include "nss-sqlite.h"
+#include "db.h"
+#include "settings.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct nss_settings settings = {
+    NSS_SQLITE_PASSWD_DB,   /* passwd_db */
+    NSS_SQLITE_SHADOW_DB,   /* shadow_db */
+    NULL,                   /* slow_log */
+    10000,                  /* slow_log_threshold_us */
+    0,                      /* slow_log_sample */
+    1024 * 1024,            /* slow_log_max_bytes */
+    NULL,                   /* capture_dir */
+    4 * 1024 * 1024,        /* capture_bytes */
+    0,                      /* memory_limit */
+    -1,                     /* cache_size */
+    0,                      /* mmap_size */
+    NSS_DB_MAX_IDLE,        /* max_idle */
+    0,                      /* idle_timeout */
+    NULL,                   /* shm_cache */
+    8192,                   /* shm_cache_slots */
+    300,                    /* shm_cache_ttl */
+    0,                      /* shm_cache_refresh */
+    0,                      /* deadline_ms */
+    0,                      /* breaker_threshold */
+    30,                     /* breaker_backoff */
+    2,                      /* async_threads */
+};
+static const char* settings_path = NSS_SQLITE_CONFIG;
+static pthread_once_t settings_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Parse a non negative number setting.
+ * @return TRUE if value was a valid number.
+ */
+static int nss_settings_long(const char* value, long* out) {
+    char* end;
+    long v;
+
+    errno = 0;
+    v = strtol(value, &end, 10);
+    if(errno != 0 || end == value || *end != '\0' || v < 0) {
+        return FALSE;
+    }
+    *out = v;
+    return TRUE;
+}
+
+/*
+ * Apply one "key = value" setting.
+ */
+static void nss_settings_set(const char* key, const char* value, int line) {
+    int ok = TRUE;
+
+    if(strcmp(key, "passwd_db") == 0) {
+        ok = *value && (settings.passwd_db = strdup(value)) != NULL;
+    } else if(strcmp(key, "shadow_db") == 0) {
+        ok = *value && (settings.shadow_db = strdup(value)) != NULL;
+    } else if(strcmp(key, "slow_log") == 0) {
+        settings.slow_log = *value ? strdup(value) : NULL;
+    } else if(strcmp(key, "slow_log_threshold_us") == 0) {
+        ok = nss_settings_long(value, &settings.slow_log_threshold_us);
+    } else if(strcmp(key, "slow_log_sample") == 0) {
+        ok = nss_settings_long(value, &settings.slow_log_sample);
+    } else if(strcmp(key, "slow_log_max_bytes") == 0) {
+        ok = nss_settings_long(value, &settings.slow_log_max_bytes);
+    } else if(strcmp(key, "capture_dir") == 0) {
+        settings.capture_dir = *value ? strdup(value) : NULL;
+    } else if(strcmp(key, "capture_bytes") == 0) {
+        ok = nss_settings_long(value, &settings.capture_bytes);
+    } else if(strcmp(key, "memory_limit") == 0) {
+        ok = nss_settings_long(value, &settings.memory_limit);
+    } else if(strcmp(key, "cache_size") == 0) {
+        ok = nss_settings_long(value, &settings.cache_size);
+    } else if(strcmp(key, "mmap_size") == 0) {
+        ok = nss_settings_long(value, &settings.mmap_size);
+    } else if(strcmp(key, "max_idle") == 0) {
+        ok = nss_settings_long(value, &settings.max_idle);
+    } else if(strcmp(key, "idle_timeout") == 0) {
+        ok = nss_settings_long(value, &settings.idle_timeout);
+    } else if(strcmp(key, "shm_cache") == 0) {
+        settings.shm_cache = *value ? strdup(value) : NULL;
+    } else if(strcmp(key, "shm_cache_slots") == 0) {
+        ok = nss_settings_long(value, &settings.shm_cache_slots) && settings.shm_cache_slots <= 1L << 24;
+    } else if(strcmp(key, "shm_cache_ttl") == 0) {
+        ok = nss_settings_long(value, &settings.shm_cache_ttl);
+    } else if(strcmp(key, "shm_cache_refresh") == 0) {
+        ok = nss_settings_long(value, &settings.shm_cache_refresh) && settings.shm_cache_refresh <= 100;
+    } else if(strcmp(key, "deadline_ms") == 0) {
+        ok = nss_settings_long(value, &settings.deadline_ms);
+    } else if(strcmp(key, "breaker_threshold") == 0) {
+        ok = nss_settings_long(value, &settings.breaker_threshold);
+    } else if(strcmp(key, "breaker_backoff") == 0) {
+        ok = nss_settings_long(value, &settings.breaker_backoff);
+    } else if(strcmp(key, "async_threads") == 0) {
+        ok = nss_settings_long(value, &settings.async_threads) && settings.async_threads > 0;
+    } else {
+        NSS_ERROR("%s:%d: unknown setting %s\n", settings_path, line, key);
+        return;
+    }
+    if(!ok) {
+        NSS_ERROR("%s:%d: bad value for %s\n", settings_path, line, key);
+    }
+}
+
+/*
+ * Strip leading and trailing blanks, in place.
+ */
+static char* nss_settings_trim(char* s) {
+    char* end;
+
+    while(isspace((unsigned char)*s)) {
+        ++s;
+    }
+    end = s + strlen(s);
+    while(end > s && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+static void nss_settings_load(void) {
+    char line[1024];
+    struct stat st;
+    const char* env;
+    FILE* f;
+    int fd, n = 0;
+
+    /* NULL in setuid programs */
+    if((env = secure_getenv("NSS_SQLITE_CONFIG")) != NULL && *env) {
+        settings_path = env;
+    }
+    if((fd = open(settings_path, O_RDONLY | O_CLOEXEC | O_NOCTTY)) < 0) {
+        return;
+    }
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+       || (st.st_uid != 0 && (settings_path != env || st.st_uid != getuid()))
+       || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        NSS_ERROR("%s: ignored, must be a regular file writable by its owner only\n", settings_path);
+        close(fd);
+        return;
+    }
+    if(!(f = fdopen(fd, "r"))) {
+        close(fd);
+        return;
+    }
+
+    while(fgets(line, sizeof(line), f) != NULL) {
+        char *key, *value, *p;
+
+        ++n;
+        if((p = strchr(line, '#')) != NULL) {
+            *p = '\0';
+        }
+        key = nss_settings_trim(line);
+        if(*key == '\0') {
+            continue;
+        }
+        if((p = strchr(key, '=')) == NULL) {
+            NSS_ERROR("%s:%d: missing '='\n", settings_path, n);
+            continue;
+        }
+        *p = '\0';
+        value = nss_settings_trim(p + 1);
+        nss_settings_set(nss_settings_trim(key), value, n);
+    }
+    fclose(f);
+}
+
+/*
+ * Get runtime settings, reading the file on first call.
+ */
+const struct nss_settings* nss_settings(void) {
+    pthread_once(&settings_once, nss_settings_load);
+    return &settings;
+}
+
+/*
+ * Users' database, NSS_SQLITE_PASSWD_DB unless overridden.
+ */
+const char* nss_passwd_db(void) {
+    return nss_settings()->passwd_db;
+}
+
+/*
+ * Shadow database, NSS_SQLITE_SHADOW_DB unless overridden.
+ */
+const char* nss_shadow_db(void) {
+    return nss_settings()->shadow_db;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_SETTINGS_H
+#define NSS_SQLITE_SETTINGS_H
+
+/*
+ * Runtime settings read from NSS_SQLITE_CONFIG. Every field has a
+ * usable default when the file or the key is missing.
+ */
+struct nss_settings {
+    const char* passwd_db;          /* users' database */
+    const char* shadow_db;          /* shadow database */
+    const char* slow_log;           /* slow query log file, NULL if off */
+    long slow_log_threshold_us;     /* log statements slower than this */
+    long slow_log_sample;           /* also log 1 statement out of N, 0 off */
+    long slow_log_max_bytes;        /* log is rotated past this size */
+    const char* capture_dir;        /* directory of capture files, NULL
+                                       if off */
+    long capture_bytes;             /* size of each capture file */
+    long memory_limit;              /* SQLite soft heap limit, 0 if none */
+    long cache_size;                /* page cache of each handle in pages,
+                                       -1 for SQLite's default */
+    long mmap_size;                 /* bytes of database mapped, 0 if none */
+    long max_idle;                  /* idle handles kept per database */
+    long idle_timeout;              /* seconds before an idle handle is
+                                       closed, 0 to keep it */
+    const char* shm_cache;          /* directory of the shared cache
+                                       file, NULL if off */
+    long shm_cache_slots;           /* entries the shared cache holds */
+    long shm_cache_ttl;             /* seconds a cached entry is served */
+    long shm_cache_refresh;         /* last percentage of the ttl during
+                                       which a hit refreshes the entry */
+    long deadline_ms;               /* time a lookup may spend in SQLite,
+                                       0 for no limit */
+    long breaker_threshold;         /* failed accesses before a database
+                                       is given up on, 0 never */
+    long breaker_backoff;           /* seconds it is given up on */
+    long async_threads;             /* workers of nss_sqlite_submit() */
+};
+
+const struct nss_settings* nss_settings(void);
+const char* nss_passwd_db(void);
+const char* nss_shadow_db(void);
+
+#endif
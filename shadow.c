@@ -21,6 +21,12 @@
  */
 
 #include "nss-sqlite.h"
+#include "capture.h"
+#include "ent.h"
+#include "flight.h"
+#include "probes.h"
+#include "settings.h"
+#include "shard.h"
 #include "utils.h"
 
 #include <errno.h>
@@ -34,17 +40,27 @@
 #include <pthread.h>
 
 /*
- * struct used to store data used by getspent.
+ * Copy a shadow row into a getspent page.
  */
-static struct {
-    sqlite3* pDb;
-    sqlite3_stmt* pSt;
-    int try_again;      /* flag to know if NSS_TRYAGAIN
-                            was returned by previous call
-                            to getspent_r */
-    /* user information cache used if NSS_TRYAGAIN was returned */
+static ssize_t store_shadow(sqlite3_stmt* pSt, void* p, char* buf, size_t buflen) {
+    struct spwd* sp = p;
     struct spwd entry;
-} spent_data = { NULL, NULL, 0, NULL};
+    int err;
+
+    if(!fill_shadow_sql(&entry, pSt)) {
+        return NSS_ENT_BAD_ROW;
+    }
+    if(fill_shadow(sp, buf, buflen, entry, &err) != NSS_STATUS_SUCCESS) {
+        return -1;
+    }
+    return sp->sp_pwdp + strlen(sp->sp_pwdp) + 1 - buf;
+}
+
+/*
+ * struct used to store data used by getspent.
+ */
+static struct nss_ent spent_data = NSS_ENT_INIT(nss_shadow_db, "getspent_page",
+        "setspent", 0, struct spwd, store_shadow);
 
 /* mutex used to serialize xxspent operation */
 pthread_mutex_t spent_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
@@ -52,31 +68,17 @@ pthread_mutex_t spent_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
 /**
  * Setup everything needed to retrieve shadow entries.
+ * Entries are fetched lazily, this only rewinds the walk.
  */
 enum nss_status _nss_sqlite_setspent(void) {
-    char* sql;
+    uint64_t t0 = nss_capture_start();
+    NSS_DEBUG("setspent: rewinding shadow walk\n");
+    NSS_PROBE(setspent_entry);
     pthread_mutex_lock(&spent_mutex);
-    if(spent_data.pDb == NULL) {
-        NSS_DEBUG("setspent: opening DB connection\n");
-        if(sqlite3_open(NSS_SQLITE_SHADOW_DB, &spent_data.pDb) != SQLITE_OK) {
-            NSS_ERROR(sqlite3_errmsg(spent_data.pDb));
-            return NSS_STATUS_UNAVAIL;
-        }
-        if(!(sql = get_query(spent_data.pDb, "setspent")) ) {
-            NSS_ERROR(sqlite3_errmsg(spent_data.pDb));
-            sqlite3_close(spent_data.pDb);
-            return NSS_STATUS_UNAVAIL;
-        }
-        if(sqlite3_prepare(spent_data.pDb, sql, -1, &spent_data.pSt, NULL) != SQLITE_OK) {
-            NSS_ERROR(sqlite3_errmsg(spent_data.pDb));
-            sqlite3_finalize(spent_data.pSt);
-            sqlite3_close(spent_data.pDb);
-            free(sql);
-            return NSS_STATUS_UNAVAIL;
-        }
-    }
-    free(sql);
+    nss_ent_rewind(&spent_data);
     pthread_mutex_unlock(&spent_mutex);
+    nss_capture(NSS_CAP_SETSPENT, NULL, 0, 0, NSS_STATUS_SUCCESS, t0);
+    NSS_PROBE1(setspent_return, NSS_STATUS_SUCCESS);
     return NSS_STATUS_SUCCESS;
 }
 
@@ -84,14 +86,14 @@ enum nss_status _nss_sqlite_setspent(void) {
  * Free getspent resources.
  */
 enum nss_status _nss_sqlite_endspent(void) {
+    uint64_t t0 = nss_capture_start();
     NSS_DEBUG("endspent: finalizing shadow serial access facilities\n");
+    NSS_PROBE(endspent_entry);
     pthread_mutex_lock(&spent_mutex);
-    if(spent_data.pDb != NULL) {
-        sqlite3_finalize(spent_data.pSt);
-        sqlite3_close(spent_data.pDb);
-        spent_data.pDb = NULL;
-    }
+    nss_ent_close(&spent_data);
     pthread_mutex_unlock(&spent_mutex);
+    nss_capture(NSS_CAP_ENDSPENT, NULL, 0, 0, NSS_STATUS_SUCCESS, t0);
+    NSS_PROBE1(endspent_return, NSS_STATUS_SUCCESS);
     return NSS_STATUS_SUCCESS;
 }
 
@@ -108,106 +110,109 @@ enum nss_status _nss_sqlite_endspent(void) {
 enum nss_status
 _nss_sqlite_getspent_r(struct spwd *spbuf, char *buf,
                       size_t buflen, int *errnop) {
+    uint64_t t0 = nss_capture_start();
+    struct spwd* entry;
     int res;
     NSS_DEBUG("getspent_r\n");
+    NSS_PROBE(getspent_entry);
+    nss_db_deadline_start();
     pthread_mutex_lock(&spent_mutex);
 
-    if(spent_data.pDb == NULL) {
-        _nss_sqlite_setspent();
-    }
-
-    if(spent_data.try_again) {
-        res = fill_shadow(spbuf, buf, buflen, spent_data.entry, errnop);
-        /* buffer was long enough this time */
-        if(res != NSS_STATUS_TRYAGAIN || (*errnop) != ERANGE) {
-            spent_data.try_again = 0;
-            pthread_mutex_unlock(&spent_mutex);
-            return res;
+    res = nss_ent_next(&spent_data, (void**)&entry);
+    if(res == NSS_STATUS_SUCCESS) {
+        NSS_DEBUG("getspent_r: fetched user %s\n", entry->sp_namp);
+        res = fill_shadow(spbuf, buf, buflen, *entry, errnop);
+        /* on ERANGE the same entry is returned by next call */
+        if(res == NSS_STATUS_SUCCESS) {
+            nss_ent_advance(&spent_data);
         }
     }
 
-    res = res2nss_status(sqlite3_step(spent_data.pSt), spent_data.pDb, spent_data.pSt);
-    if(res != NSS_STATUS_SUCCESS) {
-        spent_data.pDb = NULL;
-        pthread_mutex_unlock(&spent_mutex);
-        return res;
-    }
-
-    fill_shadow_sql(&spent_data.entry, spent_data.pSt);
-    res = fill_shadow(spbuf, buf, buflen, spent_data.entry, errnop);
-
-    NSS_DEBUG("getspent_r: fetched user %s\n", spent_data.entry.sp_namp);
-
-    if(res == NSS_STATUS_TRYAGAIN && (*errnop) == ERANGE) {
-        /* cache result for next try */
-        spent_data.try_again = 1;
-
-        pthread_mutex_unlock(&spent_mutex);
-        return NSS_STATUS_TRYAGAIN;
-    }
     pthread_mutex_unlock(&spent_mutex);
-    return NSS_STATUS_SUCCESS;
+    nss_db_deadline_end();
+    nss_capture(NSS_CAP_GETSPENT, NULL, 0, buflen, res, t0);
+    NSS_PROBE1(getspent_return, res);
+    return res;
 }
 
 
 
 
 /*
- * Get shadow information using username.
+ * Look shadow entry up by name in one database file.
  */
-
-enum nss_status _nss_sqlite_getspnam_r(const char* name, struct spwd *spbuf,
+static enum nss_status getspnam_in(const char* path, const char* name, struct spwd *spbuf,
                char *buf, size_t buflen, int *errnop) {
-    sqlite3 *pDb;
+    struct nss_db *db;
     struct sqlite3_stmt* pSquery;
     int res;
     struct spwd entry;
-    char* query;
 
-    NSS_DEBUG("getspnam_r: looking for user %s (shadow)\n", name);
-
-    if(sqlite3_open(NSS_SQLITE_SHADOW_DB, &pDb) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
+    if(!(db = nss_db_acquire(path))) {
         return NSS_STATUS_UNAVAIL;
     }
 
-    if(!(query = get_query(pDb, "getspnam_r")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
+    if((pSquery = nss_db_stmt(db, "getspnam_r_packed")) != NULL) {
+        if(sqlite3_bind_text(pSquery, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
+            NSS_DEBUG(sqlite3_errmsg(db->pDb));
+            nss_db_release(db);
+            return NSS_STATUS_UNAVAIL;
+        }
+        res = res2nss_status(nss_db_step(pSquery));
+        if(res == NSS_STATUS_SUCCESS) {
+            res = fill_shadow_packed(spbuf, buf, buflen, pSquery, errnop);
+        }
+        if(res != NSS_STATUS_RETURN) {
+            nss_db_finish(db, res);
+            return res;
+        }
     }
 
-
-    if(sqlite3_prepare(pDb, query, strlen(query), &pSquery, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        free(query);
-        sqlite3_finalize(pSquery);
-        sqlite3_close(pDb);
-        return FALSE;
+    if(!(pSquery = nss_db_stmt(db, "getspnam_r"))) {
+        nss_db_discard(db);
+        return NSS_STATUS_UNAVAIL;
     }
 
     if(sqlite3_bind_text(pSquery, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
-        NSS_DEBUG(sqlite3_errmsg(pDb));
-        free(query);
-        sqlite3_finalize(pSquery);
-        sqlite3_close(pDb);
+        NSS_DEBUG(sqlite3_errmsg(db->pDb));
+        nss_db_release(db);
         return NSS_STATUS_UNAVAIL;
     }
 
-
-    res = res2nss_status(sqlite3_step(pSquery), pDb, pSquery);
-    if(res != NSS_STATUS_SUCCESS) {
-        free(query);
-        return res;
+    res = res2nss_status(nss_db_step(pSquery));
+    if(res == NSS_STATUS_SUCCESS) {
+        fill_shadow_sql(&entry, pSquery);
+        res = fill_shadow(spbuf, buf, buflen, entry, errnop);
     }
 
-    fill_shadow_sql(&entry, pSquery);
-    res = fill_shadow(spbuf, buf, buflen, entry, errnop);
+    nss_db_finish(db, res);
+    return res;
+}
 
-    free(query);
-    sqlite3_finalize(pSquery);
-    sqlite3_close(pDb);
+/*
+ * Get shadow information using username.
+ */
 
+enum nss_status _nss_sqlite_getspnam_r(const char* name, struct spwd *spbuf,
+               char *buf, size_t buflen, int *errnop) {
+    uint64_t t0 = nss_capture_start();
+    const char* paths[NSS_SHARD_MAX];
+    struct nss_flight* f;
+    int i, n, res = NSS_STATUS_NOTFOUND;
+
+    NSS_DEBUG("getspnam_r: looking for user %s (shadow)\n", name);
+    NSS_PROBE1(getspnam_entry, name);
+    nss_db_deadline_start();
+
+    if(!nss_flight_join(&f, NSS_CAP_GETSPNAM, name, 0, copy_shadow, spbuf, buf, buflen, errnop, &res)) {
+        n = nss_shard_name(nss_shadow_db(), name, paths);
+        for(i = 0 ; i < n && res == NSS_STATUS_NOTFOUND ; ++i) {
+            res = getspnam_in(paths[i], name, spbuf, buf, buflen, errnop);
+        }
+        nss_flight_end(f, res, spbuf);
+    }
+    nss_db_deadline_end();
+    nss_capture(NSS_CAP_GETSPNAM, name, 0, buflen, res, t0);
+    NSS_PROBE2(getspnam_return, name, res);
     return res;
 }
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * shard.c : Routing of lookups when entries are spread over several
+ * database files.
+ *
+ * The database configured at build time (the root) may hold a table
+ *
+ *   nss_shards(shard INTEGER PRIMARY KEY, path TEXT, kind TEXT, lo, hi)
+ *
+ * where each row routes either ids (kind 'id': uid or gid in [lo, hi])
+ * or names (kind 'name': nss_shard_hash(name) in [lo, hi]) to the
+ * database file path. Without that table, or without rows, the root
+ * holds everything. Keys matched by no route live in the root.
+ *
+ * Point lookups by id go to exactly one file. Lookups by name go to one
+ * file when name routes exist and are tried on every file otherwise.
+ * Memberships (user_group) live with the user they belong to, group
+ * nesting is copied in every file.
+ */
+
+#include "nss-sqlite.h"
+#include "shard.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ROUTE_ID    0
+#define ROUTE_NAME  1
+
+struct nss_shard_map {
+    const char* root;
+    pthread_rwlock_t lock;
+    time_t loaded;              /* CLOCK_MONOTONIC seconds */
+    int loading;
+    int nshards;                /* root excluded */
+    const char* shards[NSS_SHARD_MAX];
+    int nroutes;
+    int has_name;               /* some routes are by name */
+    struct {
+        int kind;
+        sqlite3_int64 lo;
+        sqlite3_int64 hi;
+        const char* path;
+    } routes[NSS_SHARD_MAX_ROUTES];
+};
+
+/* One map per root database (users' and shadow) */
+static struct nss_shard_map maps[2] = {
+    { NULL, PTHREAD_RWLOCK_INITIALIZER },
+    { NULL, PTHREAD_RWLOCK_INITIALIZER },
+};
+static pthread_mutex_t maps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A thread of the parent may have been reloading a map, start over.
+ */
+static void nss_shard_atfork_child(void) {
+    int i;
+    pthread_mutex_init(&maps_lock, NULL);
+    for(i = 0 ; i < 2 ; ++i) {
+        pthread_rwlock_init(&maps[i].lock, NULL);
+        maps[i].loading = FALSE;
+        maps[i].loaded = -NSS_SHARD_RELOAD;
+    }
+}
+
+__attribute__((constructor))
+static void nss_shard_init(void) {
+    pthread_atfork(NULL, NULL, nss_shard_atfork_child);
+}
+
+/*
+ * FNV-1a, the hash name routes are expressed with. Tools placing users
+ * must use the same function.
+ */
+static sqlite3_int64 nss_shard_hash(const char* name) {
+    unsigned int h = 2166136261u;
+    while(*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Read nss_shards of map's root into next, a scratch map.
+ * @return FALSE if the table could not be read to its end, in which
+ * case the current map is to be kept.
+ */
+static int nss_shard_load(const struct nss_shard_map* map, struct nss_shard_map* next) {
+    struct nss_db* db;
+    sqlite3_stmt* pSt;
+    int i, res;
+
+    next->nroutes = 0;
+    next->nshards = 0;
+    next->has_name = FALSE;
+
+    if(!(db = nss_db_acquire(map->root))) {
+        return FALSE;
+    }
+    if(!(pSt = nss_db_sql(db, "nss_shards", "SELECT path, kind, lo, hi FROM nss_shards ORDER BY shard"))) {
+        /* No such table: not a sharded setup. Anything else (busy,
+         * schema change) is transient. */
+        res = sqlite3_errcode(db->pDb) == SQLITE_ERROR;
+        nss_db_release(db);
+        return res;
+    }
+
+    while((res = sqlite3_step(pSt)) == SQLITE_ROW && next->nroutes < NSS_SHARD_MAX_ROUTES) {
+        const char* path = (const char*)sqlite3_column_text(pSt, 0);
+        const char* kind = (const char*)sqlite3_column_text(pSt, 1);
+        int r = next->nroutes;
+
+        if(path == NULL || kind == NULL) {
+            continue;
+        }
+        if(!(next->routes[r].path = nss_db_intern(*path ? path : map->root))) {
+            continue;
+        }
+        next->routes[r].kind = strcmp(kind, "name") == 0 ? ROUTE_NAME : ROUTE_ID;
+        next->routes[r].lo = sqlite3_column_int64(pSt, 2);
+        next->routes[r].hi = sqlite3_column_int64(pSt, 3);
+        next->has_name |= next->routes[r].kind == ROUTE_NAME;
+        next->nroutes++;
+
+        /* Remember distinct files, interned names compare by address */
+        for(i = 0 ; i < next->nshards && next->shards[i] != next->routes[r].path ; ++i);
+        if(i == next->nshards && next->routes[r].path != map->root && next->nshards < NSS_SHARD_MAX - 1) {
+            next->shards[next->nshards++] = next->routes[r].path;
+        }
+    }
+    if(res != SQLITE_ROW && res != SQLITE_DONE) {
+        NSS_ERROR("nss_shards: %s\n", sqlite3_errmsg(db->pDb));
+        sqlite3_reset(pSt);
+        nss_db_release(db);
+        return FALSE;
+    }
+    sqlite3_reset(pSt);
+    nss_db_release(db);
+    return TRUE;
+}
+
+/*
+ * Get routing map of a root database, read-locked. It is reloaded at
+ * most every NSS_SHARD_RELOAD seconds, readers keep using the current
+ * one in the meantime.
+ */
+static struct nss_shard_map* nss_shard_map(const char* root) {
+    struct nss_shard_map* map = NULL;
+    struct timespec now;
+    int i;
+
+    for(i = 0 ; i < 2 ; ++i) {
+        const char* r = __atomic_load_n(&maps[i].root, __ATOMIC_ACQUIRE);
+        if(r != NULL && (r == root || strcmp(r, root) == 0)) {
+            map = &maps[i];
+            break;
+        }
+    }
+    if(map == NULL) {
+        pthread_mutex_lock(&maps_lock);
+        for(i = 0 ; i < 2 && maps[i].root != NULL && strcmp(maps[i].root, root) != 0 ; ++i);
+        if(i < 2) {
+            map = &maps[i];
+            if(map->root == NULL) {
+                map->loaded = -NSS_SHARD_RELOAD;
+                __atomic_store_n(&map->root, nss_db_intern(root), __ATOMIC_RELEASE);
+            }
+        }
+        pthread_mutex_unlock(&maps_lock);
+        if(map == NULL || map->root == NULL) {
+            return NULL;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if(now.tv_sec - __atomic_load_n(&map->loaded, __ATOMIC_RELAXED) >= NSS_SHARD_RELOAD
+       && !__atomic_exchange_n(&map->loading, TRUE, __ATOMIC_ACQUIRE)) {
+        /* Read outside of the lock, and only swapped in once complete:
+         * users living in shards must not be looked up in the root
+         * alone because a reload failed midway */
+        struct nss_shard_map* next = malloc(sizeof(*next));
+        if(next != NULL && nss_shard_load(map, next)) {
+            pthread_rwlock_wrlock(&map->lock);
+            map->nshards = next->nshards;
+            memcpy(map->shards, next->shards, next->nshards * sizeof(next->shards[0]));
+            map->nroutes = next->nroutes;
+            memcpy(map->routes, next->routes, next->nroutes * sizeof(next->routes[0]));
+            map->has_name = next->has_name;
+            pthread_rwlock_unlock(&map->lock);
+        }
+        free(next);
+        __atomic_store_n(&map->loaded, now.tv_sec, __ATOMIC_RELAXED);
+        __atomic_store_n(&map->loading, FALSE, __ATOMIC_RELEASE);
+    }
+
+    pthread_rwlock_rdlock(&map->lock);
+    return map;
+}
+
+/*
+ * Every file of a map, root first.
+ */
+static int nss_shard_list(struct nss_shard_map* map, const char** paths) {
+    int i;
+    paths[0] = map->root;
+    for(i = 0 ; i < map->nshards ; ++i) {
+        paths[i + 1] = map->shards[i];
+    }
+    return map->nshards + 1;
+}
+
+/*
+ * File holding the entry with given uid or gid.
+ * @param root Root database.
+ * @param id uid or gid.
+ * @param paths Filled with the file name (one, always).
+ * @return Number of files to look into.
+ */
+int nss_shard_id(const char* root, sqlite3_int64 id, const char** paths) {
+    struct nss_shard_map* map = nss_shard_map(root);
+    int i;
+
+    paths[0] = root;
+    if(map == NULL) {
+        return 1;
+    }
+    paths[0] = map->root;
+    for(i = 0 ; i < map->nroutes ; ++i) {
+        if(map->routes[i].kind == ROUTE_ID && map->routes[i].lo <= id && id <= map->routes[i].hi) {
+            paths[0] = map->routes[i].path;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&map->lock);
+    return 1;
+}
+
+/*
+ * Files which may hold the entry with given name.
+ * @param root Root database.
+ * @param name User or group name.
+ * @param paths Filled with file names, NSS_SHARD_MAX at most.
+ * @return Number of files to look into.
+ */
+int nss_shard_name(const char* root, const char* name, const char** paths) {
+    struct nss_shard_map* map = nss_shard_map(root);
+    sqlite3_int64 h;
+    int i, n;
+
+    paths[0] = root;
+    if(map == NULL) {
+        return 1;
+    }
+    if(!map->has_name) {
+        /* Only id routes: the name may be in any file */
+        n = nss_shard_list(map, paths);
+        pthread_rwlock_unlock(&map->lock);
+        return n;
+    }
+    h = nss_shard_hash(name);
+    paths[0] = map->root;
+    for(i = 0 ; i < map->nroutes ; ++i) {
+        if(map->routes[i].kind == ROUTE_NAME && map->routes[i].lo <= h && h <= map->routes[i].hi) {
+            paths[0] = map->routes[i].path;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&map->lock);
+    return 1;
+}
+
+/*
+ * Every file, for walks and lookups which are not keyed by entry.
+ * @param root Root database.
+ * @param paths Filled with file names, NSS_SHARD_MAX at most, root first.
+ * @return Number of files.
+ */
+int nss_shard_all(const char* root, const char** paths) {
+    struct nss_shard_map* map = nss_shard_map(root);
+    int n;
+
+    paths[0] = root;
+    if(map == NULL) {
+        return 1;
+    }
+    n = nss_shard_list(map, paths);
+    pthread_rwlock_unlock(&map->lock);
+    return n;
+}
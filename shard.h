@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_SHARD_H
+#define NSS_SQLITE_SHARD_H
+
+#include "db.h"
+
+/* Max number of routes read from nss_shards */
+#define NSS_SHARD_MAX_ROUTES 256
+/* Max number of distinct shard files */
+#define NSS_SHARD_MAX 32
+/* Seconds between two reloads of nss_shards */
+#define NSS_SHARD_RELOAD 1
+
+int nss_shard_id(const char*, sqlite3_int64, const char**);
+int nss_shard_name(const char*, const char*, const char**);
+int nss_shard_all(const char*, const char**);
+
+#endif
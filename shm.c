@@ -0,0 +1,705 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * shm.c : Result cache shared by every process of the host.
+ *
+ * With shm_cache set, passwd and group entries are kept in a file of
+ * that directory (typically /dev/shm) named after the passwd database's
+ * device and inode, which every process maps. It is a fixed size, open
+ * addressing hash table: a key has NSS_SHM_PROBES candidate slots, the
+ * oldest one is overwritten when all are taken.
+ *
+ * Readers never lock. Each slot has a sequence number, odd while a
+ * writer fills it, which readers check around their copy of the slot
+ * before trusting it, along with a checksum of the data. A writer
+ * which dies with a slot locked only loses that slot for
+ * NSS_SHM_STALE_LOCK seconds, the next writer then takes it over.
+ *
+ * Entries remember the state of the databases they were read from: the
+ * size and modification time of the passwd database, of the shard files
+ * it routes entries to, and of their WALs. It is taken before the
+ * lookup reads them, so that an entry read while a commit lands is
+ * never served, and any commit changes it, so entries are never served
+ * once a database moved on. The shard files are those the header lists,
+ * which processes storing entries keep in line with nss_shards; a
+ * change of nss_shards changes the passwd database anyway. A hit costs
+ * a few stat() calls, not a database open.
+ *
+ * Only processes running as the owner of the passwd database, who can
+ * change the database anyway, create and fill the cache; others just
+ * read it, provided it belongs to that owner and is writable by it
+ * only. Shadow entries are never cached.
+ *
+ * With shm_cache_refresh set, those processes also read again entries
+ * hit in the last part of their lifetime, from a background thread, so
+ * that hot entries are replaced before they expire instead of all
+ * missing at once. The hit itself is still served from the cache.
+ */
+
+#include "nss-sqlite.h"
+#include "arena.h"
+#include "capture.h"
+#include "settings.h"
+#include "shard.h"
+#include "shm.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Seconds between two attempts to map a missing or bad cache file */
+#define NSS_SHM_RETRY 1
+
+/* One mapping of a cache file, never unmapped as readers may be using
+ * it without any lock */
+struct nss_shm_map {
+    struct nss_shm_header* header;
+    struct nss_shm_slot* slots;
+    uint32_t nslots;
+    int writable;
+    dev_t dev;
+    ino_t ino;
+};
+
+static struct nss_shm_map* shm_map = NULL;
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t shm_retry = 0;
+
+/* Keys the refresh thread is to read again */
+struct nss_shm_refresh {
+    int kind;
+    uint32_t id;
+    char name[LOGIN_NAME_MAX];
+};
+
+static struct nss_shm_refresh refresh_queue[NSS_SHM_REFRESH_QUEUE];
+static int refresh_count = 0;
+static int refresh_running = FALSE;
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
+/* Set in the refresh thread, whose lookups must reach the database */
+static __thread int shm_refreshing = FALSE;
+
+static uint64_t nss_shm_fnv(uint64_t h, const void* p, size_t len) {
+    const unsigned char* c = p;
+    while(len--) {
+        h = (h ^ *c++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define NSS_SHM_FNV_INIT 0xcbf29ce484222325ULL
+
+/*
+ * Map the cache file of the passwd database st describes.
+ * @return The mapping, NULL if the cache cannot be used.
+ */
+static struct nss_shm_map* nss_shm_open(const struct stat* st) {
+    const struct nss_settings* settings = nss_settings();
+    struct nss_shm_header* header = MAP_FAILED;
+    struct nss_shm_map* map;
+    struct stat fst;
+    char path[PATH_MAX];
+    size_t size = sizeof(*header) + (size_t)settings->shm_cache_slots * sizeof(struct nss_shm_slot);
+    int fd, created = FALSE, writable = geteuid() == st->st_uid;
+
+    snprintf(path, sizeof(path), "%s/nss-sqlite.%llx.%llx.shm", settings->shm_cache,
+             (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+
+    if(writable) {
+        if((fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644)) >= 0) {
+            created = TRUE;
+        } else if(errno == EEXIST) {
+            fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+        }
+    } else {
+        fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if(fd < 0) {
+        if(errno != ENOENT) {
+            NSS_ERROR("%s: %s\n", path, strerror(errno));
+        }
+        return NULL;
+    }
+
+    if(fstat(fd, &fst) != 0 || !S_ISREG(fst.st_mode) || fst.st_uid != st->st_uid
+       || (fst.st_mode & (S_IWGRP | S_IWOTH))) {
+        NSS_ERROR("%s: not owned by the database owner or writable by others, ignored\n", path);
+        close(fd);
+        return NULL;
+    }
+    if(created) {
+        if(settings->shm_cache_slots == 0 || ftruncate(fd, size) != 0) {
+            unlink(path);
+            close(fd);
+            return NULL;
+        }
+    } else {
+        size = fst.st_size;
+    }
+    if(size >= sizeof(*header)) {
+        header = mmap(NULL, size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if(header == MAP_FAILED) {
+        return NULL;
+    }
+
+    if(created) {
+        header->nslots = settings->shm_cache_slots;
+        header->slot_size = sizeof(struct nss_shm_slot);
+        header->dev = st->st_dev;
+        header->ino = st->st_ino;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(header->magic, NSS_SHM_MAGIC, sizeof(header->magic));
+    } else {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }
+    /* A file just created by another process may not be complete yet */
+    if(memcmp(header->magic, NSS_SHM_MAGIC, sizeof(header->magic)) != 0
+       || header->slot_size != sizeof(struct nss_shm_slot) || header->nslots == 0
+       || size != sizeof(*header) + (size_t)header->nslots * sizeof(struct nss_shm_slot)
+       || header->dev != st->st_dev || header->ino != st->st_ino
+       || (map = malloc(sizeof(*map))) == NULL) {
+        munmap(header, size);
+        return NULL;
+    }
+
+    map->header = header;
+    map->slots = (struct nss_shm_slot*)(header + 1);
+    map->nslots = header->nslots;
+    map->writable = writable;
+    map->dev = st->st_dev;
+    map->ino = st->st_ino;
+    return map;
+}
+
+/*
+ * Fold the state of a database file, st, and of its WAL into h.
+ */
+static uint64_t nss_shm_stamp_file(uint64_t h, const char* path, const struct stat* st) {
+    char wal_path[PATH_MAX];
+    struct stat wal;
+
+    h = nss_shm_fnv(h, &st->st_ino, sizeof(st->st_ino));
+    h = nss_shm_fnv(h, &st->st_size, sizeof(st->st_size));
+    h = nss_shm_fnv(h, &st->st_mtim, sizeof(st->st_mtim));
+    snprintf(wal_path, sizeof(wal_path), "%s-wal", path);
+    if(stat(wal_path, &wal) == 0) {
+        h = nss_shm_fnv(h, &wal.st_ino, sizeof(wal.st_ino));
+        h = nss_shm_fnv(h, &wal.st_size, sizeof(wal.st_size));
+        h = nss_shm_fnv(h, &wal.st_mtim, sizeof(wal.st_mtim));
+    }
+    return h;
+}
+
+/*
+ * State of the passwd database and of the shard files the header
+ * lists, which entries must match.
+ * @param db passwd database.
+ * @param st stat() of db.
+ * @return The state, 0 if the list is being written.
+ */
+static uint64_t nss_shm_stamp(struct nss_shm_map* map, const char* db, const struct stat* st) {
+    struct nss_shm_header* header = map->header;
+    char shards[NSS_SHM_SHARDS_SIZE];
+    uint64_t h = nss_shm_stamp_file(NSS_SHM_FNV_INIT, db, st);
+    uint32_t seq, len;
+    struct stat sst;
+    char* p;
+
+    seq = __atomic_load_n(&header->shards_seq, __ATOMIC_ACQUIRE);
+    len = __atomic_load_n(&header->shards_len, __ATOMIC_RELAXED);
+    if((seq & 1) || len > sizeof(shards)) {
+        return 0;
+    }
+    memcpy(shards, header->shards, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&header->shards_seq, __ATOMIC_RELAXED) != seq) {
+        return 0;
+    }
+
+    for(p = shards ; p < shards + len && memchr(p, '\0', shards + len - p) ; p += strlen(p) + 1) {
+        if(stat(p, &sst) != 0) {
+            memset(&sst, 0, sizeof(sst));
+        }
+        h = nss_shm_stamp_file(h, p, &sst);
+    }
+    return h ? h : 1;
+}
+
+/*
+ * Bring the header's list of shard files in line with nss_shards. Only
+ * called after a lookup, which loaded the routes already.
+ * @param db passwd database.
+ * @return FALSE if the list could not be written.
+ */
+static int nss_shm_shards(struct nss_shm_map* map, const char* db) {
+    struct nss_shm_header* header = map->header;
+    const char* paths[NSS_SHARD_MAX];
+    char shards[NSS_SHM_SHARDS_SIZE];
+    uint32_t seq, locked;
+    size_t len = 0, l;
+    time_t now;
+    int i, n;
+
+    n = nss_shard_all(db, paths);
+    for(i = 0 ; i < n ; ++i) {
+        if(strcmp(paths[i], db) == 0) {
+            continue;
+        }
+        if((l = strlen(paths[i]) + 1) > sizeof(shards) - len) {
+            return FALSE;
+        }
+        memcpy(shards + len, paths[i], l);
+        len += l;
+    }
+
+    seq = __atomic_load_n(&header->shards_seq, __ATOMIC_ACQUIRE);
+    if(!(seq & 1) && header->shards_len == len && memcmp(header->shards, shards, len) == 0) {
+        return TRUE;
+    }
+
+    /* Same sequence lock as slots */
+    now = time(NULL);
+    if(seq & 1) {
+        if(now - __atomic_load_n(&header->shards_time, __ATOMIC_RELAXED) < NSS_SHM_STALE_LOCK) {
+            return FALSE;
+        }
+        locked = seq + 2;
+    } else {
+        locked = seq + 1;
+    }
+    if(!__atomic_compare_exchange_n(&header->shards_seq, &seq, locked, FALSE,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return FALSE;
+    }
+    __atomic_store_n(&header->shards_time, now, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->shards, shards, len);
+    __atomic_store_n(&header->shards_len, len, __ATOMIC_RELAXED);
+    return __atomic_compare_exchange_n(&header->shards_seq, &locked, locked + 1, FALSE,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/*
+ * Get the cache of the current passwd database.
+ * @param st Filled with stat() of the passwd database.
+ */
+static struct nss_shm_map* nss_shm_attach(struct stat* st) {
+    const char* db = nss_passwd_db();
+    struct nss_shm_map* map;
+    time_t now;
+
+    if(nss_settings()->shm_cache == NULL || stat(db, st) != 0) {
+        return NULL;
+    }
+
+    map = __atomic_load_n(&shm_map, __ATOMIC_ACQUIRE);
+    if(map == NULL || map->dev != st->st_dev || map->ino != st->st_ino) {
+        now = time(NULL);
+        pthread_mutex_lock(&shm_lock);
+        map = shm_map;
+        if((map == NULL || map->dev != st->st_dev || map->ino != st->st_ino) && now >= shm_retry) {
+            /* A previous mapping is left in place, see struct nss_shm_map */
+            if((map = nss_shm_open(st)) != NULL) {
+                __atomic_store_n(&shm_map, map, __ATOMIC_RELEASE);
+            } else {
+                shm_retry = now + NSS_SHM_RETRY;
+            }
+        }
+        pthread_mutex_unlock(&shm_lock);
+        if(map == NULL || map->dev != st->st_dev || map->ino != st->st_ino) {
+            return NULL;
+        }
+    }
+    return map;
+}
+
+static uint64_t nss_shm_key(int kind, const char* name, uint32_t id) {
+    uint64_t h = nss_shm_fnv(NSS_SHM_FNV_INIT, &kind, sizeof(kind));
+    if(name != NULL) {
+        return nss_shm_fnv(h, name, strlen(name));
+    }
+    return nss_shm_fnv(h, &id, sizeof(id));
+}
+
+static uint32_t nss_shm_sum(const struct nss_shm_slot* slot) {
+    uint64_t h = nss_shm_fnv(NSS_SHM_FNV_INIT, &slot->stamp, sizeof(slot->stamp));
+    h = nss_shm_fnv(h, slot->data, slot->len);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+/*
+ * Next NUL terminated string of a slot's data.
+ * @param p Current position, moved past the string.
+ * @return The string, NULL if data ends before its NUL.
+ */
+static char* nss_shm_str(char** p, const char* end) {
+    char* s = *p;
+    char* nul = memchr(s, '\0', end - s);
+    if(nul == NULL) {
+        return NULL;
+    }
+    *p = nul + 1;
+    return s;
+}
+
+/*
+ * Serialize an entry into a slot's data.
+ * @return FALSE if it does not fit.
+ */
+static int nss_shm_encode(struct nss_shm_slot* slot, int kind, const void* entry) {
+    const char* strs[5];
+    char* p = slot->data;
+    char* end = slot->data + sizeof(slot->data);
+    uint32_t head[2];
+    char** mem = NULL;
+    int i, n;
+
+    if(kind == NSS_CAP_GETPWNAM || kind == NSS_CAP_GETPWUID) {
+        const struct passwd* pw = entry;
+        head[0] = pw->pw_uid;
+        head[1] = pw->pw_gid;
+        strs[0] = pw->pw_name;
+        strs[1] = pw->pw_passwd;
+        strs[2] = pw->pw_gecos;
+        strs[3] = pw->pw_dir;
+        strs[4] = pw->pw_shell;
+        n = 5;
+    } else {
+        const struct group* gr = entry;
+        head[0] = gr->gr_gid;
+        head[1] = 0;
+        for(mem = gr->gr_mem ; *mem ; ++mem) {
+            head[1]++;
+        }
+        mem = gr->gr_mem;
+        strs[0] = gr->gr_name;
+        strs[1] = gr->gr_passwd;
+        n = 2;
+    }
+
+    memcpy(p, head, sizeof(head));
+    p += sizeof(head);
+    for(i = 0 ; i < n || (mem != NULL && *mem != NULL) ; ++i) {
+        const char* s = i < n ? strs[i] : *mem++;
+        size_t l = strlen(s) + 1;
+        if(l > (size_t)(end - p)) {
+            return FALSE;
+        }
+        memcpy(p, s, l);
+        p += l;
+    }
+    slot->len = p - slot->data;
+    return TRUE;
+}
+
+/*
+ * Rebuild an entry from a private copy of a slot and hand it to copy.
+ * @return FALSE if the slot does not hold the key looked up.
+ */
+static int nss_shm_decode(struct nss_shm_slot* slot, int kind, const char* name, uint32_t id,
+                          nss_flight_copy copy, void* dst, char* buf, size_t buflen,
+                          int* errnop, int* res) {
+    char* p = slot->data + 2 * sizeof(uint32_t);
+    char* end = slot->data + slot->len;
+    uint32_t head[2];
+    arena_mark_t mark;
+    int ok = FALSE;
+
+    if(slot->len < sizeof(head)) {
+        return FALSE;
+    }
+    memcpy(head, slot->data, sizeof(head));
+    if(name == NULL && head[0] != id) {
+        return FALSE;
+    }
+
+    if(kind == NSS_CAP_GETPWNAM || kind == NSS_CAP_GETPWUID) {
+        struct passwd pw;
+        pw.pw_uid = head[0];
+        pw.pw_gid = head[1];
+        if((pw.pw_name = nss_shm_str(&p, end)) && (pw.pw_passwd = nss_shm_str(&p, end))
+           && (pw.pw_gecos = nss_shm_str(&p, end)) && (pw.pw_dir = nss_shm_str(&p, end))
+           && (pw.pw_shell = nss_shm_str(&p, end))
+           && (name == NULL || strcmp(name, pw.pw_name) == 0)) {
+            *res = copy(dst, buf, buflen, &pw, errnop);
+            ok = TRUE;
+        }
+        return ok;
+    }
+
+    mark = arena_mark();
+    if(head[1] <= slot->len) {
+        struct group gr;
+        uint32_t i;
+        gr.gr_gid = head[0];
+        if((gr.gr_mem = arena_alloc((head[1] + 1) * sizeof(char*))) != NULL
+           && (gr.gr_name = nss_shm_str(&p, end)) && (gr.gr_passwd = nss_shm_str(&p, end))
+           && (name == NULL || strcmp(name, gr.gr_name) == 0)) {
+            for(i = 0 ; i < head[1] && (gr.gr_mem[i] = nss_shm_str(&p, end)) ; ++i);
+            if(i == head[1]) {
+                gr.gr_mem[i] = NULL;
+                *res = copy(dst, buf, buflen, &gr, errnop);
+                ok = TRUE;
+            }
+        }
+    }
+    arena_release(mark);
+    return ok;
+}
+
+static void nss_shm_atfork_child(void) {
+    pthread_mutex_init(&refresh_lock, NULL);
+    pthread_cond_init(&refresh_cond, NULL);
+    refresh_count = 0;
+    refresh_running = FALSE;
+}
+
+/*
+ * Read queued keys again through the entry points, which store the
+ * fresh entries in the cache.
+ */
+static void* nss_shm_refresher(void* arg) {
+    static char buf[NSS_SHM_SLOT_SIZE * 4];
+    struct nss_shm_refresh key;
+    union {
+        struct passwd pw;
+        struct group gr;
+    } entry;
+    int err;
+
+    (void)arg;
+    shm_refreshing = TRUE;
+    for(;;) {
+        pthread_mutex_lock(&refresh_lock);
+        while(refresh_count == 0) {
+            pthread_cond_wait(&refresh_cond, &refresh_lock);
+        }
+        key = refresh_queue[--refresh_count];
+        pthread_mutex_unlock(&refresh_lock);
+
+        switch(key.kind) {
+            case NSS_CAP_GETPWNAM:
+                _nss_sqlite_getpwnam_r(key.name, &entry.pw, buf, sizeof(buf), &err);
+                break;
+            case NSS_CAP_GETPWUID:
+                _nss_sqlite_getpwuid_r(key.id, &entry.pw, buf, sizeof(buf), &err);
+                break;
+            case NSS_CAP_GETGRNAM:
+                _nss_sqlite_getgrnam_r(key.name, &entry.gr, buf, sizeof(buf), &err);
+                break;
+            case NSS_CAP_GETGRGID:
+                _nss_sqlite_getgrgid_r(key.id, &entry.gr, buf, sizeof(buf), &err);
+                break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Queue a key for the refresh thread, starting it if needed. Gives up
+ * rather than wait when the queue is busy or full, a later hit on the
+ * entry queues it again.
+ */
+static void nss_shm_refresh(int kind, const char* name, uint32_t id) {
+    struct nss_shm_refresh* key;
+    sigset_t all, old;
+    pthread_attr_t attr;
+    pthread_t tid;
+    int i;
+
+    if((name != NULL && strlen(name) >= sizeof(key->name))
+       || pthread_mutex_trylock(&refresh_lock) != 0) {
+        return;
+    }
+    for(i = 0 ; i < refresh_count ; ++i) {
+        key = &refresh_queue[i];
+        if(key->kind == kind && key->id == id && (name == NULL || strcmp(key->name, name) == 0)) {
+            break;
+        }
+    }
+    if(i == refresh_count && refresh_count < NSS_SHM_REFRESH_QUEUE) {
+        key = &refresh_queue[refresh_count++];
+        key->kind = kind;
+        key->id = id;
+        snprintf(key->name, sizeof(key->name), "%s", name ? name : "");
+        pthread_cond_signal(&refresh_cond);
+    }
+    if(!refresh_running) {
+        static int registered = FALSE;
+        if(!registered) {
+            pthread_atfork(NULL, NULL, nss_shm_atfork_child);
+            registered = TRUE;
+        }
+        /* Signals of the host are not ours to receive */
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        refresh_running = pthread_create(&tid, &attr, nss_shm_refresher, NULL) == 0;
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    pthread_mutex_unlock(&refresh_lock);
+}
+
+/*
+ * Look an entry up in the shared cache.
+ * @param kind NSS_CAP_GETPWNAM, NSS_CAP_GETPWUID, NSS_CAP_GETGRNAM or
+ * NSS_CAP_GETGRGID.
+ * @param name Key for lookups by name, else NULL.
+ * @param id Key for lookups by id.
+ * @param copy Copies the cached entry into the caller's buffer.
+ * @param dst, buf, buflen, errnop Caller's entry point arguments.
+ * @param res Set to the caller's answer when TRUE is returned.
+ * @param stamp Set on a miss to the state of the databases before the
+ *      caller reads them, to be handed to nss_shm_put(). 0 if the cache
+ *      is not used.
+ * @return TRUE on a hit.
+ */
+int nss_shm_get(int kind, const char* name, uint32_t id, nss_flight_copy copy,
+                void* dst, char* buf, size_t buflen, int* errnop, int* res, uint64_t* stamp) {
+    const struct nss_settings* settings = nss_settings();
+    struct nss_shm_map* map;
+    struct nss_shm_slot local;
+    struct stat st;
+    uint64_t h;
+    time_t now;
+    int i;
+
+    *stamp = 0;
+    if(!(map = nss_shm_attach(&st)) || !(*stamp = nss_shm_stamp(map, nss_passwd_db(), &st))
+       || shm_refreshing) {
+        return FALSE;
+    }
+    h = nss_shm_key(kind, name, id);
+    now = time(NULL);
+
+    for(i = 0 ; i < NSS_SHM_PROBES ; ++i) {
+        struct nss_shm_slot* slot = &map->slots[(h + i) % map->nslots];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if((seq & 1) || __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != h) {
+            continue;
+        }
+        memcpy(&local, slot, sizeof(local));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        if(local.kind != (uint32_t)kind || local.hash != h || local.stamp != *stamp
+           || now < local.time || now - local.time >= settings->shm_cache_ttl
+           || local.len > sizeof(local.data) || local.sum != nss_shm_sum(&local)) {
+            continue;
+        }
+        if(nss_shm_decode(&local, kind, name, id, copy, dst, buf, buflen, errnop, res)) {
+            if(map->writable && settings->shm_cache_refresh > 0 &&
+               (now - local.time) * 100 >= settings->shm_cache_ttl * (100 - settings->shm_cache_refresh)) {
+                nss_shm_refresh(kind, name, id);
+            }
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Store an entry just read from the database, see nss_shm_get(). Only
+ * successful lookups are cached, and only if no commit landed since
+ * stamp was taken, nor did the shard files change: the entry may
+ * predate it.
+ * @param stamp State of the databases before the lookup read them.
+ * @param res Answer of the lookup.
+ * @param entry Entry found.
+ */
+void nss_shm_put(int kind, const char* name, uint32_t id, uint64_t stamp, int res, const void* entry) {
+    struct nss_shm_map* map;
+    struct nss_shm_slot local;
+    struct nss_shm_slot* slot = NULL;
+    struct stat st;
+    uint64_t h;
+    uint32_t seq, locked;
+    time_t now;
+    int i;
+
+    if(res != NSS_STATUS_SUCCESS || stamp == 0 || !(map = nss_shm_attach(&st)) || !map->writable
+       || !nss_shm_shards(map, nss_passwd_db()) || nss_shm_stamp(map, nss_passwd_db(), &st) != stamp) {
+        return;
+    }
+    if(!nss_shm_encode(&local, kind, entry)) {
+        return;
+    }
+    h = nss_shm_key(kind, name, id);
+    now = time(NULL);
+
+    /* Same key, else a free slot, else the oldest one */
+    for(i = 0 ; i < NSS_SHM_PROBES ; ++i) {
+        struct nss_shm_slot* cur = &map->slots[(h + i) % map->nslots];
+        if(cur->hash == h || cur->kind == 0) {
+            slot = cur;
+            break;
+        }
+        if(slot == NULL || cur->time < slot->time) {
+            slot = cur;
+        }
+    }
+
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if(seq & 1) {
+        /* Being written, or its writer died */
+        if(now - __atomic_load_n(&slot->time, __ATOMIC_RELAXED) < NSS_SHM_STALE_LOCK) {
+            return;
+        }
+        locked = seq + 2;
+    } else {
+        locked = seq + 1;
+    }
+    if(!__atomic_compare_exchange_n(&slot->seq, &seq, locked, FALSE,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_store_n(&slot->time, now, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->kind = kind;
+    slot->hash = h;
+    slot->stamp = stamp;
+    slot->len = local.len;
+    memcpy(slot->data, local.data, local.len);
+    local.stamp = stamp;
+    slot->sum = nss_shm_sum(&local);
+
+    /* Fails if another writer took the slot over meanwhile */
+    __atomic_compare_exchange_n(&slot->seq, &locked, locked + 1, FALSE,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
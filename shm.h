@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_SHM_H
+#define NSS_SQLITE_SHM_H
+
+#include "flight.h"
+
+#include <stdint.h>
+
+#define NSS_SHM_MAGIC "NSSSHM2"
+/* Size of a cache slot, entries which do not fit are not cached */
+#define NSS_SHM_SLOT_SIZE 512
+/* Slots probed for a key */
+#define NSS_SHM_PROBES 8
+/* Seconds after which a slot locked by a writer is taken over, the
+ * writer presumably died */
+#define NSS_SHM_STALE_LOCK 2
+/* Entries waiting to be refreshed ahead of their expiry */
+#define NSS_SHM_REFRESH_QUEUE 64
+/* Room for the shard file names kept in the header */
+#define NSS_SHM_SHARDS_SIZE 4032
+
+/*
+ * Shared cache file layout: a header followed by nslots slots, each
+ * protected by a sequence lock (odd while written).
+ */
+struct nss_shm_header {
+    char magic[8];                  /* NSS_SHM_MAGIC, written last */
+    uint32_t nslots;
+    uint32_t slot_size;
+    uint64_t dev;                   /* passwd database the cache is for */
+    uint64_t ino;
+    uint32_t shards_seq;            /* sequence lock of the shard list */
+    uint32_t shards_len;            /* bytes used in shards */
+    int64_t shards_time;            /* CLOCK_REALTIME seconds of the write */
+    char shards[NSS_SHM_SHARDS_SIZE];   /* shard files other than the
+                                       passwd database, NUL terminated */
+    char pad[16];
+};
+
+struct nss_shm_slot {
+    uint32_t seq;
+    uint32_t kind;                  /* enum nss_capture_func, 0 if empty */
+    uint64_t hash;                  /* hash of kind and key */
+    uint64_t stamp;                 /* database state the entry was read
+                                       from, see nss_shm_stamp() */
+    int64_t time;                   /* CLOCK_REALTIME seconds of the write */
+    uint32_t len;                   /* bytes used in data */
+    uint32_t sum;                   /* checksum of data */
+    char data[NSS_SHM_SLOT_SIZE - 40];
+};
+
+int nss_shm_get(int, const char*, uint32_t, nss_flight_copy, void*, char*, size_t, int*, int*, uint64_t*);
+void nss_shm_put(int, const char*, uint32_t, uint64_t, int, const void*);
+
+#endif
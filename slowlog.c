@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * slowlog.c : Sampling slow query log.
+ *
+ * When slow_log is set, every handle is profiled with sqlite3_trace_v2().
+ * Statements slower than slow_log_threshold_us, and one statement out of
+ * slow_log_sample, are noted together with their bound values and VM
+ * counters. Notes are written out when the handle is released, along
+ * with the statement's query plan: running EXPLAIN QUERY PLAN from the
+ * trace callback itself would reenter the connection.
+ *
+ * The log is appended one line per record and renamed to <slow_log>.1
+ * once it reaches slow_log_max_bytes, so it never takes more than twice
+ * that. Processes unable to write it lose their records.
+ */
+
+#include "nss-sqlite.h"
+#include "settings.h"
+#include "slowlog.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+struct nss_slow_record {
+    const char* name;       /* nss_queries or internal name */
+    char* sql;              /* statement text, sqlite3_malloc'ed */
+    char* expanded;         /* same with bound values, sqlite3_malloc'ed */
+    sqlite3_int64 ns;
+    int steps;
+    int fullscan;
+    int sort;
+    int autoindex;
+    int sampled;
+};
+
+struct nss_slow {
+    int flushing;           /* ignore our own EXPLAIN statements */
+    int count;
+    struct nss_slow_record records[NSS_SLOW_PENDING];
+};
+
+static unsigned long sample_counter = 0;
+
+/*
+ * SQLITE_TRACE_PROFILE callback, runs each time a statement ends.
+ */
+static int nss_slowlog_trace(unsigned mask, void* ctx, void* p, void* x) {
+    struct nss_db* db = ctx;
+    struct nss_slow* slow = db->slow;
+    const struct nss_settings* settings = nss_settings();
+    sqlite3_stmt* pSt = p;
+    sqlite3_int64 ns = *(sqlite3_int64*)x;
+    struct nss_slow_record* rec;
+    int i, steps, fullscan, sort, autoindex, sampled = FALSE;
+
+    /* Counters are read and cleared at each run, so they are per run */
+    steps = sqlite3_stmt_status(pSt, SQLITE_STMTSTATUS_VM_STEP, 1);
+    fullscan = sqlite3_stmt_status(pSt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+    sort = sqlite3_stmt_status(pSt, SQLITE_STMTSTATUS_SORT, 1);
+    autoindex = sqlite3_stmt_status(pSt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+
+    if(slow->flushing) {
+        return 0;
+    }
+    if(settings->slow_log_sample > 0) {
+        sampled = __atomic_add_fetch(&sample_counter, 1, __ATOMIC_RELAXED) % settings->slow_log_sample == 0;
+    }
+    if(!sampled && ns < settings->slow_log_threshold_us * 1000) {
+        return 0;
+    }
+    if(slow->count == NSS_SLOW_PENDING) {
+        return 0;
+    }
+
+    rec = &slow->records[slow->count++];
+    rec->name = "-";
+    for(i = 0 ; i < db->nstmts ; ++i) {
+        if(db->stmts[i].pSt == pSt) {
+            rec->name = db->stmts[i].name;
+            break;
+        }
+    }
+    rec->sql = sqlite3_mprintf("%s", sqlite3_sql(pSt));
+    rec->expanded = sqlite3_expanded_sql(pSt);
+    rec->ns = ns;
+    rec->steps = steps;
+    rec->fullscan = fullscan;
+    rec->sort = sort;
+    rec->autoindex = autoindex;
+    rec->sampled = sampled;
+    return 0;
+}
+
+/*
+ * Start profiling a new handle.
+ */
+void nss_slowlog_attach(struct nss_db* db) {
+    if(!(db->slow = calloc(1, sizeof(*db->slow)))) {
+        return;
+    }
+    sqlite3_trace_v2(db->pDb, SQLITE_TRACE_PROFILE, nss_slowlog_trace, db);
+}
+
+/*
+ * Query plan of a statement, details joined by "; ".
+ * @return sqlite3_malloc'ed string, NULL on error.
+ */
+static char* nss_slowlog_plan(struct nss_db* db, const char* sql) {
+    sqlite3_stmt* pSt;
+    char *eqp, *plan = NULL;
+
+    if(!(eqp = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql))) {
+        return NULL;
+    }
+    if(sqlite3_prepare_v2(db->pDb, eqp, -1, &pSt, NULL) == SQLITE_OK) {
+        while(sqlite3_step(pSt) == SQLITE_ROW) {
+            const char* detail = (const char*)sqlite3_column_text(pSt, 3);
+            char* p = plan ? sqlite3_mprintf("%s; %s", plan, detail) : sqlite3_mprintf("%s", detail);
+            sqlite3_free(plan);
+            plan = p;
+        }
+    }
+    sqlite3_finalize(pSt);
+    sqlite3_free(eqp);
+    return plan;
+}
+
+/*
+ * Replace line breaks so that a record stays on one line.
+ */
+static void nss_slowlog_flatten(char* s) {
+    for( ; s && *s ; ++s) {
+        if(*s == '\n' || *s == '\r' || *s == '\t') {
+            *s = ' ';
+        }
+    }
+}
+
+/*
+ * Append a line to the log, rotating it when it grew too big.
+ */
+static void nss_slowlog_write(const char* line, size_t len) {
+    const struct nss_settings* settings = nss_settings();
+    char old[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    fd = open(settings->slow_log, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY, 0600);
+    if(fd < 0) {
+        return;
+    }
+    if(fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size + len > settings->slow_log_max_bytes
+       && snprintf(old, sizeof(old), "%s.1", settings->slow_log) < (int)sizeof(old)) {
+        close(fd);
+        rename(settings->slow_log, old);
+        fd = open(settings->slow_log, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY, 0600);
+        if(fd < 0) {
+            return;
+        }
+    }
+    if(write(fd, line, len) < 0) {
+        NSS_DEBUG("slow_log: %m\n");
+    }
+    close(fd);
+}
+
+/*
+ * Write out records noted while the handle was in use. Called once
+ * every statement of the handle has been reset.
+ */
+void nss_slowlog_flush(struct nss_db* db) {
+    struct nss_slow* slow = db->slow;
+    char stamp[32];
+    struct tm tm;
+    time_t now;
+    int i;
+
+    if(slow == NULL || slow->count == 0) {
+        return;
+    }
+
+    now = time(NULL);
+    gmtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+    slow->flushing = TRUE;
+    for(i = 0 ; i < slow->count ; ++i) {
+        struct nss_slow_record* rec = &slow->records[i];
+        char *plan = NULL, *line;
+
+        if(rec->sql != NULL) {
+            plan = nss_slowlog_plan(db, rec->sql);
+        }
+        nss_slowlog_flatten(rec->expanded);
+        nss_slowlog_flatten(plan);
+        line = sqlite3_mprintf("%s pid=%d db=%s query=%s time_us=%lld steps=%d fullscan=%d sort=%d autoindex=%d%s sql=\"%s\" plan=\"%s\"\n",
+                               stamp, (int)getpid(), nss_db_path(db), rec->name, rec->ns / 1000,
+                               rec->steps, rec->fullscan, rec->sort, rec->autoindex,
+                               rec->sampled ? " sampled" : "",
+                               rec->expanded ? rec->expanded : "", plan ? plan : "");
+        if(line != NULL) {
+            nss_slowlog_write(line, strlen(line));
+        }
+        sqlite3_free(line);
+        sqlite3_free(plan);
+        sqlite3_free(rec->sql);
+        sqlite3_free(rec->expanded);
+    }
+    slow->count = 0;
+    slow->flushing = FALSE;
+}
+
+/*
+ * Stop profiling a handle about to be closed, pending records are lost.
+ */
+void nss_slowlog_detach(struct nss_db* db) {
+    int i;
+
+    if(db->slow == NULL) {
+        return;
+    }
+    sqlite3_trace_v2(db->pDb, 0, NULL, NULL);
+    for(i = 0 ; i < db->slow->count ; ++i) {
+        sqlite3_free(db->slow->records[i].sql);
+        sqlite3_free(db->slow->records[i].expanded);
+    }
+    free(db->slow);
+    db->slow = NULL;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_SLOWLOG_H
+#define NSS_SQLITE_SLOWLOG_H
+
+#include "db.h"
+
+/* Records kept per handle until it is released */
+#define NSS_SLOW_PENDING 4
+
+void nss_slowlog_attach(struct nss_db*);
+void nss_slowlog_flush(struct nss_db*);
+void nss_slowlog_detach(struct nss_db*);
+
+#endif
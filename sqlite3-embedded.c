@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * sqlite3-embedded.c : SQLite amalgamation built into the module
+ * (configure --with-sqlite-amalgamation).
+ *
+ * The module only reads, each handle is used by one thread at a time
+ * and SQLite's symbols are not visible outside of it, so this copy
+ * leaves out what the system library has to carry for everybody else.
+ */
+
+/* Hide SQLite from the host, which may use its own */
+#define SQLITE_API __attribute__((visibility("hidden")))
+
+/* Handles are never shared between threads (see db.c), SQLite itself
+ * does not need to serialize their use */
+#define SQLITE_THREADSAFE 2
+
+/* Memory statistics cost a global mutex per allocation. db.c turns
+ * them back on when memory_limit needs them. */
+#define SQLITE_DEFAULT_MEMSTATUS 0
+
+/* Small private caches, pages come from the shared file mapping */
+#define SQLITE_DEFAULT_CACHE_SIZE -256
+#define SQLITE_DEFAULT_MMAP_SIZE 67108864
+
+#define SQLITE_DEFAULT_FOREIGN_KEYS 0
+#define SQLITE_LIKE_DOESNT_MATCH_BLOBS 1
+#define SQLITE_MAX_EXPR_DEPTH 0
+#define SQLITE_TEMP_STORE 3
+#define SQLITE_USE_ALLOCA 1
+
+/* Features no lookup uses */
+#define SQLITE_OMIT_DECLTYPE 1
+#define SQLITE_OMIT_DEPRECATED 1
+#define SQLITE_OMIT_JSON 1
+#define SQLITE_OMIT_LOAD_EXTENSION 1
+#define SQLITE_OMIT_SHARED_CACHE 1
+
+#include <sqlite3.c>
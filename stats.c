@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * stats.c : Counters and database state exported to applications.
+ */
+
+#include "nss-sqlite.h"
+#include "db.h"
+#include "settings.h"
+#include "stats.h"
+
+#include <sqlite3.h>
+#include <string.h>
+
+struct nss_sqlite_stats nss_stats;
+
+void nss_sqlite_get_stats(struct nss_sqlite_stats* st) {
+    sqlite3_int64 cur, hi;
+
+    memset(st, 0, sizeof(*st));
+    st->lookups = __atomic_load_n(&nss_stats.lookups, __ATOMIC_RELAXED);
+    st->db_opens = __atomic_load_n(&nss_stats.db_opens, __ATOMIC_RELAXED);
+    st->db_reuses = __atomic_load_n(&nss_stats.db_reuses, __ATOMIC_RELAXED);
+    st->db_discards = __atomic_load_n(&nss_stats.db_discards, __ATOMIC_RELAXED);
+    st->stmt_prepares = __atomic_load_n(&nss_stats.stmt_prepares, __ATOMIC_RELAXED);
+    st->stmt_reuses = __atomic_load_n(&nss_stats.stmt_reuses, __ATOMIC_RELAXED);
+    st->arena_bytes = __atomic_load_n(&nss_stats.arena_bytes, __ATOMIC_RELAXED);
+    st->arena_overflows = __atomic_load_n(&nss_stats.arena_overflows, __ATOMIC_RELAXED);
+    st->lookaside_hits = __atomic_load_n(&nss_stats.lookaside_hits, __ATOMIC_RELAXED);
+    st->lookaside_misses = __atomic_load_n(&nss_stats.lookaside_misses, __ATOMIC_RELAXED);
+    st->breaker_trips = __atomic_load_n(&nss_stats.breaker_trips, __ATOMIC_RELAXED);
+    st->breaker_rejects = __atomic_load_n(&nss_stats.breaker_rejects, __ATOMIC_RELAXED);
+
+    if(!nss_sqlite3_loaded()) {
+        return;
+    }
+    if(sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &cur, &hi, 0) == SQLITE_OK) {
+        st->sqlite_memory = cur;
+    }
+    if(sqlite3_status64(SQLITE_STATUS_MALLOC_COUNT, &cur, &hi, 0) == SQLITE_OK) {
+        st->sqlite_malloc_count = cur;
+    }
+}
+
+void nss_sqlite_get_footprint(struct nss_sqlite_footprint* fp) {
+    nss_db_footprint(fp);
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_STATS_H
+#define NSS_SQLITE_STATS_H
+
+#include "libnss-sqlite.h"
+
+extern struct nss_sqlite_stats nss_stats;
+
+/* Counters are only ever added to, relaxed ordering is enough. */
+#define NSS_STAT_ADD(field, n) \
+    __atomic_fetch_add(&nss_stats.field, (n), __ATOMIC_RELAXED)
+#define NSS_STAT_INC(field) NSS_STAT_ADD(field, 1)
+
+#endif
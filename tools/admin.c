@@ -0,0 +1,514 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * admin.c : nss-sqlite-admin, account provisioning.
+ *
+ *  nss-sqlite-admin [-t MS] [-e COMMAND]... DB [FILE...]
+ *
+ * Commands come from -e options, else from the FILEs, else from the
+ * standard input, one per line:
+ *
+ *  add-user NAME:PASSWD:UID:GID:GECOS:HOME:SHELL   (passwd(5) entry)
+ *  mod-user NAME:PASSWD:UID:GID:GECOS:HOME:SHELL   replaces user NAME
+ *  del-user NAME
+ *  add-group NAME:PASSWD:GID[:MEMBERS]             (group(5) entry)
+ *  del-group NAME
+ *  add-member GROUP USER...
+ *  del-member GROUP USER...
+ *  add-subgroup GROUP SUBGROUP...                  members of SUBGROUP
+ *  del-subgroup GROUP SUBGROUP...                  belong to GROUP
+ *
+ * Commands are grouped into transactions, each committed once it has
+ * been open for MS milliseconds (20 by default), so that bulk changes
+ * never hold the write lock for long. The journal mode is left alone,
+ * see nss-sqlite-sync. A command failing is reported and undone alone.
+ * group_members and the closures of nested groups are kept up to date
+ * by the schema's triggers, which refuse nesting cycles. Every
+ * transaction bumps nss_generation, as nss-sqlite-sync does.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* program = "nss-sqlite-admin";
+
+static const char* schema_sql =
+    "CREATE TABLE IF NOT EXISTS nss_generation(id INTEGER PRIMARY KEY CHECK (id = 0), generation INTEGER NOT NULL);"
+    "INSERT OR IGNORE INTO nss_generation VALUES(0, 0);"
+    "CREATE TEMP TABLE admin_groups(gid INTEGER);";
+
+static sqlite3* pDb;
+static sqlite3_int64 generation;
+static long budget_ms = 20;
+static struct timespec txn_start;
+static int in_txn = 0;
+static int nesting = 0;
+static long ops = 0, failed = 0, txns = 0;
+
+static void usage(void) {
+    fprintf(stderr, "usage: %s [-t MS] [-e COMMAND]... DB [FILE...]\n", program);
+    exit(2);
+}
+
+static int exec_sql(const char* sql) {
+    char* err = NULL;
+    if(sqlite3_exec(pDb, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", program, err);
+        sqlite3_free(err);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Run a statement with text and integer arguments: each character of
+ * types tells the type of the next argument, 't' for a string, 'i' for
+ * a long long.
+ * @return Number of rows changed, -1 on errors.
+ */
+static int run(const char* sql, const char* types, ...) {
+    sqlite3_stmt* pSt;
+    va_list ap;
+    int i, res;
+
+    if(sqlite3_prepare_v2(pDb, sql, -1, &pSt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", program, sqlite3_errmsg(pDb));
+        return -1;
+    }
+    va_start(ap, types);
+    for(i = 0 ; types[i] ; ++i) {
+        if(types[i] == 't') {
+            sqlite3_bind_text(pSt, i + 1, va_arg(ap, const char*), -1, SQLITE_TRANSIENT);
+        } else {
+            sqlite3_bind_int64(pSt, i + 1, va_arg(ap, long long));
+        }
+    }
+    va_end(ap);
+    res = sqlite3_step(pSt);
+    sqlite3_finalize(pSt);
+    if(res != SQLITE_DONE && res != SQLITE_ROW) {
+        fprintf(stderr, "%s: %s\n", program, sqlite3_errmsg(pDb));
+        return -1;
+    }
+    return sqlite3_changes(pDb);
+}
+
+static long long lookup_id(const char* sql, const char* name, int quiet) {
+    sqlite3_stmt* pSt;
+    long long id = -1;
+
+    if(sqlite3_prepare_v2(pDb, sql, -1, &pSt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(pSt, 1, name, -1, SQLITE_STATIC);
+        if(sqlite3_step(pSt) == SQLITE_ROW) {
+            id = sqlite3_column_int64(pSt, 0);
+        }
+    }
+    sqlite3_finalize(pSt);
+    if(id < 0 && !quiet) {
+        fprintf(stderr, "%s: %s: no such entry\n", program, name);
+    }
+    return id;
+}
+
+#define user_id(name, quiet) lookup_id("SELECT uid FROM passwd WHERE username = ?", name, quiet)
+#define group_id(name, quiet) lookup_id("SELECT gid FROM groups WHERE groupname = ?", name, quiet)
+
+/*
+ * Start a transaction, reading the generation it is to bump.
+ */
+static int begin(void) {
+    sqlite3_stmt* pSt;
+
+    if(exec_sql("BEGIN IMMEDIATE") < 0) {
+        return -1;
+    }
+    if(sqlite3_prepare_v2(pDb, "SELECT generation FROM nss_generation", -1, &pSt, NULL) != SQLITE_OK
+       || sqlite3_step(pSt) != SQLITE_ROW) {
+        fprintf(stderr, "%s: %s\n", program, sqlite3_errmsg(pDb));
+        sqlite3_finalize(pSt);
+        exec_sql("ROLLBACK");
+        return -1;
+    }
+    generation = sqlite3_column_int64(pSt, 0);
+    sqlite3_finalize(pSt);
+    clock_gettime(CLOCK_MONOTONIC, &txn_start);
+    in_txn = 1;
+    return 0;
+}
+
+/*
+ * Bump the generation and commit.
+ */
+static int commit(void) {
+    char sql[128];
+
+    generation++;
+    snprintf(sql, sizeof(sql), "UPDATE nss_generation SET generation = %lld", (long long)generation);
+    in_txn = 0;
+    if(exec_sql(sql) < 0 || exec_sql("COMMIT") < 0) {
+        exec_sql("ROLLBACK");
+        return -1;
+    }
+    txns++;
+    return 0;
+}
+
+/*
+ * Split a passwd(5) or group(5) entry in place.
+ * @return Number of fields.
+ */
+static int split(char* entry, char** fields, int max) {
+    int n = 0;
+
+    fields[n++] = entry;
+    for(; *entry ; ++entry) {
+        if(*entry == ':') {
+            if(n == max) {
+                return -1;
+            }
+            *entry = '\0';
+            fields[n++] = entry + 1;
+        }
+    }
+    return n;
+}
+
+static int number(const char* s, long long* n) {
+    char* end;
+
+    errno = 0;
+    *n = strtoll(s, &end, 10);
+    return *s != '\0' && *end == '\0' && errno == 0 && *n >= 0;
+}
+
+static int add_member(const char* group, const char* user) {
+    long long gid = group_id(group, 0), uid = user_id(user, 0);
+
+    if(gid < 0 || uid < 0 || run("INSERT OR IGNORE INTO user_group(uid, gid) VALUES(?, ?)", "ii", uid, gid) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int del_member(const char* group, const char* user) {
+    long long gid = group_id(group, 0), uid = user_id(user, 0);
+
+    if(gid < 0 || uid < 0 || run("DELETE FROM user_group WHERE uid = ? AND gid = ?", "ii", uid, gid) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int add_subgroup(const char* group, const char* sub) {
+    long long gid = group_id(group, 0), member_gid = group_id(sub, 0);
+
+    if(!nesting) {
+        fprintf(stderr, "%s: no group_nesting table in database\n", program);
+        return -1;
+    }
+    if(gid < 0 || member_gid < 0 ||
+       run("INSERT OR IGNORE INTO group_nesting(gid, member_gid) VALUES(?, ?)", "ii", gid, member_gid) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int del_subgroup(const char* group, const char* sub) {
+    long long gid = group_id(group, 0), member_gid = group_id(sub, 0);
+
+    if(!nesting) {
+        fprintf(stderr, "%s: no group_nesting table in database\n", program);
+        return -1;
+    }
+    if(gid < 0 || member_gid < 0 ||
+       run("DELETE FROM group_nesting WHERE gid = ? AND member_gid = ?", "ii", gid, member_gid) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * add-user and mod-user. The memberships of a user whose uid changes
+ * are taken out and put back around the update so that the triggers
+ * maintaining group_members see consistent rows.
+ */
+static int set_user(char* entry, int add) {
+    char* f[7];
+    long long uid, gid, old = -1;
+
+    if(split(entry, f, 7) != 7 || !number(f[2], &uid) || !number(f[3], &gid) || *f[0] == '\0') {
+        fprintf(stderr, "%s: malformed passwd entry\n", program);
+        return -1;
+    }
+    if(add) {
+        if(user_id(f[0], 1) >= 0) {
+            fprintf(stderr, "%s: %s: user exists\n", program, f[0]);
+            return -1;
+        }
+        if(run("INSERT INTO passwd(uid, username, passwd, gid, gecos, homedir, shell) VALUES(?, ?, ?, ?, ?, ?, ?)",
+               "ittittt", uid, f[0], f[1], gid, f[4], f[5], f[6]) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+
+    if((old = user_id(f[0], 0)) < 0) {
+        return -1;
+    }
+    if(old != uid &&
+       (run("INSERT INTO temp.admin_groups SELECT gid FROM user_group WHERE uid = ?", "i", old) < 0 ||
+        run("DELETE FROM user_group WHERE uid = ?", "i", old) < 0)) {
+        return -1;
+    }
+    if(run("UPDATE passwd SET uid = ?, passwd = ?, gid = ?, gecos = ?, homedir = ?, shell = ? WHERE uid = ?",
+           "itittti", uid, f[1], gid, f[4], f[5], f[6], old) < 0) {
+        return -1;
+    }
+    if(old != uid &&
+       (run("INSERT INTO user_group(uid, gid) SELECT ?, gid FROM temp.admin_groups", "i", uid) < 0 ||
+        run("DELETE FROM temp.admin_groups", "") < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int del_user(const char* name) {
+    long long uid = user_id(name, 0);
+
+    /* Memberships first, while the triggers can still find the name */
+    if(uid < 0 ||
+       run("DELETE FROM user_group WHERE uid = ?", "i", uid) < 0 ||
+       run("DELETE FROM passwd WHERE uid = ?", "i", uid) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int add_group(char* entry) {
+    char* f[4];
+    char* member;
+    long long gid;
+    int n = split(entry, f, 4);
+
+    if((n != 3 && n != 4) || !number(f[2], &gid) || *f[0] == '\0') {
+        fprintf(stderr, "%s: malformed group entry\n", program);
+        return -1;
+    }
+    if(group_id(f[0], 1) >= 0) {
+        fprintf(stderr, "%s: %s: group exists\n", program, f[0]);
+        return -1;
+    }
+    if(run("INSERT INTO groups(gid, groupname, passwd) VALUES(?, ?, ?)", "itt", gid, f[0], f[1]) < 0) {
+        return -1;
+    }
+    for(member = n == 4 ? strtok(f[3], ",") : NULL ; member ; member = strtok(NULL, ",")) {
+        if(add_member(f[0], member) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int del_group(const char* name) {
+    long long gid = group_id(name, 0);
+
+    if(gid < 0 ||
+       (nesting && run("DELETE FROM group_nesting WHERE gid = ? OR member_gid = ?", "ii", gid, gid) < 0) ||
+       run("DELETE FROM user_group WHERE gid = ?", "i", gid) < 0 ||
+       run("DELETE FROM group_members WHERE gid = ?", "i", gid) < 0 ||
+       run("DELETE FROM groups WHERE gid = ?", "i", gid) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Apply op to GROUP and each of the names following it in args.
+ */
+static int members(char* args, int (*op)(const char*, const char*), const char* expected) {
+    char* group = strtok(args, " \t");
+    char* name;
+    int n = 0;
+
+    while(group != NULL && (name = strtok(NULL, " \t")) != NULL) {
+        if(op(group, name) < 0) {
+            return -1;
+        }
+        n++;
+    }
+    if(n == 0) {
+        fprintf(stderr, "%s: %s expected\n", program, expected);
+        return -1;
+    }
+    return 0;
+}
+
+static int dispatch(const char* cmd, char* args) {
+    if(strcmp(cmd, "add-user") == 0) {
+        return set_user(args, 1);
+    } else if(strcmp(cmd, "mod-user") == 0) {
+        return set_user(args, 0);
+    } else if(strcmp(cmd, "del-user") == 0) {
+        return del_user(args);
+    } else if(strcmp(cmd, "add-group") == 0) {
+        return add_group(args);
+    } else if(strcmp(cmd, "del-group") == 0) {
+        return del_group(args);
+    } else if(strcmp(cmd, "add-member") == 0) {
+        return members(args, add_member, "GROUP USER...");
+    } else if(strcmp(cmd, "del-member") == 0) {
+        return members(args, del_member, "GROUP USER...");
+    } else if(strcmp(cmd, "add-subgroup") == 0) {
+        return members(args, add_subgroup, "GROUP SUBGROUP...");
+    } else if(strcmp(cmd, "del-subgroup") == 0) {
+        return members(args, del_subgroup, "GROUP SUBGROUP...");
+    }
+    fprintf(stderr, "%s: unknown command %s\n", program, cmd);
+    return -1;
+}
+
+/*
+ * Run one command line inside the current transaction, starting one if
+ * needed and committing it once over budget.
+ */
+static int command(char* line, const char* where) {
+    struct timespec now;
+    char* cmd;
+    char* args;
+    size_t l = strlen(line);
+
+    while(l > 0 && (line[l - 1] == '\n' || line[l - 1] == '\r')) {
+        line[--l] = '\0';
+    }
+    cmd = line + strspn(line, " \t");
+    if(*cmd == '\0' || *cmd == '#') {
+        return 0;
+    }
+    args = cmd + strcspn(cmd, " \t");
+    if(*args != '\0') {
+        *args++ = '\0';
+        args += strspn(args, " \t");
+    }
+
+    if(!in_txn && begin() < 0) {
+        return -1;
+    }
+    /* Commands are undone alone on failure */
+    exec_sql("SAVEPOINT command");
+    ops++;
+    if(dispatch(cmd, args) < 0) {
+        fprintf(stderr, "%s: %s: %s failed\n", program, where, cmd);
+        exec_sql("ROLLBACK TO command");
+        failed++;
+    }
+    exec_sql("RELEASE command");
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if((now.tv_sec - txn_start.tv_sec) * 1000 + (now.tv_nsec - txn_start.tv_nsec) / 1000000 >= budget_ms) {
+        return commit();
+    }
+    return 0;
+}
+
+static int run_file(const char* path) {
+    FILE* f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char line[8192];
+    int res = 0;
+
+    if(f == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", program, path, strerror(errno));
+        return -1;
+    }
+    while(res == 0 && fgets(line, sizeof(line), f) != NULL) {
+        res = command(line, path);
+    }
+    if(f != stdin) {
+        fclose(f);
+    }
+    return res;
+}
+
+int main(int argc, char** argv) {
+    char** cmds = NULL;
+    int c, i, ncmds = 0, res = 0;
+
+    while((c = getopt(argc, argv, "t:e:")) != -1) {
+        switch(c) {
+            case 't':
+                budget_ms = atol(optarg);
+                break;
+            case 'e':
+                cmds = realloc(cmds, (ncmds + 1) * sizeof(*cmds));
+                cmds[ncmds++] = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if(optind == argc || (ncmds > 0 && argc - optind > 1)) {
+        usage();
+    }
+
+    if(sqlite3_open_v2(argv[optind], &pDb, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s: %s\n", program, argv[optind], sqlite3_errmsg(pDb));
+        sqlite3_close(pDb);
+        return 1;
+    }
+    sqlite3_busy_timeout(pDb, 5000);
+    if(exec_sql(schema_sql) < 0) {
+        sqlite3_close(pDb);
+        return 1;
+    }
+    nesting = lookup_id("SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?", "group_nesting", 1) > 0;
+
+    if(ncmds > 0) {
+        for(i = 0 ; i < ncmds && res == 0 ; ++i) {
+            res = command(cmds[i], "-e");
+        }
+    } else if(optind + 1 == argc) {
+        res = run_file("-");
+    } else {
+        for(i = optind + 1 ; i < argc && res == 0 ; ++i) {
+            res = run_file(argv[i]);
+        }
+    }
+    if(in_txn) {
+        if(res == 0) {
+            res = commit();
+        } else {
+            exec_sql("ROLLBACK");
+        }
+    }
+
+    sqlite3_close(pDb);
+    fprintf(stderr, "%s: %ld commands, %ld failed, %ld transactions, generation %lld\n",
+            program, ops, failed, txns, (long long)generation);
+    free(cmds);
+    return res == 0 && failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * dump.c : nss-sqlite-dump, write whole databases out.
+ *
+ *  nss-sqlite-dump [-j THREADS] [-o passwd|json] [passwd] [group] [shadow]
+ *
+ * Entries are read through nss_sqlite_dump(), so each database file is
+ * dumped as of a single point in time, and written to the standard
+ * output either in the format of passwd(5), group(5) and shadow(5) or
+ * as JSON objects, one per line, tagged with their kind. With THREADS
+ * greater than 1, lines do not come in key order. Passwd and group are
+ * dumped unless kinds are given. Databases are the module's, as set at
+ * build time or in the file NSS_SQLITE_CONFIG names.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "libnss-sqlite.h"
+
+#include <grp.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char* program = "nss-sqlite-dump";
+
+static int json = 0;
+
+static void usage(void) {
+    fprintf(stderr, "usage: %s [-j THREADS] [-o passwd|json] [passwd] [group] [shadow]\n", program);
+    exit(2);
+}
+
+/*
+ * Write a JSON string, quotes included.
+ */
+static void json_string(FILE* out, const char* s) {
+    putc_unlocked('"', out);
+    for( ; s != NULL && *s ; ++s) {
+        unsigned char c = *s;
+        if(c == '"' || c == '\\') {
+            putc_unlocked('\\', out);
+            putc_unlocked(c, out);
+        } else if(c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            putc_unlocked(c, out);
+        }
+    }
+    putc_unlocked('"', out);
+}
+
+/*
+ * Shadow numeric fields, -1 stands for an empty field.
+ */
+static void shadow_field(FILE* out, long v) {
+    if(json) {
+        if(v == -1) {
+            fputs("null", out);
+        } else {
+            fprintf(out, "%ld", v);
+        }
+    } else if(v != -1) {
+        fprintf(out, "%ld", v);
+    }
+}
+
+static void write_passwd(FILE* out, const struct passwd* pw) {
+    if(!json) {
+        fprintf(out, "%s:%s:%u:%u:%s:%s:%s\n", pw->pw_name, pw->pw_passwd,
+                (unsigned)pw->pw_uid, (unsigned)pw->pw_gid,
+                pw->pw_gecos, pw->pw_dir, pw->pw_shell);
+        return;
+    }
+    fputs("{\"type\":\"passwd\",\"name\":", out);
+    json_string(out, pw->pw_name);
+    fputs(",\"passwd\":", out);
+    json_string(out, pw->pw_passwd);
+    fprintf(out, ",\"uid\":%u,\"gid\":%u,\"gecos\":", (unsigned)pw->pw_uid, (unsigned)pw->pw_gid);
+    json_string(out, pw->pw_gecos);
+    fputs(",\"dir\":", out);
+    json_string(out, pw->pw_dir);
+    fputs(",\"shell\":", out);
+    json_string(out, pw->pw_shell);
+    fputs("}\n", out);
+}
+
+static void write_group(FILE* out, const struct group* gr) {
+    char** mem;
+
+    if(!json) {
+        fprintf(out, "%s:%s:%u:", gr->gr_name, gr->gr_passwd, (unsigned)gr->gr_gid);
+        for(mem = gr->gr_mem ; *mem ; ++mem) {
+            if(mem != gr->gr_mem) {
+                putc_unlocked(',', out);
+            }
+            fputs(*mem, out);
+        }
+        putc_unlocked('\n', out);
+        return;
+    }
+    fputs("{\"type\":\"group\",\"name\":", out);
+    json_string(out, gr->gr_name);
+    fputs(",\"passwd\":", out);
+    json_string(out, gr->gr_passwd);
+    fprintf(out, ",\"gid\":%u,\"members\":[", (unsigned)gr->gr_gid);
+    for(mem = gr->gr_mem ; *mem ; ++mem) {
+        if(mem != gr->gr_mem) {
+            putc_unlocked(',', out);
+        }
+        json_string(out, *mem);
+    }
+    fputs("]}\n", out);
+}
+
+static void write_shadow(FILE* out, const struct spwd* sp) {
+    if(json) {
+        fputs("{\"type\":\"shadow\",\"name\":", out);
+        json_string(out, sp->sp_namp);
+        fputs(",\"passwd\":", out);
+        json_string(out, sp->sp_pwdp);
+        fputs(",\"lastchange\":", out);
+    } else {
+        fprintf(out, "%s:%s:", sp->sp_namp, sp->sp_pwdp);
+    }
+    shadow_field(out, sp->sp_lstchg);
+    fputs(json ? ",\"min\":" : ":", out);
+    shadow_field(out, sp->sp_min);
+    fputs(json ? ",\"max\":" : ":", out);
+    shadow_field(out, sp->sp_max);
+    fputs(json ? ",\"warn\":" : ":", out);
+    shadow_field(out, sp->sp_warn);
+    fputs(json ? ",\"inact\":" : ":", out);
+    shadow_field(out, sp->sp_inact);
+    fputs(json ? ",\"expire\":" : ":", out);
+    shadow_field(out, sp->sp_expire);
+    fputs(json ? "}\n" : ":\n", out);
+}
+
+/*
+ * nss_sqlite_dump() callback, may run on several threads at once.
+ * Each entry is written while holding the stream's lock so lines do
+ * not interleave.
+ */
+static int write_entry(void* ctx, int kind, const void* entry) {
+    FILE* out = ctx;
+    int res;
+
+    flockfile(out);
+    switch(kind) {
+        case NSS_SQLITE_DUMP_PASSWD:
+            write_passwd(out, entry);
+            break;
+        case NSS_SQLITE_DUMP_GROUP:
+            write_group(out, entry);
+            break;
+        case NSS_SQLITE_DUMP_SHADOW:
+            write_shadow(out, entry);
+            break;
+    }
+    res = ferror(out) ? 1 : 0;
+    funlockfile(out);
+    return res;
+}
+
+int main(int argc, char** argv) {
+    int c, i, threads = 1, what = 0, res;
+
+    while((c = getopt(argc, argv, "j:o:")) != -1) {
+        switch(c) {
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'o':
+                if(strcmp(optarg, "json") == 0) {
+                    json = 1;
+                } else if(strcmp(optarg, "passwd") == 0) {
+                    json = 0;
+                } else {
+                    usage();
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    for(i = optind ; i < argc ; ++i) {
+        if(strcmp(argv[i], "passwd") == 0) {
+            what |= NSS_SQLITE_DUMP_PASSWD;
+        } else if(strcmp(argv[i], "group") == 0) {
+            what |= NSS_SQLITE_DUMP_GROUP;
+        } else if(strcmp(argv[i], "shadow") == 0) {
+            what |= NSS_SQLITE_DUMP_SHADOW;
+        } else {
+            usage();
+        }
+    }
+    if(what == 0) {
+        what = NSS_SQLITE_DUMP_PASSWD | NSS_SQLITE_DUMP_GROUP;
+    }
+    if(threads < 1) {
+        usage();
+    }
+
+    res = nss_sqlite_dump(what, threads, write_entry, stdout);
+    if(fflush(stdout) != 0 || res == 1) {
+        perror(program);
+        return 1;
+    }
+    if(res != 0) {
+        fprintf(stderr, "%s: cannot read database, see syslog\n", program);
+        return 1;
+    }
+    return 0;
+}
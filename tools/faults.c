@@ -0,0 +1,767 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * faults.c : nss-sqlite-faults, benchmark lookups on a failing database.
+ *
+ *  nss-sqlite-faults [-j THREADS] [-t SECONDS] [-m MODULE] [-c CONFIG]
+ *                    [-b RATE] [-e RATE] [-s RATE] [-r MS] [-B BUFLEN] [DB...]
+ *
+ * A SQLite VFS forwarding to the default one is registered as default
+ * before the module is loaded, so that the databases it opens go through
+ * it. On main database files, it fails a fraction RATE of shared lock
+ * requests with SQLITE_BUSY (-b), of reads with SQLITE_IOERR_READ (-e)
+ * and returns another fraction of reads short (-s). With -r, every DB
+ * is replaced by a copy of itself every MS milliseconds, the way a
+ * distribution tool would rename a new file over it.
+ *
+ * THREADS threads then call every entry point of the module in turn,
+ * with the users and groups it returned before faults were enabled,
+ * for SECONDS seconds. Buffers start at BUFLEN bytes and are doubled
+ * on ERANGE. Throughput, latency percentiles, failed calls and the
+ * time a thread took to get a successful answer again after a failure
+ * are reported per function.
+ *
+ * The module must use the same SQLite library as this program, which
+ * is not the case when built with --with-sqlite-amalgamation.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "capture.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <grp.h>
+#include <nss.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* program = "nss-sqlite-faults";
+
+typedef enum nss_status (*void_fn)(void);
+typedef enum nss_status (*pwent_fn)(struct passwd*, char*, size_t, int*);
+typedef enum nss_status (*pwnam_fn)(const char*, struct passwd*, char*, size_t, int*);
+typedef enum nss_status (*pwuid_fn)(uid_t, struct passwd*, char*, size_t, int*);
+typedef enum nss_status (*grent_fn)(struct group*, char*, size_t, int*);
+typedef enum nss_status (*grnam_fn)(const char*, struct group*, char*, size_t, int*);
+typedef enum nss_status (*grgid_fn)(gid_t, struct group*, char*, size_t, int*);
+typedef enum nss_status (*initgroups_fn)(const char*, gid_t, long*, long*, gid_t**, long, int*);
+typedef enum nss_status (*spent_fn)(struct spwd*, char*, size_t, int*);
+typedef enum nss_status (*spnam_fn)(const char*, struct spwd*, char*, size_t, int*);
+
+/* Entry points, indexed by enum nss_capture_func */
+static const char* const func_names[NSS_CAP_MAX] = {
+    NULL, "setpwent", "endpwent", "getpwent_r", "getpwnam_r", "getpwuid_r",
+    "setgrent", "endgrent", "getgrent_r", "getgrnam_r", "getgrgid_r",
+    "initgroups_dyn", "setspent", "endspent", "getspent_r", "getspnam_r"
+};
+static void* funcs[NSS_CAP_MAX];
+
+/* Functions benchmarked, in the order workers call them */
+static const int exercised[] = {
+    NSS_CAP_GETPWNAM, NSS_CAP_GETPWUID, NSS_CAP_GETGRNAM, NSS_CAP_GETGRGID,
+    NSS_CAP_INITGROUPS, NSS_CAP_GETSPNAM, NSS_CAP_GETPWENT, NSS_CAP_GETGRENT,
+    NSS_CAP_GETSPENT
+};
+#define NEXERCISED (sizeof(exercised) / sizeof(exercised[0]))
+
+/* Largest buffer tried before a call is counted as failed */
+#define MAX_BUFLEN (1 << 20)
+/* Keys of each kind read before the benchmark */
+#define MAX_KEYS 10000
+
+struct key {
+    char* name;
+    unsigned int id;
+};
+
+static struct key users[MAX_KEYS], groups[MAX_KEYS], shadows[MAX_KEYS];
+static size_t nusers = 0, ngroups = 0, nshadows = 0;
+
+static int nthreads = 1;
+static size_t initial_buflen = 256;
+static volatile int stop = 0;
+
+/*
+ * Fault injection
+ */
+
+static double busy_rate = 0, ioerr_rate = 0, short_rate = 0;
+static volatile int faults_on = 0;
+static unsigned long n_opens = 0, n_busy = 0, n_ioerr = 0, n_short = 0, n_replaced = 0;
+
+struct fault_file {
+    sqlite3_file base;
+    sqlite3_file* real;     /* follows this structure */
+    int main_db;
+};
+
+static sqlite3_vfs* real_vfs;
+static sqlite3_vfs fault_vfs;
+static __thread uint64_t rnd_state = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * xorshift64, seeded per thread.
+ */
+static uint64_t rnd(void) {
+    if(rnd_state == 0) {
+        rnd_state = now_ns() ^ ((uint64_t)(uintptr_t)&rnd_state << 16) ^ 0x9e3779b97f4a7c15ULL;
+    }
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return rnd_state;
+}
+
+/*
+ * Tell whether a fault of given rate hits a main database file.
+ */
+static int fault_hit(struct fault_file* f, double rate) {
+    return faults_on && f->main_db && rate > 0 && (rnd() >> 11) * (1.0 / (1ULL << 53)) < rate;
+}
+
+#define REAL(file) (((struct fault_file*)(file))->real)
+
+static int fault_close(sqlite3_file* file) {
+    return REAL(file)->pMethods->xClose(REAL(file));
+}
+
+static int fault_read(sqlite3_file* file, void* buf, int amt, sqlite3_int64 off) {
+    struct fault_file* f = (struct fault_file*)file;
+    int res;
+
+    if(fault_hit(f, ioerr_rate)) {
+        __sync_fetch_and_add(&n_ioerr, 1);
+        return SQLITE_IOERR_READ;
+    }
+    res = f->real->pMethods->xRead(f->real, buf, amt, off);
+    if(res == SQLITE_OK && fault_hit(f, short_rate)) {
+        /* SQLite expects the missing part of a short read zeroed */
+        __sync_fetch_and_add(&n_short, 1);
+        memset((char*)buf + amt / 2, 0, amt - amt / 2);
+        return SQLITE_IOERR_SHORT_READ;
+    }
+    return res;
+}
+
+static int fault_write(sqlite3_file* file, const void* buf, int amt, sqlite3_int64 off) {
+    return REAL(file)->pMethods->xWrite(REAL(file), buf, amt, off);
+}
+
+static int fault_truncate(sqlite3_file* file, sqlite3_int64 size) {
+    return REAL(file)->pMethods->xTruncate(REAL(file), size);
+}
+
+static int fault_sync(sqlite3_file* file, int flags) {
+    return REAL(file)->pMethods->xSync(REAL(file), flags);
+}
+
+static int fault_file_size(sqlite3_file* file, sqlite3_int64* size) {
+    return REAL(file)->pMethods->xFileSize(REAL(file), size);
+}
+
+static int fault_lock(sqlite3_file* file, int lock) {
+    if(lock == SQLITE_LOCK_SHARED && fault_hit((struct fault_file*)file, busy_rate)) {
+        __sync_fetch_and_add(&n_busy, 1);
+        return SQLITE_BUSY;
+    }
+    return REAL(file)->pMethods->xLock(REAL(file), lock);
+}
+
+static int fault_unlock(sqlite3_file* file, int lock) {
+    return REAL(file)->pMethods->xUnlock(REAL(file), lock);
+}
+
+static int fault_check_reserved_lock(sqlite3_file* file, int* out) {
+    return REAL(file)->pMethods->xCheckReservedLock(REAL(file), out);
+}
+
+static int fault_file_control(sqlite3_file* file, int op, void* arg) {
+    return REAL(file)->pMethods->xFileControl(REAL(file), op, arg);
+}
+
+static int fault_sector_size(sqlite3_file* file) {
+    return REAL(file)->pMethods->xSectorSize(REAL(file));
+}
+
+static int fault_device_characteristics(sqlite3_file* file) {
+    return REAL(file)->pMethods->xDeviceCharacteristics(REAL(file));
+}
+
+static int fault_shm_map(sqlite3_file* file, int page, int size, int extend, void volatile** p) {
+    return REAL(file)->pMethods->xShmMap(REAL(file), page, size, extend, p);
+}
+
+static int fault_shm_lock(sqlite3_file* file, int offset, int n, int flags) {
+    return REAL(file)->pMethods->xShmLock(REAL(file), offset, n, flags);
+}
+
+static void fault_shm_barrier(sqlite3_file* file) {
+    REAL(file)->pMethods->xShmBarrier(REAL(file));
+}
+
+static int fault_shm_unmap(sqlite3_file* file, int delete) {
+    return REAL(file)->pMethods->xShmUnmap(REAL(file), delete);
+}
+
+static int fault_fetch(sqlite3_file* file, sqlite3_int64 off, int amt, void** pp) {
+    if(faults_on && ((struct fault_file*)file)->main_db && (ioerr_rate > 0 || short_rate > 0)) {
+        /* Send every page through xRead so that read faults apply */
+        *pp = NULL;
+        return SQLITE_OK;
+    }
+    return REAL(file)->pMethods->xFetch(REAL(file), off, amt, pp);
+}
+
+static int fault_unfetch(sqlite3_file* file, sqlite3_int64 off, void* p) {
+    return REAL(file)->pMethods->xUnfetch(REAL(file), off, p);
+}
+
+static const sqlite3_io_methods fault_methods = {
+    3,
+    fault_close, fault_read, fault_write, fault_truncate, fault_sync, fault_file_size,
+    fault_lock, fault_unlock, fault_check_reserved_lock, fault_file_control,
+    fault_sector_size, fault_device_characteristics,
+    fault_shm_map, fault_shm_lock, fault_shm_barrier, fault_shm_unmap,
+    fault_fetch, fault_unfetch
+};
+
+static int fault_open(sqlite3_vfs* vfs, const char* name, sqlite3_file* file, int flags, int* out) {
+    struct fault_file* f = (struct fault_file*)file;
+    int res;
+
+    (void)vfs;
+    f->real = (sqlite3_file*)(f + 1);
+    f->main_db = (flags & SQLITE_OPEN_MAIN_DB) != 0;
+    res = real_vfs->xOpen(real_vfs, name, f->real, flags, out);
+    /* SQLite only closes files with methods, keep in line with the real one */
+    f->base.pMethods = f->real->pMethods ? &fault_methods : NULL;
+    if(res == SQLITE_OK && f->main_db) {
+        __sync_fetch_and_add(&n_opens, 1);
+    }
+    return res;
+}
+
+/*
+ * Register the fault injecting VFS as default, on top of current one.
+ */
+static int fault_vfs_register(void) {
+    if(sqlite3_initialize() != SQLITE_OK || !(real_vfs = sqlite3_vfs_find(NULL))) {
+        return -1;
+    }
+    if(real_vfs->iVersion < 3) {
+        fprintf(stderr, "%s: default VFS is too old\n", program);
+        return -1;
+    }
+    fault_vfs = *real_vfs;
+    fault_vfs.zName = "nss-sqlite-faults";
+    fault_vfs.szOsFile = sizeof(struct fault_file) + real_vfs->szOsFile;
+    fault_vfs.xOpen = fault_open;
+    fault_vfs.pNext = NULL;
+    return sqlite3_vfs_register(&fault_vfs, 1) == SQLITE_OK ? 0 : -1;
+}
+
+/*
+ * File replacement
+ */
+
+struct replaced {
+    const char* path;
+    char* data;
+    size_t size;
+};
+
+static struct replaced* replaced_files = NULL;
+static int nreplaced_files = 0;
+static int replace_ms = 0;
+
+static int load_file(struct replaced* r) {
+    FILE* f;
+    long size;
+
+    if(!(f = fopen(r->path, "r"))) {
+        fprintf(stderr, "%s: %s: %s\n", program, r->path, strerror(errno));
+        return -1;
+    }
+    if(fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0
+       || !(r->data = malloc(size ? size : 1)) || fread(r->data, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "%s: %s: unable to read\n", program, r->path);
+        fclose(f);
+        return -1;
+    }
+    r->size = size;
+    fclose(f);
+    return 0;
+}
+
+/*
+ * Write a copy of a database next to it and rename it over the original.
+ */
+static void replace_file(const struct replaced* r) {
+    char tmp[4096];
+    FILE* f;
+
+    snprintf(tmp, sizeof(tmp), "%s.faults", r->path);
+    if(!(f = fopen(tmp, "w"))) {
+        return;
+    }
+    if(fwrite(r->data, 1, r->size, f) != r->size) {
+        fclose(f);
+        unlink(tmp);
+        return;
+    }
+    fclose(f);
+    if(rename(tmp, r->path) == 0) {
+        __sync_fetch_and_add(&n_replaced, 1);
+    } else {
+        unlink(tmp);
+    }
+}
+
+static void* replacer_run(void* arg) {
+    struct timespec delay;
+    int i;
+
+    (void)arg;
+    delay.tv_sec = replace_ms / 1000;
+    delay.tv_nsec = (replace_ms % 1000) * 1000000L;
+    while(!stop) {
+        nanosleep(&delay, NULL);
+        for(i = 0 ; i < nreplaced_files && !stop ; ++i) {
+            replace_file(&replaced_files[i]);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Benchmark
+ */
+
+struct samples {
+    uint32_t* v;
+    size_t n, size;
+};
+
+struct func_stats {
+    struct samples latency;     /* ns */
+    struct samples recovery;    /* us */
+    unsigned long failed;       /* unavailable, or no answer for a known key */
+    uint64_t failed_since;      /* first failure not followed by a success */
+};
+
+struct worker {
+    pthread_t thread;
+    struct func_stats stats[NSS_CAP_MAX];
+    unsigned long calls;
+};
+
+static void usage(void) {
+    fprintf(stderr, "Usage: %s [-j THREADS] [-t SECONDS] [-m MODULE] [-c CONFIG]\n"
+            "       [-b RATE] [-e RATE] [-s RATE] [-r MS] [-B BUFLEN] [DB...]\n", program);
+    exit(2);
+}
+
+static void add_sample(struct samples* s, uint64_t v) {
+    if(s->n == s->size) {
+        size_t size = s->size ? s->size * 2 : 1024;
+        uint32_t* p = realloc(s->v, size * sizeof(*p));
+        if(p == NULL) {
+            return;
+        }
+        s->v = p;
+        s->size = size;
+    }
+    s->v[s->n++] = v > UINT32_MAX ? UINT32_MAX : v;
+}
+
+static void add_key(struct key* keys, size_t* n, const char* name, unsigned int id) {
+    if(*n < MAX_KEYS && (keys[*n].name = strdup(name)) != NULL) {
+        keys[*n].id = id;
+        (*n)++;
+    }
+}
+
+/*
+ * Read users, groups and shadow entries through the module.
+ */
+static void load_keys(void) {
+    static char buf[MAX_BUFLEN];
+    struct passwd pw;
+    struct group gr;
+    struct spwd sp;
+    int err;
+
+    ((void_fn)funcs[NSS_CAP_SETPWENT])();
+    while(((pwent_fn)funcs[NSS_CAP_GETPWENT])(&pw, buf, sizeof(buf), &err) == NSS_STATUS_SUCCESS) {
+        add_key(users, &nusers, pw.pw_name, pw.pw_uid);
+    }
+    ((void_fn)funcs[NSS_CAP_ENDPWENT])();
+    ((void_fn)funcs[NSS_CAP_SETGRENT])();
+    while(((grent_fn)funcs[NSS_CAP_GETGRENT])(&gr, buf, sizeof(buf), &err) == NSS_STATUS_SUCCESS) {
+        add_key(groups, &ngroups, gr.gr_name, gr.gr_gid);
+    }
+    ((void_fn)funcs[NSS_CAP_ENDGRENT])();
+    ((void_fn)funcs[NSS_CAP_SETSPENT])();
+    while(((spent_fn)funcs[NSS_CAP_GETSPENT])(&sp, buf, sizeof(buf), &err) == NSS_STATUS_SUCCESS) {
+        add_key(shadows, &nshadows, sp.sp_namp, 0);
+    }
+    ((void_fn)funcs[NSS_CAP_ENDSPENT])();
+}
+
+/*
+ * Issue one call with a buffer of buflen bytes.
+ */
+static int call(int func, char* buf, size_t buflen, int* err) {
+    union {
+        struct passwd pw;
+        struct group gr;
+        struct spwd sp;
+    } result;
+    void* fn = funcs[func];
+    const struct key* k;
+
+    switch(func) {
+        case NSS_CAP_GETPWENT:
+            return ((pwent_fn)fn)(&result.pw, buf, buflen, err);
+        case NSS_CAP_GETPWNAM:
+            k = &users[rnd() % nusers];
+            return ((pwnam_fn)fn)(k->name, &result.pw, buf, buflen, err);
+        case NSS_CAP_GETPWUID:
+            k = &users[rnd() % nusers];
+            return ((pwuid_fn)fn)(k->id, &result.pw, buf, buflen, err);
+        case NSS_CAP_GETGRENT:
+            return ((grent_fn)fn)(&result.gr, buf, buflen, err);
+        case NSS_CAP_GETGRNAM:
+            k = &groups[rnd() % ngroups];
+            return ((grnam_fn)fn)(k->name, &result.gr, buf, buflen, err);
+        case NSS_CAP_GETGRGID:
+            k = &groups[rnd() % ngroups];
+            return ((grgid_fn)fn)(k->id, &result.gr, buf, buflen, err);
+        case NSS_CAP_GETSPENT:
+            return ((spent_fn)fn)(&result.sp, buf, buflen, err);
+        case NSS_CAP_GETSPNAM:
+            k = &shadows[rnd() % nshadows];
+            return ((spnam_fn)fn)(k->name, &result.sp, buf, buflen, err);
+        case NSS_CAP_INITGROUPS: {
+            long start = 0, size = 16;
+            gid_t* gids = malloc(size * sizeof(*gids));
+            int res;
+            if(gids == NULL) {
+                *err = ENOMEM;
+                return NSS_STATUS_TRYAGAIN;
+            }
+            k = &users[rnd() % nusers];
+            res = ((initgroups_fn)fn)(k->name, (gid_t)-1, &start, &size, &gids, 0, err);
+            free(gids);
+            return res;
+        }
+    }
+    return NSS_STATUS_UNAVAIL;
+}
+
+/*
+ * Tell whether a function can be benchmarked with the keys read.
+ */
+static int usable(int func) {
+    switch(func) {
+        case NSS_CAP_GETPWNAM: case NSS_CAP_GETPWUID: case NSS_CAP_INITGROUPS:
+            return nusers > 0;
+        case NSS_CAP_GETGRNAM: case NSS_CAP_GETGRGID:
+            return ngroups > 0;
+        case NSS_CAP_GETSPNAM:
+            return nshadows > 0;
+    }
+    return 1;
+}
+
+static void* worker_run(void* arg) {
+    struct worker* w = arg;
+    char* buf = malloc(MAX_BUFLEN);
+    size_t i;
+
+    if(buf == NULL) {
+        return NULL;
+    }
+    for(i = 0 ; !stop ; ++i) {
+        int func = exercised[i % NEXERCISED];
+        struct func_stats* st = &w->stats[func];
+        size_t buflen = initial_buflen;
+        uint64_t t;
+        int res, err = 0, ok;
+
+        if(!usable(func)) {
+            continue;
+        }
+        t = now_ns();
+        while((res = call(func, buf, buflen, &err)) == NSS_STATUS_TRYAGAIN && err == ERANGE
+              && buflen < MAX_BUFLEN) {
+            buflen *= 2;
+        }
+        add_sample(&st->latency, now_ns() - t);
+        w->calls++;
+
+        if(res == NSS_STATUS_NOTFOUND && (func == NSS_CAP_GETPWENT || func == NSS_CAP_GETGRENT
+                                          || func == NSS_CAP_GETSPENT)) {
+            /* End of enumeration, start it over */
+            ((void_fn)funcs[func == NSS_CAP_GETPWENT ? NSS_CAP_SETPWENT
+                            : func == NSS_CAP_GETGRENT ? NSS_CAP_SETGRENT : NSS_CAP_SETSPENT])();
+            ok = 1;
+        } else {
+            /* Keys are known to exist, anything but an answer is wrong */
+            ok = res == NSS_STATUS_SUCCESS
+                 || (res == NSS_STATUS_NOTFOUND && func == NSS_CAP_INITGROUPS);
+        }
+
+        if(!ok) {
+            st->failed++;
+            if(st->failed_since == 0) {
+                st->failed_since = t;
+            }
+        } else if(st->failed_since != 0) {
+            add_sample(&st->recovery, (now_ns() - st->failed_since) / 1000);
+            st->failed_since = 0;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int by_value(const void* a, const void* b) {
+    uint32_t va = *(const uint32_t*)a, vb = *(const uint32_t*)b;
+    return va < vb ? -1 : va > vb;
+}
+
+/*
+ * Merge samples of every worker for a function.
+ */
+static size_t merge(struct worker* workers, int func, int recovery, uint32_t** out) {
+    size_t n = 0;
+    int i;
+
+    for(i = 0 ; i < nthreads ; ++i) {
+        struct func_stats* st = &workers[i].stats[func];
+        n += recovery ? st->recovery.n : st->latency.n;
+    }
+    if(n == 0 || !(*out = malloc(n * sizeof(**out)))) {
+        return 0;
+    }
+    n = 0;
+    for(i = 0 ; i < nthreads ; ++i) {
+        struct samples* s = recovery ? &workers[i].stats[func].recovery
+                                     : &workers[i].stats[func].latency;
+        memcpy(*out + n, s->v, s->n * sizeof(**out));
+        n += s->n;
+    }
+    qsort(*out, n, sizeof(**out), by_value);
+    return n;
+}
+
+static void report(struct worker* workers, double elapsed) {
+    unsigned long calls = 0;
+    size_t f;
+    int i;
+
+    for(i = 0 ; i < nthreads ; ++i) {
+        calls += workers[i].calls;
+    }
+    printf("%lu calls, %d threads, %.3f s, %.0f calls/s\n", calls, nthreads, elapsed,
+           calls / elapsed);
+    printf("faults: %lu opens, %lu busy, %lu ioerr, %lu short reads, %lu replacements\n",
+           n_opens, n_busy, n_ioerr, n_short, n_replaced);
+    printf("%-15s %8s %8s %9s %9s %9s %9s %7s %8s %9s %9s\n", "function", "calls", "calls/s",
+           "p50_us", "p99_us", "p999_us", "max_us", "failed", "recover", "rec_p50", "rec_max");
+
+    for(f = 0 ; f < NEXERCISED ; ++f) {
+        int func = exercised[f];
+        unsigned long failed = 0;
+        uint32_t *v = NULL, *r = NULL;
+        size_t n, nr;
+
+        if(!(n = merge(workers, func, 0, &v))) {
+            continue;
+        }
+        for(i = 0 ; i < nthreads ; ++i) {
+            failed += workers[i].stats[func].failed;
+        }
+        printf("%-15s %8zu %8.0f %9.1f %9.1f %9.1f %9.1f %7lu", func_names[func], n, n / elapsed,
+               v[n / 2] / 1000.0, v[n * 99 / 100] / 1000.0, v[n * 999 / 1000] / 1000.0,
+               v[n - 1] / 1000.0, failed);
+        /* Recovery times are in us, printed in ms */
+        if((nr = merge(workers, func, 1, &r)) > 0) {
+            printf(" %8zu %9.2f %9.2f\n", nr, r[nr / 2] / 1000.0, r[nr - 1] / 1000.0);
+        } else {
+            printf(" %8d %9s %9s\n", 0, "-", "-");
+        }
+        free(v);
+        free(r);
+    }
+}
+
+/*
+ * Parse a fault rate, between 0 and 1.
+ */
+static double rate(const char* arg) {
+    char* end;
+    double r = strtod(arg, &end);
+    if(*end != '\0' || r < 0 || r > 1) {
+        usage();
+    }
+    return r;
+}
+
+int main(int argc, char** argv) {
+    const char* module = "libnss_sqlite.so.2";
+    struct worker* workers;
+    struct timespec start, end, duration = { 10, 0 };
+    pthread_t replacer;
+    void* handle;
+    int c, i;
+
+    while((c = getopt(argc, argv, "j:t:m:c:b:e:s:r:B:")) != -1) {
+        switch(c) {
+            case 'j':
+                if((nthreads = atoi(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            case 't':
+                if((duration.tv_sec = atoi(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            case 'm':
+                module = optarg;
+                break;
+            case 'c':
+                setenv("NSS_SQLITE_CONFIG", optarg, 1);
+                break;
+            case 'b':
+                busy_rate = rate(optarg);
+                break;
+            case 'e':
+                ioerr_rate = rate(optarg);
+                break;
+            case 's':
+                short_rate = rate(optarg);
+                break;
+            case 'r':
+                if((replace_ms = atoi(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            case 'B':
+                if((initial_buflen = atoi(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    if(replace_ms > 0 && optind == argc) {
+        fprintf(stderr, "%s: -r needs the databases to replace\n", program);
+        usage();
+    }
+
+    /* Files are read before anything opens them */
+    nreplaced_files = argc - optind;
+    if(nreplaced_files > 0 && !(replaced_files = calloc(nreplaced_files, sizeof(*replaced_files)))) {
+        fprintf(stderr, "%s: out of memory\n", program);
+        return 1;
+    }
+    for(i = 0 ; i < nreplaced_files ; ++i) {
+        replaced_files[i].path = argv[optind + i];
+        if(load_file(&replaced_files[i]) != 0) {
+            return 1;
+        }
+    }
+
+    if(fault_vfs_register() != 0) {
+        fprintf(stderr, "%s: unable to register VFS\n", program);
+        return 1;
+    }
+    if(!(handle = dlopen(module, RTLD_NOW))) {
+        fprintf(stderr, "%s: %s\n", program, dlerror());
+        return 1;
+    }
+    for(i = 1 ; i < NSS_CAP_MAX ; ++i) {
+        char symbol[64];
+        snprintf(symbol, sizeof(symbol), "_nss_sqlite_%s", func_names[i]);
+        if(!(funcs[i] = dlsym(handle, symbol))) {
+            fprintf(stderr, "%s: %s: missing %s\n", program, module, symbol);
+            return 1;
+        }
+    }
+
+    load_keys();
+    if(nusers == 0 && ngroups == 0) {
+        fprintf(stderr, "%s: no user nor group found\n", program);
+        return 1;
+    }
+    if(n_opens == 0) {
+        fprintf(stderr, "%s: %s does not use this program's SQLite, no fault injected\n",
+                program, module);
+    }
+
+    if(!(workers = calloc(nthreads, sizeof(*workers)))) {
+        fprintf(stderr, "%s: out of memory\n", program);
+        return 1;
+    }
+    faults_on = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0 ; i < nthreads ; ++i) {
+        if(pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            fprintf(stderr, "%s: unable to start thread\n", program);
+            return 1;
+        }
+    }
+    if(replace_ms > 0 && pthread_create(&replacer, NULL, replacer_run, NULL) != 0) {
+        fprintf(stderr, "%s: unable to start thread\n", program);
+        return 1;
+    }
+    while(nanosleep(&duration, &duration) != 0 && errno == EINTR);
+    stop = 1;
+    for(i = 0 ; i < nthreads ; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if(replace_ms > 0) {
+        pthread_join(replacer, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    faults_on = 0;
+
+    report(workers, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return 0;
+}
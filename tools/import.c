@@ -0,0 +1,755 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * import.c : nss-sqlite-import, bulk load of passwd, group and shadow
+ * files.
+ *
+ *  nss-sqlite-import [-j THREADS] [-p PASSWD] [-g GROUP] [-s SHADOW] DB [SHADOW_DB]
+ *
+ * Files are in the format of passwd(5), group(5) and shadow(5), "-"
+ * reads the standard input. They are parsed by THREADS threads (one per
+ * CPU by default), each taking a slice of every file, and rows are
+ * inserted in key order so that tables are filled by appending. DB and
+ * SHADOW_DB must have the schema of conf/passwd.sql and conf/shadow.sql;
+ * entries replace those with the same key. Each database is loaded in
+ * a single transaction, during which the indexes and triggers of the
+ * loaded tables are dropped and built again once the rows are in:
+ * readers never see a database without them. Memberships of group
+ * files go to user_group for the users known once passwd is loaded, and
+ * user_group_closure and group_members are rebuilt, nested groups of
+ * the database included; packed columns of the loaded rows are filled
+ * by their triggers once restored. Statistics are then gathered with
+ * ANALYZE and the file rewritten with VACUUM, leaving pages in key
+ * order.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Most fields of a line, shadow(5) has 9 */
+#define MAX_FIELDS 9
+#define MAX_THREADS 64
+
+static const char* program = "nss-sqlite-import";
+
+enum kind { KIND_PASSWD, KIND_GROUP, KIND_SHADOW, KINDS };
+
+/* Fields of each kind, and the numeric one used as key (-1 for name) */
+static const int kind_fields[KINDS] = { 7, 4, 9 };
+static const int kind_key[KINDS] = { 2, 2, -1 };
+static const char* kind_name[KINDS] = { "passwd", "group", "shadow" };
+
+struct rec {
+    long long key;
+    char* f[MAX_FIELDS];        /* into the file's buffer, NUL terminated */
+};
+
+struct recs {
+    struct rec* v;
+    size_t n;
+    size_t alloc;
+};
+
+struct source {
+    enum kind kind;
+    const char* path;
+    char* data;
+    size_t size;
+    struct recs recs;
+};
+
+struct chunk {
+    struct source* src;
+    char* start;
+    char* end;
+    struct recs recs;
+    long bad;
+};
+
+/* Schema objects dropped for the load */
+struct saved {
+    char type[8];
+    char* table;
+    char* sql;
+};
+
+static void usage(void) {
+    fprintf(stderr, "usage: %s [-j THREADS] [-p PASSWD] [-g GROUP] [-s SHADOW] DB [SHADOW_DB]\n", program);
+    exit(2);
+}
+
+static int exec_sql(sqlite3* pDb, const char* sql) {
+    char* err = NULL;
+    if(sqlite3_exec(pDb, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", program, err);
+        sqlite3_free(err);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read a whole file, or the standard input for "-".
+ */
+static char* read_all(const char* path, size_t* size) {
+    FILE* f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    size_t alloc = 1 << 20, l = 0, r;
+    char* data = NULL;
+
+    if(f == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", program, path, strerror(errno));
+        return NULL;
+    }
+    for(;;) {
+        if(data == NULL || l == alloc) {
+            char* grown;
+            if(data != NULL) {
+                alloc *= 2;
+            }
+            if((grown = realloc(data, alloc + 1)) == NULL) {
+                fprintf(stderr, "%s: %s: out of memory\n", program, path);
+                free(data);
+                data = NULL;
+                break;
+            }
+            data = grown;
+        }
+        if((r = fread(data + l, 1, alloc - l, f)) == 0) {
+            if(ferror(f)) {
+                fprintf(stderr, "%s: %s: %s\n", program, path, strerror(errno));
+                free(data);
+                data = NULL;
+            }
+            break;
+        }
+        l += r;
+    }
+    if(data != NULL) {
+        data[l] = '\0';
+        *size = l;
+    }
+    if(f != stdin) {
+        fclose(f);
+    }
+    return data;
+}
+
+static int parse_number(const char* s, long long* n) {
+    char* end;
+
+    errno = 0;
+    *n = strtoll(s, &end, 10);
+    return *s != '\0' && *end == '\0' && errno == 0;
+}
+
+/*
+ * Split a line into fields in place and check it.
+ */
+static int parse_line(enum kind kind, char* line, struct rec* rec) {
+    int i, n = 0;
+    long long v;
+    char* p = line;
+
+    rec->f[n++] = p;
+    for(; *p ; ++p) {
+        if(*p == ':') {
+            if(n == kind_fields[kind]) {
+                return 0;
+            }
+            *p = '\0';
+            rec->f[n++] = p + 1;
+        }
+    }
+    /* Trailing reserved field of shadow(5) may be left out */
+    if(kind == KIND_SHADOW && n == kind_fields[kind] - 1) {
+        rec->f[n++] = p;
+    }
+    if(n != kind_fields[kind] || *rec->f[0] == '\0') {
+        return 0;
+    }
+
+    switch(kind) {
+        case KIND_PASSWD:
+            return parse_number(rec->f[2], &rec->key) && parse_number(rec->f[3], &v);
+        case KIND_GROUP:
+            return parse_number(rec->f[2], &rec->key);
+        case KIND_SHADOW:
+            for(i = 2 ; i < 8 ; ++i) {
+                if(*rec->f[i] != '\0' && !parse_number(rec->f[i], &v)) {
+                    return 0;
+                }
+            }
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int recs_add(struct recs* recs, const struct rec* rec) {
+    if(recs->n == recs->alloc) {
+        size_t alloc = recs->alloc ? recs->alloc * 2 : 1024;
+        struct rec* v = realloc(recs->v, alloc * sizeof(*v));
+        if(v == NULL) {
+            return -1;
+        }
+        recs->v = v;
+        recs->alloc = alloc;
+    }
+    recs->v[recs->n++] = *rec;
+    return 0;
+}
+
+static void* parse_chunk(void* arg) {
+    struct chunk* chunk = arg;
+    char* line = chunk->start;
+
+    while(line < chunk->end) {
+        char* eol = memchr(line, '\n', chunk->end - line);
+        struct rec rec;
+
+        if(eol == NULL) {
+            eol = chunk->end;
+        }
+        *eol = '\0';
+        if(eol > line && eol[-1] == '\r') {
+            eol[-1] = '\0';
+        }
+        /* Comments, blank lines and NIS compat entries */
+        if(*line != '\0' && *line != '#' && *line != '+' && *line != '-') {
+            if(!parse_line(chunk->src->kind, line, &rec)) {
+                fprintf(stderr, "%s: %s: malformed entry for %s\n", program, chunk->src->path, line);
+                chunk->bad++;
+            } else if(recs_add(&chunk->recs, &rec) < 0) {
+                fprintf(stderr, "%s: out of memory\n", program);
+                chunk->bad++;
+                break;
+            }
+        }
+        line = eol + 1;
+    }
+    return NULL;
+}
+
+static int cmp_key(const void* a, const void* b) {
+    long long x = ((const struct rec*)a)->key, y = ((const struct rec*)b)->key;
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_name(const void* a, const void* b) {
+    return strcmp(((const struct rec*)a)->f[0], ((const struct rec*)b)->f[0]);
+}
+
+static void* sort_source(void* arg) {
+    struct source* src = arg;
+    qsort(src->recs.v, src->recs.n, sizeof(*src->recs.v), kind_key[src->kind] < 0 ? cmp_name : cmp_key);
+    return NULL;
+}
+
+/*
+ * Read and parse every source, slices of all files being parsed at
+ * once, then sort each in key order.
+ * @return Number of malformed entries, -1 on errors.
+ */
+static long parse_sources(struct source* srcs, int nsrcs, int threads) {
+    struct chunk chunks[KINDS * MAX_THREADS];
+    pthread_t tids[KINDS * MAX_THREADS];
+    int started[KINDS * MAX_THREADS];
+    int i, j, n = 0;
+    long bad = 0;
+
+    for(i = 0 ; i < nsrcs ; ++i) {
+        struct source* src = &srcs[i];
+        char* p;
+
+        if((src->data = read_all(src->path, &src->size)) == NULL) {
+            return -1;
+        }
+        p = src->data;
+        for(j = 0 ; j < threads ; ++j) {
+            char* end = j == threads - 1 ? src->data + src->size : src->data + src->size * (j + 1) / threads;
+            /* Slices end on line boundaries */
+            if(end < p) {
+                end = p;
+            }
+            while(end < src->data + src->size && end > p && end[-1] != '\n') {
+                end++;
+            }
+            memset(&chunks[n], 0, sizeof(chunks[n]));
+            chunks[n].src = src;
+            chunks[n].start = p;
+            chunks[n].end = end;
+            n++;
+            p = end;
+        }
+    }
+
+    for(i = 0 ; i < n ; ++i) {
+        if(!(started[i] = pthread_create(&tids[i], NULL, parse_chunk, &chunks[i]) == 0)) {
+            parse_chunk(&chunks[i]);
+        }
+    }
+    for(i = 0 ; i < n ; ++i) {
+        struct recs* all = &chunks[i].src->recs;
+        if(started[i]) {
+            pthread_join(tids[i], NULL);
+        }
+        bad += chunks[i].bad;
+        for(j = 0 ; (size_t)j < chunks[i].recs.n ; ++j) {
+            if(recs_add(all, &chunks[i].recs.v[j]) < 0) {
+                fprintf(stderr, "%s: out of memory\n", program);
+                return -1;
+            }
+        }
+        free(chunks[i].recs.v);
+    }
+
+    for(i = 0 ; i < nsrcs ; ++i) {
+        if(!(started[i] = pthread_create(&tids[i], NULL, sort_source, &srcs[i]) == 0)) {
+            sort_source(&srcs[i]);
+        }
+    }
+    for(i = 0 ; i < nsrcs ; ++i) {
+        if(started[i]) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+    return bad;
+}
+
+/*
+ * Drop indexes and triggers of the tables about to be loaded,
+ * remembering them in saved. Automatic indexes of constraints stay.
+ * @return Number of objects dropped, -1 on errors.
+ */
+static int drop_schema(sqlite3* pDb, const char* tables, struct saved** saved) {
+    sqlite3_stmt* pSt;
+    char* sql = sqlite3_mprintf("SELECT type, name, tbl_name, sql FROM sqlite_master "
+                                "WHERE type IN ('index', 'trigger') AND sql IS NOT NULL "
+                                "AND tbl_name IN (%s)", tables);
+    char** names = NULL;
+    int i, n = 0, res;
+
+    *saved = NULL;
+    res = sqlite3_prepare_v2(pDb, sql, -1, &pSt, NULL);
+    sqlite3_free(sql);
+    if(res != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", program, sqlite3_errmsg(pDb));
+        return -1;
+    }
+    while(sqlite3_step(pSt) == SQLITE_ROW) {
+        struct saved* s = realloc(*saved, (n + 1) * sizeof(**saved));
+        char** nm = realloc(names, (n + 1) * sizeof(*names));
+        if(s != NULL) {
+            *saved = s;
+        }
+        if(nm != NULL) {
+            names = nm;
+        }
+        if(s == NULL || nm == NULL) {
+            break;
+        }
+        snprintf(s[n].type, sizeof(s[n].type), "%s", sqlite3_column_text(pSt, 0));
+        names[n] = strdup((const char*)sqlite3_column_text(pSt, 1));
+        s[n].table = strdup((const char*)sqlite3_column_text(pSt, 2));
+        s[n].sql = strdup((const char*)sqlite3_column_text(pSt, 3));
+        n++;
+    }
+    sqlite3_finalize(pSt);
+
+    /* sqlite_master cannot change under the walk above */
+    for(i = 0, res = 0 ; i < n ; ++i) {
+        if(res == 0) {
+            sql = sqlite3_mprintf("DROP %s \"%w\"", (*saved)[i].type, names[i]);
+            res = exec_sql(pDb, sql);
+            sqlite3_free(sql);
+        }
+        free(names[i]);
+    }
+    free(names);
+    return res < 0 ? -1 : n;
+}
+
+/*
+ * Create again what drop_schema() dropped, of the given type and
+ * table, or of any table if table is NULL.
+ */
+static int restore_schema(sqlite3* pDb, struct saved* saved, int n, const char* type, const char* table) {
+    int i;
+
+    for(i = 0 ; i < n ; ++i) {
+        if(saved[i].sql == NULL || strcmp(saved[i].type, type) != 0 ||
+           (table != NULL && strcmp(saved[i].table, table) != 0)) {
+            continue;
+        }
+        if(exec_sql(pDb, saved[i].sql) < 0) {
+            return -1;
+        }
+        free(saved[i].sql);
+        saved[i].sql = NULL;
+    }
+    return 0;
+}
+
+static void free_schema(struct saved* saved, int n) {
+    int i;
+
+    for(i = 0 ; i < n ; ++i) {
+        free(saved[i].table);
+        free(saved[i].sql);
+    }
+    free(saved);
+}
+
+static int table_exists(sqlite3* pDb, const char* table) {
+    sqlite3_stmt* pSt;
+    int exists = 0;
+
+    if(sqlite3_prepare_v2(pDb, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?",
+                          -1, &pSt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(pSt, 1, table, -1, SQLITE_STATIC);
+        exists = sqlite3_step(pSt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(pSt);
+    return exists;
+}
+
+/*
+ * Bind a field, as an integer for numeric columns. Empty numeric
+ * fields of shadow(5) are stored as -1 like the schema's defaults.
+ */
+static void bind_field(sqlite3_stmt* pSt, int col, const char* value, int numeric) {
+    long long n;
+
+    if(!numeric) {
+        sqlite3_bind_text(pSt, col, value, -1, SQLITE_STATIC);
+    } else if(parse_number(value, &n)) {
+        sqlite3_bind_int64(pSt, col, n);
+    } else {
+        sqlite3_bind_int64(pSt, col, -1);
+    }
+}
+
+/*
+ * Insert every record with sql, binding the fields listed in cols
+ * (negative values for numeric ones, 1 based) in order.
+ */
+static int insert_recs(sqlite3* pDb, const char* sql, const struct recs* recs, const int* cols, int ncols) {
+    sqlite3_stmt* pSt;
+    size_t i;
+    int j;
+
+    if(sqlite3_prepare_v2(pDb, sql, -1, &pSt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", program, sqlite3_errmsg(pDb));
+        return -1;
+    }
+    for(i = 0 ; i < recs->n ; ++i) {
+        for(j = 0 ; j < ncols ; ++j) {
+            int col = cols[j] < 0 ? -cols[j] : cols[j];
+            bind_field(pSt, j + 1, recs->v[i].f[col - 1], cols[j] < 0);
+        }
+        if(sqlite3_step(pSt) != SQLITE_DONE) {
+            fprintf(stderr, "%s: %s: %s\n", program, recs->v[i].f[0], sqlite3_errmsg(pDb));
+            sqlite3_finalize(pSt);
+            return -1;
+        }
+        sqlite3_reset(pSt);
+    }
+    sqlite3_finalize(pSt);
+    return 0;
+}
+
+/*
+ * Queue every member of the group records into temp.import_members.
+ */
+static int insert_members(sqlite3* pDb, const struct recs* groups) {
+    sqlite3_stmt* pSt;
+    size_t i;
+
+    if(exec_sql(pDb, "CREATE TEMP TABLE import_members(gid INTEGER, username TEXT)") < 0 ||
+       sqlite3_prepare_v2(pDb, "INSERT INTO import_members VALUES(?, ?)", -1, &pSt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+    for(i = 0 ; i < groups->n ; ++i) {
+        char* member = groups->v[i].f[3];
+        while(*member != '\0') {
+            char* next = strchr(member, ',');
+            int l = next ? next - member : (int)strlen(member);
+            if(l > 0) {
+                sqlite3_bind_int64(pSt, 1, groups->v[i].key);
+                sqlite3_bind_text(pSt, 2, member, l, SQLITE_STATIC);
+                if(sqlite3_step(pSt) != SQLITE_DONE) {
+                    fprintf(stderr, "%s: %s\n", program, sqlite3_errmsg(pDb));
+                    sqlite3_finalize(pSt);
+                    return -1;
+                }
+                sqlite3_reset(pSt);
+            }
+            member += l + (next != NULL);
+        }
+    }
+    sqlite3_finalize(pSt);
+    return 0;
+}
+
+static sqlite3* open_db(const char* path) {
+    sqlite3* pDb;
+
+    if(sqlite3_open_v2(path, &pDb, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s: %s\n", program, path, sqlite3_errmsg(pDb));
+        sqlite3_close(pDb);
+        return NULL;
+    }
+    sqlite3_busy_timeout(pDb, 5000);
+    /* Room for the index builds */
+    if(exec_sql(pDb, "PRAGMA cache_size = -65536; PRAGMA temp_store = MEMORY") < 0) {
+        sqlite3_close(pDb);
+        return NULL;
+    }
+    return pDb;
+}
+
+/*
+ * Gather statistics, commit, and rewrite the file in key order.
+ */
+static int finish_db(sqlite3* pDb, const char* path) {
+    if(exec_sql(pDb, "ANALYZE") < 0 || exec_sql(pDb, "COMMIT") < 0) {
+        return -1;
+    }
+    if(exec_sql(pDb, "VACUUM") < 0) {
+        fprintf(stderr, "%s: %s: loaded but not vacuumed\n", program, path);
+    }
+    return 0;
+}
+
+/*
+ * Serialize the rows loaded into table, whose packed column was left
+ * NULL while its triggers were dropped. The restored triggers fill it.
+ */
+static int repack(sqlite3* pDb, const char* table) {
+    sqlite3_stmt* pSt;
+    char sql[128];
+    int packed = 0;
+
+    if(sqlite3_prepare_v2(pDb, "SELECT 1 FROM pragma_table_info(?) WHERE name = 'packed'",
+                          -1, &pSt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(pSt, 1, table, -1, SQLITE_STATIC);
+        packed = sqlite3_step(pSt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(pSt);
+    if(!packed) {
+        return 0;
+    }
+    snprintf(sql, sizeof(sql), "UPDATE %s SET packed = NULL WHERE packed IS NULL", table);
+    return exec_sql(pDb, sql);
+}
+
+static int import_users(const char* path, struct source* passwd, struct source* group) {
+    static const int passwd_cols[] = { -3, 1, 2, -4, 5, 6, 7 };
+    static const int group_cols[] = { -3, 1, 2 };
+    struct saved* saved = NULL;
+    char sql[512];
+    sqlite3* pDb;
+    int nsaved = -1, res = -1, closure;
+
+    if(!(pDb = open_db(path))) {
+        return -1;
+    }
+    if(exec_sql(pDb, "BEGIN IMMEDIATE") < 0 ||
+       (nsaved = drop_schema(pDb, "'passwd', 'groups', 'user_group', 'user_group_closure'", &saved)) < 0) {
+        goto out;
+    }
+
+    if(passwd != NULL &&
+       insert_recs(pDb, "INSERT OR REPLACE INTO passwd(uid, username, passwd, gid, gecos, homedir, shell) "
+                        "VALUES(?, ?, ?, ?, ?, ?, ?)", &passwd->recs, passwd_cols, 7) < 0) {
+        goto out;
+    }
+    if(group != NULL &&
+       (insert_recs(pDb, "INSERT OR REPLACE INTO groups(gid, groupname, passwd) VALUES(?, ?, ?)",
+                    &group->recs, group_cols, 3) < 0 ||
+        insert_members(pDb, &group->recs) < 0)) {
+        goto out;
+    }
+    if(restore_schema(pDb, saved, nsaved, "index", "passwd") < 0 ||
+       restore_schema(pDb, saved, nsaved, "index", "groups") < 0) {
+        goto out;
+    }
+
+    if(group != NULL) {
+        sqlite3_stmt* pSt;
+        if(exec_sql(pDb, "INSERT OR IGNORE INTO user_group(uid, gid) "
+                         "SELECT p.uid, m.gid FROM import_members m INNER JOIN passwd p ON p.username = m.username "
+                         "ORDER BY 1, 2") < 0) {
+            goto out;
+        }
+        if(sqlite3_prepare_v2(pDb, "SELECT count(*) FROM import_members "
+                                   "WHERE username NOT IN (SELECT username FROM passwd)", -1, &pSt, NULL) == SQLITE_OK &&
+           sqlite3_step(pSt) == SQLITE_ROW && sqlite3_column_int64(pSt, 0) > 0) {
+            fprintf(stderr, "%s: %lld memberships of unknown users skipped\n", program,
+                    (long long)sqlite3_column_int64(pSt, 0));
+        }
+        sqlite3_finalize(pSt);
+        if(exec_sql(pDb, "DROP TABLE temp.import_members") < 0) {
+            goto out;
+        }
+    }
+
+    /* Triggers were not there to maintain them */
+    closure = table_exists(pDb, "user_group_closure");
+    if(closure &&
+       exec_sql(pDb, "DELETE FROM user_group_closure;"
+                     "INSERT INTO user_group_closure(uid, gid, paths) "
+                     "SELECT uid, gid, sum(paths) FROM (SELECT uid, gid, 1 AS paths FROM user_group "
+                     "UNION ALL SELECT ug.uid, gc.gid, gc.paths FROM user_group ug INNER JOIN group_closure gc ON gc.member_gid = ug.gid) "
+                     "GROUP BY uid, gid ORDER BY uid, gid") < 0) {
+        goto out;
+    }
+    if(restore_schema(pDb, saved, nsaved, "index", NULL) < 0) {
+        goto out;
+    }
+    snprintf(sql, sizeof(sql), "DELETE FROM group_members;"
+             "INSERT INTO group_members SELECT ug.gid, count(*), CAST(group_concat(p.username || x'00', '') AS BLOB) "
+             "FROM %s ug INNER JOIN passwd p ON p.uid = ug.uid GROUP BY ug.gid", closure ? "user_group_closure" : "user_group");
+    if(table_exists(pDb, "group_members") && exec_sql(pDb, sql) < 0) {
+        goto out;
+    }
+    if(restore_schema(pDb, saved, nsaved, "trigger", NULL) < 0 ||
+       repack(pDb, "passwd") < 0 || repack(pDb, "groups") < 0) {
+        goto out;
+    }
+    res = finish_db(pDb, path);
+
+out:
+    if(res < 0) {
+        exec_sql(pDb, "ROLLBACK");
+    }
+    free_schema(saved, nsaved);
+    sqlite3_close(pDb);
+    return res;
+}
+
+static int import_shadow(const char* path, struct source* shadow) {
+    static const int shadow_cols[] = { 1, 2, -3, -4, -5, -6, -7, -8 };
+    struct saved* saved = NULL;
+    sqlite3* pDb;
+    int nsaved = -1, res = -1;
+
+    if(!(pDb = open_db(path))) {
+        return -1;
+    }
+    if(exec_sql(pDb, "BEGIN IMMEDIATE") < 0 ||
+       (nsaved = drop_schema(pDb, "'shadow'", &saved)) < 0 ||
+       insert_recs(pDb, "INSERT OR REPLACE INTO shadow(username, passwd, lastchange, mindays, maxdays, warn, inact, expire) "
+                        "VALUES(?, ?, ?, ?, ?, ?, ?, ?)", &shadow->recs, shadow_cols, 8) < 0 ||
+       restore_schema(pDb, saved, nsaved, "index", NULL) < 0 ||
+       restore_schema(pDb, saved, nsaved, "trigger", NULL) < 0 ||
+       repack(pDb, "shadow") < 0) {
+        goto out;
+    }
+    res = finish_db(pDb, path);
+
+out:
+    if(res < 0) {
+        exec_sql(pDb, "ROLLBACK");
+    }
+    free_schema(saved, nsaved);
+    sqlite3_close(pDb);
+    return res;
+}
+
+int main(int argc, char** argv) {
+    struct source srcs[KINDS];
+    struct source* by_kind[KINDS] = { NULL, NULL, NULL };
+    const char* files[KINDS] = { NULL, NULL, NULL };
+    long threads = sysconf(_SC_NPROCESSORS_ONLN), bad;
+    struct timespec t0, t1;
+    int c, i, nsrcs = 0, res = 0;
+
+    while((c = getopt(argc, argv, "j:p:g:s:")) != -1) {
+        switch(c) {
+            case 'j':
+                threads = atol(optarg);
+                break;
+            case 'p':
+                files[KIND_PASSWD] = optarg;
+                break;
+            case 'g':
+                files[KIND_GROUP] = optarg;
+                break;
+            case 's':
+                files[KIND_SHADOW] = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if(optind == argc || argc - optind > 2 ||
+       (files[KIND_SHADOW] != NULL && argc - optind != 2) ||
+       (files[KIND_PASSWD] == NULL && files[KIND_GROUP] == NULL && files[KIND_SHADOW] == NULL)) {
+        usage();
+    }
+    if(threads < 1) {
+        threads = 1;
+    } else if(threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0 ; i < KINDS ; ++i) {
+        if(files[i] != NULL) {
+            memset(&srcs[nsrcs], 0, sizeof(srcs[nsrcs]));
+            srcs[nsrcs].kind = i;
+            srcs[nsrcs].path = files[i];
+            by_kind[i] = &srcs[nsrcs++];
+        }
+    }
+    if((bad = parse_sources(srcs, nsrcs, threads)) < 0) {
+        return 1;
+    }
+
+    if((by_kind[KIND_PASSWD] != NULL || by_kind[KIND_GROUP] != NULL) &&
+       import_users(argv[optind], by_kind[KIND_PASSWD], by_kind[KIND_GROUP]) < 0) {
+        res = 1;
+    }
+    if(res == 0 && by_kind[KIND_SHADOW] != NULL &&
+       import_shadow(argv[optind + 1], by_kind[KIND_SHADOW]) < 0) {
+        res = 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for(i = 0 ; i < nsrcs ; ++i) {
+        fprintf(stderr, "%s: %zu %s entries%s\n", program, srcs[i].recs.n, kind_name[srcs[i].kind],
+                res == 0 ? "" : " not loaded");
+        free(srcs[i].recs.v);
+        free(srcs[i].data);
+    }
+    fprintf(stderr, "%s: %ld malformed entries skipped, %.1fs\n", program, bad,
+            (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    return res;
+}
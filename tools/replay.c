@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * replay.c : nss-sqlite-replay, re-issue captured lookups.
+ *
+ *  nss-sqlite-replay [-f] [-j THREADS] [-m MODULE] [-c CONFIG] FILE...
+ *
+ * Capture files written by the module (capture_dir setting) are merged
+ * by time and their calls issued again through the module's entry
+ * points, with the original buffer sizes. Calls are spread round robin
+ * over THREADS threads and, unless -f is given, each is issued at its
+ * original offset from the first one. CONFIG is handed to the module
+ * as NSS_SQLITE_CONFIG, its passwd_db and shadow_db settings select the
+ * databases played against. Latencies are reported per function next
+ * to the captured ones.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "capture.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <grp.h>
+#include <nss.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* program = "nss-sqlite-replay";
+
+typedef enum nss_status (*void_fn)(void);
+typedef enum nss_status (*pwent_fn)(struct passwd*, char*, size_t, int*);
+typedef enum nss_status (*pwnam_fn)(const char*, struct passwd*, char*, size_t, int*);
+typedef enum nss_status (*pwuid_fn)(uid_t, struct passwd*, char*, size_t, int*);
+typedef enum nss_status (*grent_fn)(struct group*, char*, size_t, int*);
+typedef enum nss_status (*grnam_fn)(const char*, struct group*, char*, size_t, int*);
+typedef enum nss_status (*grgid_fn)(gid_t, struct group*, char*, size_t, int*);
+typedef enum nss_status (*initgroups_fn)(const char*, gid_t, long*, long*, gid_t**, long, int*);
+typedef enum nss_status (*spent_fn)(struct spwd*, char*, size_t, int*);
+typedef enum nss_status (*spnam_fn)(const char*, struct spwd*, char*, size_t, int*);
+
+/* Entry points, indexed by enum nss_capture_func */
+static const char* const func_names[NSS_CAP_MAX] = {
+    NULL, "setpwent", "endpwent", "getpwent_r", "getpwnam_r", "getpwuid_r",
+    "setgrent", "endgrent", "getgrent_r", "getgrnam_r", "getgrgid_r",
+    "initgroups_dyn", "setspent", "endspent", "getspent_r", "getspnam_r"
+};
+static void* funcs[NSS_CAP_MAX];
+
+static struct nss_capture_record* records = NULL;
+static size_t nrecords = 0;
+static int nthreads = 1;
+static int fast = 0;
+static struct timespec origin;
+
+struct worker {
+    pthread_t thread;
+    int index;
+    uint32_t* latency;      /* per record handled, ns */
+    int* status;
+};
+
+static void usage(void) {
+    fprintf(stderr, "Usage: %s [-f] [-j THREADS] [-m MODULE] [-c CONFIG] FILE...\n", program);
+    exit(2);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Append records of a capture file, oldest first.
+ */
+static int load_capture(const char* path) {
+    struct nss_capture_header header;
+    struct nss_capture_record* p;
+    uint64_t first, n, i;
+    FILE* f;
+
+    if(!(f = fopen(path, "r"))) {
+        fprintf(stderr, "%s: %s: %s\n", program, path, strerror(errno));
+        return -1;
+    }
+    if(fread(&header, sizeof(header), 1, f) != 1
+       || memcmp(header.magic, NSS_CAPTURE_MAGIC, sizeof(NSS_CAPTURE_MAGIC)) != 0
+       || header.record_size != sizeof(struct nss_capture_record) || header.capacity == 0) {
+        fprintf(stderr, "%s: %s: not a capture file\n", program, path);
+        fclose(f);
+        return -1;
+    }
+    n = header.head < header.capacity ? header.head : header.capacity;
+    first = header.head - n;
+    if(!(p = realloc(records, (nrecords + n) * sizeof(*records)))) {
+        fprintf(stderr, "%s: out of memory\n", program);
+        fclose(f);
+        return -1;
+    }
+    records = p;
+    /* Walk the ring from its oldest slot */
+    for(i = first ; i < header.head ; ++i) {
+        struct nss_capture_record* rec = &records[nrecords];
+        if(fseek(f, sizeof(header) + (i % header.capacity) * sizeof(*rec), SEEK_SET) != 0
+           || fread(rec, sizeof(*rec), 1, f) != 1) {
+            break;
+        }
+        rec->key[sizeof(rec->key) - 1] = '\0';
+        if(rec->func > 0 && rec->func < NSS_CAP_MAX) {
+            nrecords++;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static int by_time(const void* a, const void* b) {
+    const struct nss_capture_record* ra = a;
+    const struct nss_capture_record* rb = b;
+    return ra->time_ns < rb->time_ns ? -1 : ra->time_ns > rb->time_ns;
+}
+
+/*
+ * Issue one captured call.
+ */
+static int replay(const struct nss_capture_record* rec, char* buf) {
+    union {
+        struct passwd pw;
+        struct group gr;
+        struct spwd sp;
+    } result;
+    void* fn = funcs[rec->func];
+    size_t buflen = rec->buflen;
+    int err = 0;
+
+    switch(rec->func) {
+        case NSS_CAP_SETPWENT: case NSS_CAP_ENDPWENT:
+        case NSS_CAP_SETGRENT: case NSS_CAP_ENDGRENT:
+        case NSS_CAP_SETSPENT: case NSS_CAP_ENDSPENT:
+            return ((void_fn)fn)();
+        case NSS_CAP_GETPWENT:
+            return ((pwent_fn)fn)(&result.pw, buf, buflen, &err);
+        case NSS_CAP_GETPWNAM:
+            return ((pwnam_fn)fn)(rec->key, &result.pw, buf, buflen, &err);
+        case NSS_CAP_GETPWUID:
+            return ((pwuid_fn)fn)(rec->id, &result.pw, buf, buflen, &err);
+        case NSS_CAP_GETGRENT:
+            return ((grent_fn)fn)(&result.gr, buf, buflen, &err);
+        case NSS_CAP_GETGRNAM:
+            return ((grnam_fn)fn)(rec->key, &result.gr, buf, buflen, &err);
+        case NSS_CAP_GETGRGID:
+            return ((grgid_fn)fn)(rec->id, &result.gr, buf, buflen, &err);
+        case NSS_CAP_GETSPENT:
+            return ((spent_fn)fn)(&result.sp, buf, buflen, &err);
+        case NSS_CAP_GETSPNAM:
+            return ((spnam_fn)fn)(rec->key, &result.sp, buf, buflen, &err);
+        case NSS_CAP_INITGROUPS: {
+            long start = 0, size = 16;
+            gid_t* groups = malloc(size * sizeof(*groups));
+            int res;
+            if(groups == NULL) {
+                return NSS_STATUS_TRYAGAIN;
+            }
+            res = ((initgroups_fn)fn)(rec->key, rec->id, &start, &size, &groups, rec->buflen, &err);
+            free(groups);
+            return res;
+        }
+    }
+    return NSS_STATUS_UNAVAIL;
+}
+
+static void* worker_run(void* arg) {
+    struct worker* w = arg;
+    size_t i, k, bufsize = 0;
+    char* buf = NULL;
+    uint64_t first = records[0].time_ns;
+
+    for(i = w->index ; i < nrecords ; i += nthreads) {
+        if(records[i].buflen > bufsize) {
+            char* p = realloc(buf, records[i].buflen);
+            if(p == NULL) {
+                break;
+            }
+            buf = p;
+            bufsize = records[i].buflen;
+        }
+        if(!fast) {
+            /* Wait for the call's original offset from the first one */
+            uint64_t offset = records[i].time_ns - first;
+            struct timespec at = origin;
+            at.tv_sec += offset / 1000000000;
+            at.tv_nsec += offset % 1000000000;
+            if(at.tv_nsec >= 1000000000) {
+                at.tv_sec++;
+                at.tv_nsec -= 1000000000;
+            }
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR);
+        }
+        k = i / nthreads;
+        {
+            uint64_t t = now_ns();
+            w->status[k] = replay(&records[i], buf);
+            t = now_ns() - t;
+            w->latency[k] = t > UINT32_MAX ? UINT32_MAX : t;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int by_value(const void* a, const void* b) {
+    uint32_t va = *(const uint32_t*)a, vb = *(const uint32_t*)b;
+    return va < vb ? -1 : va > vb;
+}
+
+/*
+ * Print latency percentiles of a set, in microseconds.
+ */
+static void print_percentiles(uint32_t* v, size_t n) {
+    qsort(v, n, sizeof(*v), by_value);
+    printf(" %9.1f %9.1f %9.1f", v[n / 2] / 1000.0, v[n * 99 / 100] / 1000.0, v[n - 1] / 1000.0);
+}
+
+static void report(struct worker* workers, double elapsed) {
+    uint32_t *replayed, *captured;
+    size_t i, n;
+    int f, diff;
+
+    printf("%zu calls, %d threads, %s timing, %.3f s, %.0f calls/s\n", nrecords, nthreads,
+           fast ? "no" : "original", elapsed, nrecords / elapsed);
+    printf("%-15s %8s %9s %9s %9s %9s %9s %9s %7s\n", "function", "calls",
+           "p50_us", "p99_us", "max_us", "cap_p50", "cap_p99", "cap_max", "changed");
+
+    replayed = malloc(nrecords * sizeof(*replayed));
+    captured = malloc(nrecords * sizeof(*captured));
+    if(replayed == NULL || captured == NULL) {
+        return;
+    }
+    for(f = 1 ; f < NSS_CAP_MAX ; ++f) {
+        for(i = 0, n = 0, diff = 0 ; i < nrecords ; ++i) {
+            struct worker* w = &workers[i % nthreads];
+            if(records[i].func != f) {
+                continue;
+            }
+            replayed[n] = w->latency[i / nthreads];
+            captured[n] = records[i].latency_ns;
+            diff += w->status[i / nthreads] != records[i].status;
+            n++;
+        }
+        if(n == 0) {
+            continue;
+        }
+        printf("%-15s %8zu", func_names[f], n);
+        print_percentiles(replayed, n);
+        print_percentiles(captured, n);
+        printf(" %7d\n", diff);
+    }
+    free(replayed);
+    free(captured);
+}
+
+int main(int argc, char** argv) {
+    const char* module = "libnss_sqlite.so.2";
+    struct worker* workers;
+    struct timespec end;
+    void* handle;
+    int c, i;
+
+    while((c = getopt(argc, argv, "fj:m:c:")) != -1) {
+        switch(c) {
+            case 'f':
+                fast = 1;
+                break;
+            case 'j':
+                if((nthreads = atoi(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            case 'm':
+                module = optarg;
+                break;
+            case 'c':
+                setenv("NSS_SQLITE_CONFIG", optarg, 1);
+                break;
+            default:
+                usage();
+        }
+    }
+    if(optind == argc) {
+        usage();
+    }
+
+    for(i = optind ; i < argc ; ++i) {
+        if(load_capture(argv[i]) != 0) {
+            return 1;
+        }
+    }
+    if(nrecords == 0) {
+        fprintf(stderr, "%s: no record to replay\n", program);
+        return 1;
+    }
+    qsort(records, nrecords, sizeof(*records), by_time);
+
+    if(!(handle = dlopen(module, RTLD_NOW))) {
+        fprintf(stderr, "%s: %s\n", program, dlerror());
+        return 1;
+    }
+    for(i = 1 ; i < NSS_CAP_MAX ; ++i) {
+        char symbol[64];
+        snprintf(symbol, sizeof(symbol), "_nss_sqlite_%s", func_names[i]);
+        if(!(funcs[i] = dlsym(handle, symbol))) {
+            fprintf(stderr, "%s: %s: missing %s\n", program, module, symbol);
+            return 1;
+        }
+    }
+
+    if(!(workers = calloc(nthreads, sizeof(*workers)))) {
+        fprintf(stderr, "%s: out of memory\n", program);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &origin);
+    for(i = 0 ; i < nthreads ; ++i) {
+        size_t n = nrecords / nthreads + 1;
+        workers[i].index = i;
+        workers[i].latency = calloc(n, sizeof(*workers[i].latency));
+        workers[i].status = calloc(n, sizeof(*workers[i].status));
+        if(workers[i].latency == NULL || workers[i].status == NULL
+           || pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            fprintf(stderr, "%s: unable to start thread\n", program);
+            return 1;
+        }
+    }
+    for(i = 0 ; i < nthreads ; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    report(workers, (end.tv_sec - origin.tv_sec) + (end.tv_nsec - origin.tv_nsec) / 1e9);
+    return 0;
+}
@@ -0,0 +1,428 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * sync.c : nss-sqlite-sync, incremental distribution of the databases.
+ *
+ * Instead of shipping whole database files, the authoring side produces
+ * SQLite changesets (session extension) named after the generation they
+ * lead to, and each host applies them in order, inside one short
+ * transaction per changeset. Applying a changeset bumps nss_generation,
+ * which tells which changesets are still pending. The journal mode of
+ * the database is left alone: in WAL mode, readers need write access to
+ * the -shm file, which unprivileged processes do not have next to a root
+ * owned database.
+ *
+ *  nss-sqlite-sync record DB DIR SQLFILE...
+ *      Run SQL files against DB and drop the resulting changeset in DIR.
+ *  nss-sqlite-sync diff OLD NEW DIR
+ *      Drop in DIR the changeset turning OLD into NEW.
+ *  nss-sqlite-sync apply DB DIR
+ *      Apply every pending changeset found in DIR to DB.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/* Session declarations are only visible when asked for */
+#define SQLITE_ENABLE_SESSION
+#define SQLITE_ENABLE_PREUPDATE_HOOK
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <unistd.h>
+
+#define CHANGESET_SUFFIX ".changeset"
+
+static const char* program = "nss-sqlite-sync";
+
+static const char* schema_sql =
+    "CREATE TABLE IF NOT EXISTS nss_generation(id INTEGER PRIMARY KEY CHECK (id = 0), generation INTEGER NOT NULL);"
+    "INSERT OR IGNORE INTO nss_generation VALUES(0, 0);";
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: %s record DB DIR SQLFILE...\n"
+        "       %s diff OLD NEW DIR\n"
+        "       %s apply DB DIR\n", program, program, program);
+    exit(2);
+}
+
+static int exec_sql(sqlite3* pDb, const char* sql) {
+    char* err = NULL;
+    if(sqlite3_exec(pDb, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", program, err);
+        sqlite3_free(err);
+        return -1;
+    }
+    return 0;
+}
+
+static sqlite3* open_db(const char* path) {
+    sqlite3* pDb;
+    if(sqlite3_open_v2(path, &pDb, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s: %s\n", program, path, sqlite3_errmsg(pDb));
+        sqlite3_close(pDb);
+        return NULL;
+    }
+    sqlite3_busy_timeout(pDb, 5000);
+    if(exec_sql(pDb, schema_sql) < 0) {
+        sqlite3_close(pDb);
+        return NULL;
+    }
+    return pDb;
+}
+
+static sqlite3_int64 get_generation(sqlite3* pDb) {
+    sqlite3_stmt* pSt;
+    sqlite3_int64 generation = -1;
+
+    if(sqlite3_prepare_v2(pDb, "SELECT generation FROM nss_generation", -1, &pSt, NULL) == SQLITE_OK
+       && sqlite3_step(pSt) == SQLITE_ROW) {
+        generation = sqlite3_column_int64(pSt, 0);
+    }
+    sqlite3_finalize(pSt);
+    return generation;
+}
+
+static int set_generation(sqlite3* pDb, sqlite3_int64 generation) {
+    char sql[128];
+    snprintf(sql, sizeof(sql), "UPDATE nss_generation SET generation = %lld", (long long)generation);
+    return exec_sql(pDb, sql);
+}
+
+/*
+ * Bookkeeping tables never travel in changesets.
+ */
+static int table_filter(void* ctx, const char* table) {
+    return strcmp(table, "nss_generation") != 0;
+}
+
+static char* read_file(const char* path, int* size) {
+    FILE* f;
+    char* data = NULL;
+    long l;
+
+    if(!(f = fopen(path, "rb"))) {
+        fprintf(stderr, "%s: %s: %s\n", program, path, strerror(errno));
+        return NULL;
+    }
+    if(fseek(f, 0, SEEK_END) == 0 && (l = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0
+       && (data = malloc(l + 1)) != NULL) {
+        if(fread(data, 1, l, f) != (size_t)l) {
+            fprintf(stderr, "%s: %s: short read\n", program, path);
+            free(data);
+            data = NULL;
+        } else {
+            data[l] = '\0';
+            *size = (int)l;
+        }
+    }
+    fclose(f);
+    return data;
+}
+
+/*
+ * Write a changeset under a temporary name, caller renames it with
+ * publish_changeset() once the matching transaction is committed so
+ * that hosts never see a changeset which does not exist on our side.
+ */
+static int write_changeset(const char* tmp, const void* data, int size) {
+    FILE* f;
+
+    if(!(f = fopen(tmp, "wb"))) {
+        fprintf(stderr, "%s: %s: %s\n", program, tmp, strerror(errno));
+        return -1;
+    }
+    if(fwrite(data, 1, size, f) != (size_t)size || fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        fprintf(stderr, "%s: %s: %s\n", program, tmp, strerror(errno));
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+static void changeset_name(char* buf, size_t len, const char* dir, sqlite3_int64 generation, const char* suffix) {
+    snprintf(buf, len, "%s/%020lld%s%s", dir, (long long)generation, CHANGESET_SUFFIX, suffix);
+}
+
+/*
+ * Save session's changes as the changeset leading to generation and
+ * commit the authoring transaction.
+ */
+static int publish(sqlite3* pDb, sqlite3_session* pSession, const char* dir, sqlite3_int64 generation) {
+    char tmp[4096], final[4096];
+    void* changeset;
+    int size;
+
+    if(sqlite3session_changeset(pSession, &size, &changeset) != SQLITE_OK) {
+        fprintf(stderr, "%s: unable to build changeset\n", program);
+        return -1;
+    }
+    if(size == 0) {
+        fprintf(stderr, "%s: nothing changed\n", program);
+        sqlite3_free(changeset);
+        exec_sql(pDb, "ROLLBACK");
+        return 0;
+    }
+
+    changeset_name(tmp, sizeof(tmp), dir, generation, ".tmp");
+    changeset_name(final, sizeof(final), dir, generation, "");
+    if(write_changeset(tmp, changeset, size) < 0) {
+        sqlite3_free(changeset);
+        return -1;
+    }
+    sqlite3_free(changeset);
+
+    if(set_generation(pDb, generation) < 0 || exec_sql(pDb, "COMMIT") < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    if(rename(tmp, final) != 0) {
+        fprintf(stderr, "%s: %s: %s\n", program, final, strerror(errno));
+        return -1;
+    }
+    printf("%s (%d bytes)\n", final, size);
+    return 0;
+}
+
+static int cmd_record(const char* path, const char* dir, char** files, int nfiles) {
+    sqlite3* pDb;
+    sqlite3_session* pSession = NULL;
+    sqlite3_int64 generation;
+    int i, res = -1;
+
+    if(!(pDb = open_db(path))) {
+        return -1;
+    }
+    if(exec_sql(pDb, "BEGIN IMMEDIATE") < 0) {
+        goto out;
+    }
+    generation = get_generation(pDb) + 1;
+
+    if(sqlite3session_create(pDb, "main", &pSession) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", program, sqlite3_errmsg(pDb));
+        goto out;
+    }
+    sqlite3session_table_filter(pSession, table_filter, NULL);
+    sqlite3session_attach(pSession, NULL);
+
+    for(i = 0 ; i < nfiles ; ++i) {
+        int size;
+        char* sql = read_file(files[i], &size);
+        if(sql == NULL || exec_sql(pDb, sql) < 0) {
+            free(sql);
+            exec_sql(pDb, "ROLLBACK");
+            goto out;
+        }
+        free(sql);
+    }
+
+    res = publish(pDb, pSession, dir, generation);
+
+out:
+    if(pSession) {
+        sqlite3session_delete(pSession);
+    }
+    sqlite3_close(pDb);
+    return res;
+}
+
+static int cmd_diff(const char* old, const char* new, const char* dir) {
+    sqlite3* pDb;
+    sqlite3_session* pSession = NULL;
+    sqlite3_stmt* pSt = NULL;
+    sqlite3_int64 generation;
+    char* err = NULL;
+    char* sql;
+    int res = -1;
+
+    if(!(pDb = open_db(new))) {
+        return -1;
+    }
+    sql = sqlite3_mprintf("ATTACH %Q AS old", old);
+    if(exec_sql(pDb, sql) < 0 || exec_sql(pDb, "BEGIN IMMEDIATE") < 0) {
+        sqlite3_free(sql);
+        goto out;
+    }
+    sqlite3_free(sql);
+
+    /* Generation follows what hosts have, ie. OLD's */
+    if(sqlite3_prepare_v2(pDb, "SELECT generation FROM old.nss_generation", -1, &pSt, NULL) != SQLITE_OK
+       || sqlite3_step(pSt) != SQLITE_ROW) {
+        sqlite3_finalize(pSt);
+        pSt = NULL;
+        generation = get_generation(pDb) + 1;
+    } else {
+        generation = sqlite3_column_int64(pSt, 0) + 1;
+    }
+    sqlite3_finalize(pSt);
+
+    if(sqlite3session_create(pDb, "main", &pSession) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", program, sqlite3_errmsg(pDb));
+        goto out;
+    }
+    sqlite3session_table_filter(pSession, table_filter, NULL);
+
+    sqlite3_prepare_v2(pDb, "SELECT name FROM main.sqlite_master WHERE type = 'table' "
+                            "AND name NOT LIKE 'sqlite_%'", -1, &pSt, NULL);
+    while(sqlite3_step(pSt) == SQLITE_ROW) {
+        const char* table = (const char*)sqlite3_column_text(pSt, 0);
+        if(!table_filter(NULL, table)) {
+            continue;
+        }
+        if(sqlite3session_attach(pSession, table) != SQLITE_OK
+           || sqlite3session_diff(pSession, "old", table, &err) != SQLITE_OK) {
+            fprintf(stderr, "%s: %s: %s\n", program, table, err ? err : sqlite3_errmsg(pDb));
+            sqlite3_free(err);
+            sqlite3_finalize(pSt);
+            exec_sql(pDb, "ROLLBACK");
+            goto out;
+        }
+    }
+    sqlite3_finalize(pSt);
+
+    res = publish(pDb, pSession, dir, generation);
+
+out:
+    if(pSession) {
+        sqlite3session_delete(pSession);
+    }
+    sqlite3_close(pDb);
+    return res;
+}
+
+static int conflict_handler(void* ctx, int conflict, sqlite3_changeset_iter* pIter) {
+    switch(conflict) {
+        /* Host drifted from authoring side, authoring side wins */
+        case SQLITE_CHANGESET_DATA:
+        case SQLITE_CHANGESET_CONFLICT:
+            return SQLITE_CHANGESET_REPLACE;
+        case SQLITE_CHANGESET_NOTFOUND:
+            return SQLITE_CHANGESET_OMIT;
+        default:
+            return SQLITE_CHANGESET_ABORT;
+    }
+}
+
+static int apply_one(sqlite3* pDb, const char* path, sqlite3_int64 generation) {
+    void* changeset;
+    int size;
+
+    if(!(changeset = read_file(path, &size))) {
+        return -1;
+    }
+    if(exec_sql(pDb, "BEGIN IMMEDIATE") < 0) {
+        free(changeset);
+        return -1;
+    }
+    if(sqlite3changeset_apply(pDb, size, changeset, NULL, conflict_handler, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s: %s\n", program, path, sqlite3_errmsg(pDb));
+        goto fail;
+    }
+    if(set_generation(pDb, generation) < 0 || exec_sql(pDb, "COMMIT") < 0) {
+        goto fail;
+    }
+    free(changeset);
+    printf("applied %s\n", path);
+    return 0;
+
+fail:
+    exec_sql(pDb, "ROLLBACK");
+    free(changeset);
+    return -1;
+}
+
+static int cmp_generation(const void* a, const void* b) {
+    sqlite3_int64 x = *(const sqlite3_int64*)a, y = *(const sqlite3_int64*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int cmd_apply(const char* path, const char* dir) {
+    sqlite3* pDb;
+    sqlite3_int64 current, *pending = NULL;
+    struct dirent* ent;
+    DIR* d;
+    int count = 0, alloc = 0, i, res = 0;
+
+    if(!(d = opendir(dir))) {
+        fprintf(stderr, "%s: %s: %s\n", program, dir, strerror(errno));
+        return -1;
+    }
+    if(!(pDb = open_db(path))) {
+        closedir(d);
+        return -1;
+    }
+    current = get_generation(pDb);
+
+    while((ent = readdir(d)) != NULL) {
+        char* end;
+        long long g = strtoll(ent->d_name, &end, 10);
+        if(end == ent->d_name || strcmp(end, CHANGESET_SUFFIX) != 0 || g <= current) {
+            continue;
+        }
+        if(count == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            pending = realloc(pending, alloc * sizeof(*pending));
+        }
+        pending[count++] = g;
+    }
+    closedir(d);
+    qsort(pending, count, sizeof(*pending), cmp_generation);
+
+    for(i = 0 ; i < count && res == 0 ; ++i) {
+        char file[4096];
+        if(pending[i] != current + 1) {
+            fprintf(stderr, "%s: changeset for generation %lld is missing\n", program, (long long)current + 1);
+            res = -1;
+            break;
+        }
+        changeset_name(file, sizeof(file), dir, pending[i], "");
+        if((res = apply_one(pDb, file, pending[i])) == 0) {
+            current = pending[i];
+        }
+    }
+    free(pending);
+    sqlite3_close(pDb);
+    return res;
+}
+
+int main(int argc, char** argv) {
+    int res;
+
+    if(argc < 2) {
+        usage();
+    }
+    if(strcmp(argv[1], "record") == 0 && argc >= 5) {
+        res = cmd_record(argv[2], argv[3], argv + 4, argc - 4);
+    } else if(strcmp(argv[1], "diff") == 0 && argc == 5) {
+        res = cmd_diff(argv[2], argv[3], argv[4]);
+    } else if(strcmp(argv[1], "apply") == 0 && argc == 4) {
+        res = cmd_apply(argv[2], argv[3]);
+    } else {
+        usage();
+    }
+    return res == 0 ? 0 : 1;
+}
@@ -21,6 +21,9 @@
  */
 
 #include "nss-sqlite.h"
+#include "arena.h"
+#include "probes.h"
+#include "utils.h"
 
 #include <errno.h>
 #include <grp.h>
@@ -28,79 +31,93 @@
 #include <pwd.h>
 #include <shadow.h>
 #include <sqlite3.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 
 /* Query the DB itself for the SQL query that is needed to resolve the call to getent function
- * @param pDb Database handle, will be closed if something fails.
+ * @param pDb Database handle.
  * @param getent_function The name of the getent function for which SQL statement is going to be retrieved.
+ * @param missing Set to TRUE when nss_queries has no such query, FALSE
+ *      when it could not be read.
+ * @return The query, allocated from calling thread's arena, or NULL.
  */
-char *get_query(struct sqlite3* pDb, char *getent_function) {
+char *get_query(struct sqlite3* pDb, const char *getent_function, int* missing) {
     struct sqlite3_stmt* pSsql;
     const char* sql = "SELECT query FROM nss_queries WHERE name = ?";
+    const char* text;
     char *query;
-    int res;
+    int res, step;
 
-    if(sqlite3_prepare(pDb, sql, -1, &pSsql, NULL) != SQLITE_OK) {
+    *missing = FALSE;
+    NSS_PROBE1(query_entry, getent_function);
+    if(sqlite3_prepare_v2(pDb, sql, -1, &pSsql, NULL) != SQLITE_OK) {
         NSS_ERROR(sqlite3_errmsg(pDb));
         sqlite3_finalize(pSsql);
-        sqlite3_close(pDb);
         return NULL;
     }
 
     if(sqlite3_bind_text(pSsql, 1, getent_function, -1, SQLITE_STATIC) != SQLITE_OK) {
         NSS_DEBUG(sqlite3_errmsg(pDb));
         sqlite3_finalize(pSsql);
-        sqlite3_close(pDb);
         return NULL;
     }
 
-    res = res2nss_status(sqlite3_step(pSsql), pDb, pSsql);
+    step = sqlite3_step(pSsql);
+    res = res2nss_status(step);
     if(res != NSS_STATUS_SUCCESS) {
+        *missing = step == SQLITE_DONE;
         sqlite3_finalize(pSsql);
-        sqlite3_close(pDb);
+        NSS_PROBE2(query_return, getent_function, res);
         return NULL;
     }
 
-    query = strdup(sqlite3_column_text(pSsql, 0));
+    if((text = (const char*)sqlite3_column_text(pSsql, 0)) == NULL) {
+        /* A NULL query is as good as none, anything else ran out of memory */
+        *missing = sqlite3_column_type(pSsql, 0) == SQLITE_NULL;
+        sqlite3_finalize(pSsql);
+        NSS_PROBE2(query_return, getent_function, NSS_STATUS_NOTFOUND);
+        return NULL;
+    }
+    query = arena_strdup(text);
     sqlite3_finalize(pSsql);
+    NSS_PROBE2(query_return, getent_function, res);
     return query;
 }
 
 /*
  * Translate sqlite return code into a directly usable nss_status code.
- * @param pDb Database handle, will be closed if something fails.
- * @param pSt Statement to fetch from, will be finalized if something
- *      goes wrong.
+ * Caller is responsible for releasing the handle (or discarding it when
+ * NSS_STATUS_UNAVAIL is returned).
+ * @param res SQLite result code.
  */
 
-enum nss_status res2nss_status(int res, struct sqlite3* pDb, struct sqlite3_stmt* pSt) {
+enum nss_status res2nss_status(int res) {
     switch(res) {
         /* Something was wrong with locks, try again later. */
         case SQLITE_BUSY:
-            sqlite3_finalize(pSt);
-            sqlite3_close(pDb);
             return NSS_STATUS_TRYAGAIN;
         /* No row returned (?) */
 
         case SQLITE_DONE:
-            sqlite3_finalize(pSt);
-            sqlite3_close(pDb);
             return NSS_STATUS_NOTFOUND;
 
         case SQLITE_ROW:
             return NSS_STATUS_SUCCESS;
 
+        /* Lookup went past its deadline, let nsswitch move on */
+        case SQLITE_INTERRUPT:
+            return NSS_STATUS_UNAVAIL;
+
         default:
-            sqlite3_finalize(pSt);
-            sqlite3_close(pDb);
         return NSS_STATUS_UNAVAIL;
     }
 }
 
 /*
  * Fill a group struct using given information.
- * @param pDb Handle to a database used to fetch group's members.
+ * @param db Handle to a database used to fetch group's members.
  * @param gbuf Struct which will be filled with various info.
  * @param buf Buffer which will contain all strings pointed to by
  *      gbuf.
@@ -112,14 +129,27 @@ enum nss_status res2nss_status(int res, struct sqlite3* pDb, struct sqlite3_stmt
  *      wrong.
  */
 
-enum nss_status fill_group(struct sqlite3 *pDb, struct group *gbuf, char* buf, size_t buflen, struct group entry, int *errnop) {
-    int name_length = strlen((char*)entry.gr_name) + 1;
-    int pw_length = strlen((char*)entry.gr_passwd) + 1;
-    int total_length = name_length + pw_length;
+enum nss_status fill_group(struct nss_db *db, struct group *gbuf, char* buf, size_t buflen, struct group entry, int *errnop) {
+    int name_length, pw_length, total_length;
+    int pad;
     int res;
 
+    if(entry.gr_name == NULL || entry.gr_passwd == NULL) {
+        NSS_ERROR("unreadable group row\n");
+        return NSS_STATUS_UNAVAIL;
+    }
+    name_length = strlen((char*)entry.gr_name) + 1;
+    pw_length = strlen((char*)entry.gr_passwd) + 1;
+    total_length = name_length + pw_length;
+
+    NSS_PROBE1(fill_entry, "group");
+    /* gr_mem pointers follow the strings and must be aligned */
+    pad = (sizeof(char*) - ((uintptr_t)(buf + total_length) % sizeof(char*))) % sizeof(char*);
+    total_length += pad;
+
     if(buflen < total_length) {
         *errnop = ERANGE;
+        NSS_PROBE3(fill_return, "group", NSS_STATUS_TRYAGAIN, total_length);
         return NSS_STATUS_TRYAGAIN;
     }
 
@@ -131,23 +161,50 @@ enum nss_status fill_group(struct sqlite3 *pDb, struct group *gbuf, char* buf, s
 
     strcpy(buf, (const char*)entry.gr_passwd);
     gbuf->gr_passwd = buf;
-    buf += pw_length;
+    buf += pw_length + pad;
 
     /* We have a group, we now need to fetch its users */
-    res = get_users(pDb, gbuf->gr_gid, buf, buflen - total_length, errnop);
+    res = get_users(db, gbuf->gr_gid, buf, buflen - total_length, errnop);
     if(res == NSS_STATUS_SUCCESS) {
         gbuf->gr_mem = (char**)buf;
     }
 
+    NSS_PROBE3(fill_return, "group", res, total_length);
     return res;
 }
 
-inline void fill_group_sql(struct group* entry, struct sqlite3_stmt* pSquery) {
+/*
+ * Text of a column, NULL when it cannot be used: NULL in a column which
+ * must not be, or not read because SQLite ran out of memory or hit a
+ * damaged page.
+ * @param null Value standing for NULL in a nullable column, NULL if the
+ *      column must not be NULL.
+ */
+static char* column_text(struct sqlite3_stmt* pSquery, int i, const char* null) {
+    const char* text = (const char*)sqlite3_column_text(pSquery, i);
+    int err = sqlite3_errcode(sqlite3_db_handle(pSquery)) & 0xff;
+
+    if(err == SQLITE_NOMEM || err == SQLITE_CORRUPT || err == SQLITE_IOERR) {
+        return NULL;
+    }
+    if(text == NULL && sqlite3_column_type(pSquery, i) == SQLITE_NULL) {
+        return (char*)null;
+    }
+    return (char*)text;
+}
+
+/*
+ * Point a group struct to the columns of a row.
+ * @return FALSE if a string could not be read, the entry must not be
+ *      used then.
+ */
+int fill_group_sql(struct group* entry, struct sqlite3_stmt* pSquery) {
     entry->gr_gid = sqlite3_column_int(pSquery, 0);
-    entry->gr_name = sqlite3_column_text(pSquery, 1);
-    entry->gr_passwd = sqlite3_column_text(pSquery, 2);
+    entry->gr_name = column_text(pSquery, 1, NULL);
+    /* A group without password must not be joinable by anyone */
+    entry->gr_passwd = column_text(pSquery, 2, "!");
 
-    return;
+    return entry->gr_name != NULL && entry->gr_passwd != NULL;
 }
 
 
@@ -163,16 +220,25 @@ inline void fill_group_sql(struct group* entry, struct sqlite3_stmt* pSquery) {
  */
 
 enum nss_status fill_passwd(struct passwd* pwbuf, char* buf, size_t buflen, struct passwd entry, int* errnop) {
-    int name_length = strlen(entry.pw_name) + 1;
-    int pw_length = strlen(entry.pw_passwd) + 1;
-    int gecos_length = strlen(entry.pw_gecos) + 1;
-    int homedir_length = strlen(entry.pw_dir) + 1;
-    int shell_length = strlen(entry.pw_shell) + 1;
-
-    int total_length = name_length + pw_length + gecos_length + shell_length + homedir_length;
+    int name_length, pw_length, gecos_length, homedir_length, shell_length;
+    int total_length;
 
+    if(entry.pw_name == NULL || entry.pw_passwd == NULL || entry.pw_gecos == NULL
+       || entry.pw_dir == NULL || entry.pw_shell == NULL) {
+        NSS_ERROR("unreadable passwd row\n");
+        return NSS_STATUS_UNAVAIL;
+    }
+    name_length = strlen(entry.pw_name) + 1;
+    pw_length = strlen(entry.pw_passwd) + 1;
+    gecos_length = strlen(entry.pw_gecos) + 1;
+    homedir_length = strlen(entry.pw_dir) + 1;
+    shell_length = strlen(entry.pw_shell) + 1;
+    total_length = name_length + pw_length + gecos_length + shell_length + homedir_length;
+
+    NSS_PROBE1(fill_entry, "passwd");
     if(buflen < total_length) {
         *errnop = ERANGE;
+        NSS_PROBE3(fill_return, "passwd", NSS_STATUS_TRYAGAIN, total_length);
         return NSS_STATUS_TRYAGAIN;
     }
 
@@ -198,20 +264,25 @@ enum nss_status fill_passwd(struct passwd* pwbuf, char* buf, size_t buflen, stru
     strcpy(buf, entry.pw_shell);
     pwbuf->pw_shell = buf;
 
-
+    NSS_PROBE3(fill_return, "passwd", NSS_STATUS_SUCCESS, total_length);
     return NSS_STATUS_SUCCESS;
 }
 
-inline void fill_passwd_sql(struct passwd* entry, struct sqlite3_stmt* pSquery) {
-    entry->pw_name = sqlite3_column_text(pSquery, 0);
-    entry->pw_passwd = sqlite3_column_text(pSquery, 1);
+/*
+ * Same as fill_group_sql() for struct passwd, whose columns are all
+ * NOT NULL.
+ */
+int fill_passwd_sql(struct passwd* entry, struct sqlite3_stmt* pSquery) {
+    entry->pw_name = column_text(pSquery, 0, NULL);
+    entry->pw_passwd = column_text(pSquery, 1, NULL);
     entry->pw_uid = sqlite3_column_int(pSquery, 2);
     entry->pw_gid =sqlite3_column_int(pSquery, 3);
-    entry->pw_gecos = sqlite3_column_text(pSquery, 4);
-    entry->pw_dir = sqlite3_column_text(pSquery, 5);
-    entry->pw_shell = sqlite3_column_text(pSquery, 6);
+    entry->pw_gecos = column_text(pSquery, 4, NULL);
+    entry->pw_dir = column_text(pSquery, 5, NULL);
+    entry->pw_shell = column_text(pSquery, 6, NULL);
 
-    return;
+    return entry->pw_name != NULL && entry->pw_passwd != NULL && entry->pw_gecos != NULL
+           && entry->pw_dir != NULL && entry->pw_shell != NULL;
 }
 
 
@@ -233,12 +304,19 @@ inline void fill_passwd_sql(struct passwd* entry, struct sqlite3_stmt* pSquery)
  */
 
 enum nss_status fill_shadow(struct spwd *spbuf, char* buf, size_t buflen, struct spwd entry, int* errnop) {
+    int name_length, pw_length;
 
-    int name_length = strlen(entry.sp_namp) + 1;
-    int pw_length = strlen(entry.sp_pwdp) + 1;
+    if(entry.sp_namp == NULL || entry.sp_pwdp == NULL) {
+        NSS_ERROR("unreadable shadow row\n");
+        return NSS_STATUS_UNAVAIL;
+    }
+    name_length = strlen(entry.sp_namp) + 1;
+    pw_length = strlen(entry.sp_pwdp) + 1;
 
+    NSS_PROBE1(fill_entry, "shadow");
     if(buflen < name_length + pw_length) {
         *errnop = ERANGE;
+        NSS_PROBE3(fill_return, "shadow", NSS_STATUS_TRYAGAIN, name_length + pw_length);
         return NSS_STATUS_TRYAGAIN;
     }
 
@@ -255,19 +333,239 @@ enum nss_status fill_shadow(struct spwd *spbuf, char* buf, size_t buflen, struct
     spbuf->sp_warn = entry.sp_warn;
     spbuf->sp_inact = entry.sp_inact;
     spbuf->sp_expire = entry.sp_expire;
+    /* Reserved, the schema has no column for it */
+    spbuf->sp_flag = ~0UL;
 
+    NSS_PROBE3(fill_return, "shadow", NSS_STATUS_SUCCESS, name_length + pw_length);
     return NSS_STATUS_SUCCESS;
 }
 
-inline void fill_shadow_sql(struct spwd* entry, struct sqlite3_stmt* pSquery) {
-    entry->sp_namp = sqlite3_column_text(pSquery, 0);
-    entry->sp_pwdp = sqlite3_column_text(pSquery, 1);
+/*
+ * Same as fill_group_sql() for struct spwd. A NULL password locks the
+ * account, an empty one would let anybody log in.
+ */
+int fill_shadow_sql(struct spwd* entry, struct sqlite3_stmt* pSquery) {
+    entry->sp_namp = column_text(pSquery, 0, NULL);
+    entry->sp_pwdp = column_text(pSquery, 1, "!");
     entry->sp_lstchg = sqlite3_column_int(pSquery, 2);
     entry->sp_min = sqlite3_column_int(pSquery, 3);
     entry->sp_max = sqlite3_column_int(pSquery, 4);
     entry->sp_warn = sqlite3_column_int(pSquery, 5);
     entry->sp_inact = sqlite3_column_int(pSquery, 6);
-    entry->sp_expire = sqlite3_column_int(pSquery, 6);
+    entry->sp_expire = sqlite3_column_int(pSquery, 7);
+    entry->sp_flag = ~0UL;
+
+    return entry->sp_namp != NULL && entry->sp_pwdp != NULL;
+}
+
+/*
+ * Split a serialized row, the first column of a *_packed query: a
+ * header of n decimal numbers separated by ':' and ended by a NUL byte,
+ * the last noff of which are the offsets of all strings but the first
+ * in the area following the header, then that area where every string
+ * is NUL terminated, laid out as the caller's buffer wants it.
+ * @param pSquery Statement positioned on the row.
+ * @param v Filled with the numbers of the header.
+ * @param len Filled with the size of the area.
+ * @return Start of the area, NULL if the row is NULL or malformed.
+ */
+static const char* packed_split(struct sqlite3_stmt* pSquery, long long* v, int n, int noff, size_t* len) {
+    const char* row = sqlite3_column_blob(pSquery, 0);
+    int size = sqlite3_column_bytes(pSquery, 0);
+    const char *p, *area;
+    char* next;
+    int i;
+
+    if(row == NULL || (area = memchr(row, '\0', size)) == NULL) {
+        return NULL;
+    }
+    area++;
+    *len = row + size - area;
+    if(*len == 0 || area[*len - 1] != '\0') {
+        return NULL;
+    }
+    for(p = row, i = 0 ; i < n ; ++i, p = next + 1) {
+        v[i] = strtoll(p, &next, 10);
+        if(next == p || *next != (i == n - 1 ? '\0' : ':')) {
+            return NULL;
+        }
+    }
+    /* Every string must end before the next one starts */
+    for(i = n - noff ; i < n ; ++i) {
+        if(v[i] <= (i > n - noff ? v[i - 1] : 0) || v[i] >= (long long)*len || area[v[i] - 1] != '\0') {
+            return NULL;
+        }
+    }
+    return area;
+}
+
+/*
+ * Fill a passwd struct from a serialized row: header
+ * "uid:gid:passwd:gecos:dir:shell", strings copied at once.
+ * @param pwbuf Struct which will be filled with various info.
+ * @param buf Buffer which will contain all strings pointed to by
+ *      pwbuf.
+ * @param buflen Buffer length.
+ * @param pSquery Statement positioned on the row.
+ * @param errnop Pointer to errno, will be filled if something goes wrong.
+ * @return NSS_STATUS_RETURN if the row is not serialized, its columns
+ *      have to be read instead.
+ */
+enum nss_status fill_passwd_packed(struct passwd* pwbuf, char* buf, size_t buflen, struct sqlite3_stmt* pSquery, int* errnop) {
+    long long v[6];
+    const char* area;
+    size_t len;
+
+    if(!(area = packed_split(pSquery, v, 6, 4, &len))) {
+        return NSS_STATUS_RETURN;
+    }
+    NSS_PROBE1(fill_entry, "passwd");
+    if(buflen < len) {
+        *errnop = ERANGE;
+        NSS_PROBE3(fill_return, "passwd", NSS_STATUS_TRYAGAIN, len);
+        return NSS_STATUS_TRYAGAIN;
+    }
+
+    memcpy(buf, area, len);
+    pwbuf->pw_uid = v[0];
+    pwbuf->pw_gid = v[1];
+    pwbuf->pw_name = buf;
+    pwbuf->pw_passwd = buf + v[2];
+    pwbuf->pw_gecos = buf + v[3];
+    pwbuf->pw_dir = buf + v[4];
+    pwbuf->pw_shell = buf + v[5];
+
+    NSS_PROBE3(fill_return, "passwd", NSS_STATUS_SUCCESS, len);
+    return NSS_STATUS_SUCCESS;
+}
 
-    return;
+/*
+ * Same as fill_passwd_packed() for struct spwd, header
+ * "lstchg:min:max:warn:inact:expire:passwd".
+ */
+enum nss_status fill_shadow_packed(struct spwd* spbuf, char* buf, size_t buflen, struct sqlite3_stmt* pSquery, int* errnop) {
+    long long v[7];
+    const char* area;
+    size_t len;
+
+    if(!(area = packed_split(pSquery, v, 7, 1, &len))) {
+        return NSS_STATUS_RETURN;
+    }
+    NSS_PROBE1(fill_entry, "shadow");
+    if(buflen < len) {
+        *errnop = ERANGE;
+        NSS_PROBE3(fill_return, "shadow", NSS_STATUS_TRYAGAIN, len);
+        return NSS_STATUS_TRYAGAIN;
+    }
+
+    memcpy(buf, area, len);
+    spbuf->sp_namp = buf;
+    spbuf->sp_pwdp = buf + v[6];
+    spbuf->sp_lstchg = v[0];
+    spbuf->sp_min = v[1];
+    spbuf->sp_max = v[2];
+    spbuf->sp_warn = v[3];
+    spbuf->sp_inact = v[4];
+    spbuf->sp_expire = v[5];
+    spbuf->sp_flag = ~0UL;
+
+    NSS_PROBE3(fill_return, "shadow", NSS_STATUS_SUCCESS, len);
+    return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * Same as fill_passwd_packed() for struct group, header "gid:passwd".
+ * Members are read as fill_group() does.
+ * @param db Handle to a database used to fetch group's members.
+ */
+enum nss_status fill_group_packed(struct nss_db* db, struct group* gbuf, char* buf, size_t buflen, struct sqlite3_stmt* pSquery, int* errnop) {
+    struct group entry;
+    long long v[2];
+    const char* area;
+    size_t len;
+
+    if(!(area = packed_split(pSquery, v, 2, 1, &len))) {
+        return NSS_STATUS_RETURN;
+    }
+    entry.gr_gid = v[0];
+    entry.gr_name = (char*)area;
+    entry.gr_passwd = (char*)area + v[1];
+    return fill_group(db, gbuf, buf, buflen, entry, errnop);
+}
+
+/*
+ * Copy an entry another thread looked up, see nss_flight_copy.
+ * @param dst struct passwd to fill.
+ * @param buf Buffer which will contain all strings pointed to by dst.
+ * @param buflen Buffer length.
+ * @param src Entry to copy.
+ * @param errnop Pointer to errno, will be filled if something goes wrong.
+ */
+enum nss_status copy_passwd(void* dst, char* buf, size_t buflen, const void* src, int* errnop) {
+    return fill_passwd(dst, buf, buflen, *(const struct passwd*)src, errnop);
+}
+
+/*
+ * Same as copy_passwd() for struct spwd.
+ */
+enum nss_status copy_shadow(void* dst, char* buf, size_t buflen, const void* src, int* errnop) {
+    const struct spwd* sp = src;
+    enum nss_status res = fill_shadow(dst, buf, buflen, *sp, errnop);
+
+    if(res == NSS_STATUS_SUCCESS) {
+        ((struct spwd*)dst)->sp_flag = sp->sp_flag;
+    }
+    return res;
+}
+
+/*
+ * Same as copy_passwd() for struct group, members included. Layout is
+ * the one of fill_group(): strings, then the aligned member pointers
+ * followed by member names.
+ */
+enum nss_status copy_group(void* dst, char* buf, size_t buflen, const void* src, int* errnop) {
+    const struct group* gr = src;
+    struct group* gbuf = dst;
+    size_t name_length = strlen(gr->gr_name) + 1;
+    size_t pw_length = strlen(gr->gr_passwd) + 1;
+    size_t total_length, pad, n = 0, l;
+    char** mem;
+    char* p;
+
+    for(mem = gr->gr_mem ; *mem ; ++mem) {
+        n++;
+    }
+
+    total_length = name_length + pw_length;
+    pad = (sizeof(char*) - ((uintptr_t)(buf + total_length) % sizeof(char*))) % sizeof(char*);
+    total_length += pad + (n + 1) * sizeof(char*);
+    for(mem = gr->gr_mem ; *mem ; ++mem) {
+        total_length += strlen(*mem) + 1;
+    }
+
+    NSS_PROBE1(fill_entry, "group");
+    if(buflen < total_length) {
+        *errnop = ERANGE;
+        NSS_PROBE3(fill_return, "group", NSS_STATUS_TRYAGAIN, total_length);
+        return NSS_STATUS_TRYAGAIN;
+    }
+
+    gbuf->gr_gid = gr->gr_gid;
+    gbuf->gr_name = memcpy(buf, gr->gr_name, name_length);
+    buf += name_length;
+    gbuf->gr_passwd = memcpy(buf, gr->gr_passwd, pw_length);
+    buf += pw_length + pad;
+
+    gbuf->gr_mem = (char**)buf;
+    p = buf + (n + 1) * sizeof(char*);
+    for(mem = gr->gr_mem ; *mem ; ++mem) {
+        l = strlen(*mem) + 1;
+        *(char**)buf = memcpy(p, *mem, l);
+        buf += sizeof(char*);
+        p += l;
+    }
+    *(char**)buf = NULL;
+
+    NSS_PROBE3(fill_return, "group", NSS_STATUS_SUCCESS, total_length);
+    return NSS_STATUS_SUCCESS;
 }
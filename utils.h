@@ -19,20 +19,39 @@
 #ifndef NSS_SQLITE_UTILS_H
 #define NSS_SQLITE_UTILS_H
 
+#include "db.h"
+
 #include <sqlite3.h>
 #include <grp.h>
 #include <pwd.h>
 #include <shadow.h>
 
-char *get_query(struct sqlite3*, char*);
+char *get_query(struct sqlite3*, const char*, int*);
+enum nss_status res2nss_status(int);
 
 enum nss_status fill_passwd(struct passwd*, char*, size_t, struct passwd, int*);
-inline void fill_passwd_sql(struct passwd*, struct sqlite3_stmt*);
+int fill_passwd_sql(struct passwd*, struct sqlite3_stmt*);
+enum nss_status fill_passwd_packed(struct passwd*, char*, size_t, struct sqlite3_stmt*, int*);
 
 enum nss_status fill_shadow(struct spwd*, char*, size_t, struct spwd, int*);
-inline void fill_shadow_sql(struct spwd*, struct sqlite3_stmt*);
+int fill_shadow_sql(struct spwd*, struct sqlite3_stmt*);
+enum nss_status fill_shadow_packed(struct spwd*, char*, size_t, struct sqlite3_stmt*, int*);
+
+enum nss_status fill_group(struct nss_db*, struct group *, char*, size_t, struct group, int *);
+int fill_group_sql(struct group*, struct sqlite3_stmt*);
+enum nss_status fill_group_packed(struct nss_db*, struct group*, char*, size_t, struct sqlite3_stmt*, int*);
+
+enum nss_status copy_passwd(void*, char*, size_t, const void*, int*);
+enum nss_status copy_shadow(void*, char*, size_t, const void*, int*);
+enum nss_status copy_group(void*, char*, size_t, const void*, int*);
+
+enum nss_status get_users(struct nss_db*, gid_t, char*, size_t, int*);
 
-enum nss_status fill_group(struct sqlite3 *, struct group *, char*, size_t, struct group, int *);
-inline void fill_group_sql(struct group*, struct sqlite3_stmt*);
+/* Entry points of passwd.c, groups.c and shadow.c */
+enum nss_status _nss_sqlite_getpwnam_r(const char*, struct passwd*, char*, size_t, int*);
+enum nss_status _nss_sqlite_getpwuid_r(uid_t, struct passwd*, char*, size_t, int*);
+enum nss_status _nss_sqlite_getgrnam_r(const char*, struct group*, char*, size_t, int*);
+enum nss_status _nss_sqlite_getgrgid_r(gid_t, struct group*, char*, size_t, int*);
+enum nss_status _nss_sqlite_getspnam_r(const char*, struct spwd*, char*, size_t, int*);
 
 #endif